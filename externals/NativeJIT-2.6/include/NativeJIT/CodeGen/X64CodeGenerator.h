@@ -28,6 +28,7 @@
 // http://felixcloutier.com/x86/
 
 #include <ostream>                              // Debugging output.
+#include <string>                               // Packed instruction operands output.
 
 #include "NativeJIT/BitOperations.h"
 #include "NativeJIT/CodeGen/CodeBuffer.h"       // Inherits from CodeBuffer.
@@ -80,6 +81,7 @@ namespace NativeJIT
     {
         Add,
         And,
+        AndNot,     // Floating point only: dest = ~dest & src.
         Bsf,
         Bsr,
         Bt,
@@ -88,13 +90,17 @@ namespace NativeJIT
         Bts,
         Call,
         Cmp,
+        CmpMask,    // Floating point only, see CompareType.
         CvtFP2FP,
         CvtFP2SI,
         CvtSI2FP,
         Dec,
+        Div,        // Floating point only.
         IMul,
         Inc,
         Lea,
+        Max,        // Floating point only.
+        Min,        // Floating point only.
         Mov,
         MovSX,
         MovZX,
@@ -108,9 +114,11 @@ namespace NativeJIT
         Rep,
         Ret,
         Rol,
+        Round,      // Floating point only, requires SSE4.1.
         Shl,        // Note: Shl and Sal are aliases, unlike Shr and Sar.
         Shld,
         Shr,
+        Sqrt,       // Floating point only.
         Stosq,
         Sub,
         Xor,
@@ -128,6 +136,64 @@ namespace NativeJIT
     };
 
 
+    // Rounding modes of the RoundSS/RoundSD instructions.
+    enum class RoundingMode : uint8_t
+    {
+        Nearest = 0,    // Round half to even.
+        Floor = 1,
+        Ceil = 2,
+        Truncate = 3
+    };
+
+
+    // Predicates of the CmpSS/CmpSD and the packed compare instructions,
+    // which set the destination bits to all ones if the comparison is true
+    // and to zero otherwise. NaN compares unordered, so only NotEqual,
+    // NotLess, NotLessEqual and Unordered are true for it.
+    enum class CompareType : uint8_t
+    {
+        Equal = 0,
+        Less = 1,
+        LessEqual = 2,
+        Unordered = 3,
+        NotEqual = 4,
+        NotLess = 5,
+        NotLessEqual = 6,
+        Ordered = 7
+    };
+
+
+    // Packed double precision instructions. The values are the opcode bytes
+    // in the 0F opcode map, which is shared by the SSE, VEX and EVEX forms.
+    // WARNING: When modifying PackedOpCode, be sure to also modify the
+    // function PackedOpCodeName().
+    // The bitwise And, AndNot and Or are encoded as vpandq/vpandnq/vporq for
+    // zmm, since vandpd/vandnpd/vorpd with EVEX prefix require AVX-512DQ.
+    enum class PackedOpCode : uint8_t
+    {
+        Sqrt = 0x51,
+        And = 0x54,
+        AndNot = 0x55,  // dest = ~src1 & src2.
+        Or = 0x56,
+        Add = 0x58,
+        Mul = 0x59,
+        Sub = 0x5c,
+        Min = 0x5d,
+        Div = 0x5e,
+        Max = 0x5f
+    };
+
+
+    // Width of the vector registers used by the packed instructions. Ymm
+    // instructions are VEX encoded and require AVX, Zmm instructions are
+    // EVEX encoded and require AVX-512F.
+    enum class VectorWidth : unsigned
+    {
+        Ymm,
+        Zmm
+    };
+
+
     class X64CodeGenerator : public CodeBuffer
     {
     public:
@@ -152,6 +218,7 @@ namespace NativeJIT
         // These two methods are public in order to allow access for BinaryNode debugging text.
         static char const * OpCodeName(OpCode op);
         static char const * JccName(JccType jcc);
+        static char const * PackedOpCodeName(PackedOpCode op, VectorWidth width);
 
         //
         // X64 opcode emit methods.
@@ -233,6 +300,67 @@ namespace NativeJIT
         template <OpCode OP, unsigned SIZE, bool ISFLOAT, typename T>
         void EmitImmediate(Register<SIZE, ISFLOAT> dest, Register<SIZE, ISFLOAT> src, T value);
 
+        //
+        // Packed double precision vector instructions.
+        //
+        // Vector registers are specified by their number: 0-15 for ymm and
+        // 0-31 for zmm registers. The registers are not tracked by the
+        // register allocator, so the caller is responsible for their use.
+        // Memory operands don't need to be aligned.
+        //
+
+        // Three register operands: dest = src1 op src2. Sqrt ignores src1.
+        void EmitPacked(PackedOpCode op,
+                        VectorWidth width,
+                        unsigned dest,
+                        unsigned src1,
+                        unsigned src2);
+
+        // Rounds the elements of src to integral values (vroundpd for ymm,
+        // vrndscalepd for zmm). The mode is the roundsd immediate.
+        void EmitPackedRound(VectorWidth width,
+                             unsigned dest,
+                             unsigned src,
+                             uint8_t mode);
+
+        // Sets the elements of dest to all ones where the comparison of the
+        // src1 and src2 elements is true, and to zero elsewhere (vcmppd). The
+        // zmm form compares into the k1 opmask register, which is then
+        // expanded into dest with vpternlogq.
+        void EmitPackedCompare(VectorWidth width,
+                               unsigned dest,
+                               unsigned src1,
+                               unsigned src2,
+                               CompareType type);
+
+        // Vector load from [base + index * scale + offset] (vmovupd).
+        void EmitPackedLoad(VectorWidth width,
+                            unsigned dest,
+                            Register<8, false> base,
+                            Register<8, false> index,
+                            SIB scale,
+                            int32_t offset);
+
+        // Vector store to [base + index * scale + offset] (vmovupd).
+        void EmitPackedStore(VectorWidth width,
+                             Register<8, false> base,
+                             Register<8, false> index,
+                             SIB scale,
+                             int32_t offset,
+                             unsigned src);
+
+        // Loads a double from [base + offset] into all vector elements
+        // (vbroadcastsd). With rip as the base, the offset is the position of
+        // the value in the code buffer, as for the other RIP-relative operands.
+        void EmitPackedBroadcast(VectorWidth width,
+                                 unsigned dest,
+                                 Register<8, false> base,
+                                 int32_t offset);
+
+        // Clears the upper bits of the vector registers to avoid the AVX to
+        // SSE transition penalty when returning to the non-VEX code.
+        void EmitVZeroUpper();
+
     private:
         void Call(Register<8, false> r);
 
@@ -288,6 +416,14 @@ namespace NativeJIT
         template <unsigned SIZE>
         void Shld(Register<SIZE, false> dest, Register<SIZE, false> src);
 
+        // RoundSS/RoundSD (SSE4.1), encoded as 66 0F 3A 0A/0B ib.
+        template <unsigned SIZE>
+        void Round(Register<SIZE, true> dest, Register<SIZE, true> src, uint8_t mode);
+
+        // CmpSS/CmpSD, encoded as F3/F2 0F C2 ib.
+        template <unsigned SIZE>
+        void CmpMask(Register<SIZE, true> dest, Register<SIZE, true> src, uint8_t type);
+
         // Scalar SSE instructions are encoded as XX 0F OPCODE, where XX is
         // either 0xF2 or 0xF3 depending on the register size. Used for
         // instructions operating on scalars (f. ex. MovSS/SD, AddSS/SD) rather
@@ -492,6 +628,31 @@ namespace NativeJIT
         template <unsigned SIZE, bool ISFLOAT>
         void EmitModRMOffset(Register<SIZE, ISFLOAT> dest, Register<8, false> src, int32_t srcOffset);
 
+        // Emits the VEX (ymm) or EVEX (zmm) prefix of a packed double
+        // instruction with the implied 0x66 prefix. The map is 1 for the 0F,
+        // 2 for the 0F38 and 3 for the 0F3A opcode map. For the memory operands rm is the
+        // base register and index is the SIB index register. A non-zero
+        // opmask selects the k1-k7 register with zeroing-masking (zmm only).
+        void EmitPackedPrefix(VectorWidth width,
+                              uint8_t map,
+                              unsigned reg,
+                              unsigned vvvv,
+                              unsigned rm,
+                              unsigned index,
+                              bool isMemory,
+                              unsigned opmask = 0);
+
+        // Emits the ModR/M, SIB and displacement of a packed instruction
+        // memory operand. The EVEX instructions scale 8-bit displacements by
+        // the size of the memory operand, which is passed as disp8Scale.
+        void EmitPackedModRMOffset(unsigned reg,
+                                   Register<8, false> base,
+                                   bool hasIndex,
+                                   Register<8, false> index,
+                                   SIB scale,
+                                   int32_t offset,
+                                   int32_t disp8Scale);
+
         // Helper class used to provide partial specializations by OpCode,
         // ISFLOAT and SIZE for the Emit() methods.
         template <OpCode OP>
@@ -642,6 +803,13 @@ namespace NativeJIT
             template <unsigned SIZE, bool ISFLOAT, typename T>
             void PrintImmediate(OpCode op, Register<SIZE, ISFLOAT> dest, Register<SIZE, ISFLOAT> src, T value);
 
+            // Used by the packed vector instructions which are not described
+            // by an OpCode. Operands are printed as they are.
+            void Print(char const * mnemonic, std::string const & operands);
+
+            // Returns the name of a ymm or zmm register.
+            static std::string GetVectorRegisterName(VectorWidth width, unsigned id);
+
         private:
             X64CodeGenerator& m_code;
             unsigned m_startPosition;
@@ -1462,6 +1630,33 @@ namespace NativeJIT
     }
 
 
+    template <unsigned SIZE>
+    void X64CodeGenerator::Round(Register<SIZE, true> dest, Register<SIZE, true> src, uint8_t mode)
+    {
+        // Unlike the SSEx66 instructions, the 0x66 prefix is mandatory and
+        // the register size is selected by the opcode.
+        Emit8(0x66);
+        EmitRexDirect(dest, src);
+        Emit8(0x0f);
+        Emit8(0x3a);
+        Emit8(SIZE == 8 ? 0x0b : 0x0a);
+        EmitModRM(dest, src);
+        Emit8(mode);
+    }
+
+
+    template <unsigned SIZE>
+    void X64CodeGenerator::CmpMask(Register<SIZE, true> dest, Register<SIZE, true> src, uint8_t type)
+    {
+        Emit8(SIZE == 8 ? 0xf2 : 0xf3);
+        EmitRexDirect(dest, src);
+        Emit8(0x0f);
+        Emit8(0xc2);
+        EmitModRM(dest, src);
+        Emit8(type);
+    }
+
+
     //
     // Scalar SSE instructions
     //
@@ -2699,6 +2894,40 @@ namespace NativeJIT
     }
 
 
+    //
+    // Round
+    //
+
+    template <>
+    template <>
+    template <unsigned SIZE, typename T>
+    void X64CodeGenerator::Helper<OpCode::Round>::ArgTypes1<true>::EmitImmediate(
+        X64CodeGenerator& code,
+        Register<SIZE, true> dest,
+        Register<SIZE, true> src,
+        T mode)
+    {
+        code.Round(dest, src, mode);
+    }
+
+
+    //
+    // CmpMask
+    //
+
+    template <>
+    template <>
+    template <unsigned SIZE, typename T>
+    void X64CodeGenerator::Helper<OpCode::CmpMask>::ArgTypes1<true>::EmitImmediate(
+        X64CodeGenerator& code,
+        Register<SIZE, true> dest,
+        Register<SIZE, true> src,
+        T type)
+    {
+        code.CmpMask(dest, src, static_cast<uint8_t>(type));
+    }
+
+
 #define DEFINE_GROUP1(name, baseOpCode, extensionOpCode) \
     template <>                                                                                 \
     template <>                                                                                 \
@@ -2846,14 +3075,24 @@ namespace NativeJIT
     }                                                                                   \
 
     DEFINE_SSE_ARGS1(Add,            ScalarSSE, 0x58);  // AddSS/AddSD.
+    DEFINE_SSE_ARGS1(And,            SSEx66,    0x54);  // AndPS/AndPD.
+    DEFINE_SSE_ARGS1(AndNot,         SSEx66,    0x55);  // AndNPS/AndNPD.
     DEFINE_SSE_ARGS1(Cmp,            SSEx66,    0x2f);  // ComISS/ComISD.
+    DEFINE_SSE_ARGS1(Div,            ScalarSSE, 0x5e);  // DivSS/DivSD.
     DEFINE_SSE_ARGS1(IMul,           ScalarSSE, 0x59);  // MulSS/MulSD.
+    DEFINE_SSE_ARGS1(Max,            ScalarSSE, 0x5f);  // MaxSS/MaxSD.
+    DEFINE_SSE_ARGS1(Min,            ScalarSSE, 0x5d);  // MinSS/MinSD.
     DEFINE_SSE_ARGS1(Mov,            ScalarSSE, 0x10);  // MovSS/MovSD.
     DEFINE_SSE_ARGS1(MovAP,          SSEx66,    0x28);  // MovAPS/MovAPD.
+    DEFINE_SSE_ARGS1(Or,             SSEx66,    0x56);  // OrPS/OrPD.
+    DEFINE_SSE_ARGS1(Sqrt,           ScalarSSE, 0x51);  // SqrtSS/SqrtSD.
     DEFINE_SSE_ARGS1(Sub,            ScalarSSE, 0x5c);  // SubSS/SubSD.
 
 #undef DEFINE_SSE_ARGS1
 
+    // Note: the memory operands of AndPS/PD, AndNPS/PD and OrPS/PD are 128 bits wide and,
+    // like the ones of MovAPS/PD, must be 16-byte aligned.
+
     // Unlike others, MovAPS/MovAPD also have the "mov [rxx + 16], xmm" form
     // of the instruction with a different opcode.
     template <>
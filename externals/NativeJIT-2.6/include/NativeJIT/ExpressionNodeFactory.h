@@ -38,17 +38,24 @@
 #include "NativeJIT/Nodes/BinaryNode.h"
 #include "NativeJIT/Nodes/CallNode.h"
 #include "NativeJIT/Nodes/CastNode.h"
+#include "NativeJIT/Nodes/CompareMaskNode.h"
 #include "NativeJIT/Nodes/ConditionalNode.h"
 #include "NativeJIT/Nodes/DependentNode.h"
 #include "NativeJIT/Nodes/FieldPointerNode.h"
 #include "NativeJIT/Nodes/ImmediateNode.h"
 #include "NativeJIT/Nodes/IndirectNode.h"
+#include "NativeJIT/Nodes/LoopNode.h"
+#include "NativeJIT/Nodes/MemoNode.h"
 #include "NativeJIT/Nodes/Node.h"
 #include "NativeJIT/Nodes/PackedMinMaxNode.h"
 #include "NativeJIT/Nodes/ParameterNode.h"
 #include "NativeJIT/Nodes/ReturnNode.h"
+#include "NativeJIT/Nodes/RoundNode.h"
+#include "NativeJIT/Nodes/SequenceNode.h"
 #include "NativeJIT/Nodes/ShldNode.h"
 #include "NativeJIT/Nodes/StackVariableNode.h"
+#include "NativeJIT/Nodes/StoreNode.h"
+#include "NativeJIT/Nodes/UnaryNode.h"
 #include "Temporary/Allocator.h"
 
 
@@ -198,6 +205,33 @@ namespace NativeJIT
     }
 
 
+    template <typename T>
+    Node<T>& ExpressionNodeFactory::Store(Node<T*>& address,
+                                          int32_t offset,
+                                          Node<T>& value)
+    {
+        return PlacementConstruct<StoreNode<T>>(*this, address, offset, value);
+    }
+
+
+    template <typename L, typename R>
+    Node<R>& ExpressionNodeFactory::Sequence(Node<L>& first, Node<R>& second)
+    {
+        return PlacementConstruct<SequenceNode<L, R>>(*this, first, second);
+    }
+
+
+    template <typename T>
+    Node<T>& ExpressionNodeFactory::Memo(T (*function)(),
+                                         T* value,
+                                         uint64_t const * const * counters,
+                                         uint64_t* copies,
+                                         unsigned count)
+    {
+        return PlacementConstruct<MemoNode<T>>(*this, function, value, counters, copies, count);
+    }
+
+
     //
     // Binary arithmetic operators
     //
@@ -215,6 +249,14 @@ namespace NativeJIT
     }
 
 
+    template <typename L, typename R>
+    Node<L>& ExpressionNodeFactory::AndNot(Node<L>& left, Node<R>& right)
+    {
+        static_assert(std::is_floating_point<L>::value, "AndNot is only supported for floating point types.");
+        return Binary<OpCode::AndNot>(left, right);
+    }
+
+
     template <typename L, typename R>
     Node<L>& ExpressionNodeFactory::Sub(Node<L>& left, Node<R>& right)
     {
@@ -222,6 +264,15 @@ namespace NativeJIT
     }
 
 
+    template <typename L, typename R>
+    Node<L>& ExpressionNodeFactory::Div(Node<L>& left, Node<R>& right)
+    {
+        // Integer division uses fixed registers (rdx:rax) and isn't supported.
+        static_assert(std::is_floating_point<L>::value, "Div is only supported for floating point types.");
+        return Binary<OpCode::Div>(left, right);
+    }
+
+
     template <typename L, typename R>
     Node<L>& ExpressionNodeFactory::Mul(Node<L>& left, Node<R>& right)
     {
@@ -295,6 +346,48 @@ namespace NativeJIT
     }
 
 
+    //
+    // Floating point operators
+    //
+    template <typename T>
+    Node<T>& ExpressionNodeFactory::Max(Node<T>& left, Node<T>& right)
+    {
+        // Note: MaxSD returns the right operand if either of them is NaN.
+        static_assert(std::is_floating_point<T>::value, "Max is only supported for floating point types.");
+        return Binary<OpCode::Max>(left, right);
+    }
+
+
+    template <typename T>
+    Node<T>& ExpressionNodeFactory::Min(Node<T>& left, Node<T>& right)
+    {
+        // Note: MinSD returns the right operand if either of them is NaN.
+        static_assert(std::is_floating_point<T>::value, "Min is only supported for floating point types.");
+        return Binary<OpCode::Min>(left, right);
+    }
+
+
+    template <typename T>
+    Node<T>& ExpressionNodeFactory::Sqrt(Node<T>& value)
+    {
+        return PlacementConstruct<UnaryNode<OpCode::Sqrt, T>>(*this, value);
+    }
+
+
+    template <typename T>
+    Node<T>& ExpressionNodeFactory::Round(Node<T>& value, RoundingMode mode)
+    {
+        return PlacementConstruct<RoundNode<T>>(*this, value, mode);
+    }
+
+
+    template <typename T>
+    Node<T>& ExpressionNodeFactory::CompareMask(Node<T>& left, Node<T>& right, CompareType type)
+    {
+        return PlacementConstruct<CompareMaskNode<T>>(*this, left, right, type);
+    }
+
+
     template <typename T, typename INDEX>
     Node<T*>& ExpressionNodeFactory::Add(Node<T*>& array, Node<INDEX>& index)
     {
@@ -419,6 +512,29 @@ namespace NativeJIT
     }
 
 
+    //
+    // Loops
+    //
+    template <typename T>
+    LoopVariableNode<T>& ExpressionNodeFactory::LoopVariable()
+    {
+        return PlacementConstruct<LoopVariableNode<T>>(*this);
+    }
+
+
+    template <typename T, typename CONTEXT>
+    Node<uint64_t>& ExpressionNodeFactory::Loop(LoopVariableNode<uint64_t>& offset,
+                                                LoopVariableNode<CONTEXT>& context,
+                                                Node<T>& body,
+                                                Node<T*>& output,
+                                                Node<uint64_t>& count,
+                                                Node<CONTEXT>& contextValue)
+    {
+        return PlacementConstruct<LoopNode<T, CONTEXT>>(
+            *this, offset, context, body, output, count, contextValue);
+    }
+
+
     //
     // PackedMinMax
     //
@@ -36,6 +36,9 @@ namespace NativeJIT
     template <JccType JCC>
     class FlagExpressionNode;
 
+    template <typename T>
+    class LoopVariableNode;
+
     template <typename T>
     class Node;
 
@@ -104,12 +107,31 @@ namespace NativeJIT
 
         template <typename T> NodeBase& Return(Node<T>& value);
 
+        // Stores the value at [address + offset] and returns it. See
+        // SequenceNode for evaluating the stores whose values are not used.
+        template <typename T> Node<T>& Store(Node<T*>& address,
+                                             int32_t offset,
+                                             Node<T>& value);
+
+        template <typename L, typename R> Node<R>& Sequence(Node<L>& first,
+                                                            Node<R>& second);
+
+        // Value of a function called again only once any of the counters
+        // has changed, see MemoNode.
+        template <typename T> Node<T>& Memo(T (*function)(),
+                                            T* value,
+                                            uint64_t const * const * counters,
+                                            uint64_t* copies,
+                                            unsigned count);
+
 
         //
         // Binary arithmetic operators
         //
         template <typename L, typename R> Node<L>& Add(Node<L>& left, Node<R>& right);
         template <typename L, typename R> Node<L>& And(Node<L>& left, Node<R>& right);
+        template <typename L, typename R> Node<L>& AndNot(Node<L>& left, Node<R>& right);
+        template <typename L, typename R> Node<L>& Div(Node<L>& left, Node<R>& right);
         template <typename L, typename R> Node<L>& Mul(Node<L>& left, Node<R>& right);
         template <typename L, typename R> Node<L>& MulImmediate(Node<L>& left, R right);
         template <typename L, typename R> Node<L>& Or(Node<L>& left, Node<R>& right);
@@ -128,6 +150,19 @@ namespace NativeJIT
         template <typename T>
         Node<T>& Shld(Node<T>& shiftee, Node<T>& filler, uint8_t bitCount);
 
+        //
+        // Floating point operators
+        //
+        template <typename T> Node<T>& Max(Node<T>& left, Node<T>& right);
+        template <typename T> Node<T>& Min(Node<T>& left, Node<T>& right);
+        template <typename T> Node<T>& Sqrt(Node<T>& value);
+
+        // Requires SSE4.1, which is not checked.
+        template <typename T> Node<T>& Round(Node<T>& value, RoundingMode mode);
+
+        // All bits set if the comparison is true, cleared otherwise.
+        template <typename T> Node<T>& CompareMask(Node<T>& left, Node<T>& right, CompareType type);
+
         //
         // Model related.
         //
@@ -189,6 +224,22 @@ namespace NativeJIT
                       Node<P3>& param3,
                       Node<P4>& param4);
 
+        //
+        // Loops
+        //
+
+        // See LoopNode for the rules on the order in which the loop variables,
+        // the body and the loop itself need to be created.
+        template <typename T> LoopVariableNode<T>& LoopVariable();
+
+        template <typename T, typename CONTEXT>
+        Node<uint64_t>& Loop(LoopVariableNode<uint64_t>& offset,
+                             LoopVariableNode<CONTEXT>& context,
+                             Node<T>& body,
+                             Node<T*>& output,
+                             Node<uint64_t>& count,
+                             Node<CONTEXT>& contextValue);
+
         //
         // Packed operators
         //
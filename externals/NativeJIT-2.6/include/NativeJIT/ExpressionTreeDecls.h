@@ -26,6 +26,7 @@
 #include <array>                // For arrays in FreeList.
 #include <cstdint>
 #include <iosfwd>               // For debugging output.
+#include <utility>              // For std::pair in loop body ranges.
 
 #include "NativeJIT/AllocatorVector.h"                  // Embedded member.
 #include "NativeJIT/CodeGen/JumpTable.h"                // ExpressionTree embeds Label.
@@ -128,6 +129,18 @@ namespace NativeJIT
 
         void AddRIPRelative(RIPRelativeImmediate& node);
         void ReportFunctionCallNode(unsigned parameterCount);
+
+        // Marks the nodes with IDs in the [firstId, lastId) range as the body
+        // of a loop. Their values change on every iteration, so Pass2 does not
+        // evaluate shared nodes from the range up front. Instead, the loop
+        // calls CodeGenSharedNodes() at the top of each iteration.
+        void AddLoopBody(unsigned firstId, unsigned lastId);
+
+        // Evaluates the nodes with IDs in the [firstId, lastId) range that have
+        // more than one parent and that have not been evaluated yet. This is
+        // the equivalent of Pass2 for a loop body.
+        void CodeGenSharedNodes(unsigned firstId, unsigned lastId);
+
         void Compile();
 
         //
@@ -305,6 +318,10 @@ namespace NativeJIT
         // parameter. Returns false otherwise.
         bool TemporaryOffsetToSlot(int32_t temporaryOffset, unsigned& temporarySlot);
 
+        // Returns whether the node with the specified ID belongs to the body
+        // of a loop registered through AddLoopBody().
+        bool IsInLoopBody(unsigned id) const;
+
         void Pass0();
         void Pass1();
         void Pass2();
@@ -338,6 +355,9 @@ namespace NativeJIT
         // to return early if any of them is not met.
         AllocatorVector<ExecutionPreconditionTest*> m_preconditionTests;
 
+        // The [first, last) node ID ranges of loop bodies. See AddLoopBody().
+        AllocatorVector<std::pair<unsigned, unsigned>> m_loopBodies;
+
         FreeList<RegisterBase::c_maxIntegerRegisterID + 1, false> m_rxxFreeList;
         FreeList<RegisterBase::c_maxFloatRegisterID + 1, true> m_xmmFreeList;
 
@@ -88,6 +88,18 @@ namespace NativeJIT
             CodeGenHelpers::Emit<OP>(tree.GetCodeGenerator(),
                                      sLeft.ConvertToDirect(true), sLeft);
         }
+        else if (std::is_floating_point<L>::value
+                 && (OP == OpCode::And || OP == OpCode::AndNot || OP == OpCode::Or))
+        {
+            // The floating point bitwise operations only have the packed
+            // form whose memory operand must be 16-byte aligned, which is
+            // not guaranteed for the values in memory. Use registers instead.
+            auto leftReg = sLeft.ConvertToDirect(true);
+            ReferenceCounter leftPin = sLeft.GetPin();
+            auto rightReg = sRight.ConvertToDirect(false);
+
+            tree.GetCodeGenerator().Emit<OP>(leftReg, rightReg);
+        }
         else
         {
             CodeGenHelpers::Emit<OP>(tree.GetCodeGenerator(),
@@ -564,8 +564,14 @@ namespace NativeJIT
     void CallNodeBase<R, PARAMETERCOUNT>::ParameterChild<T>::EmitStaging(ExpressionTree& tree,
                                                                          SaveRestoreVolatilesHelper& volatiles)
     {
+        // If the data is shared and already in the result register, it must
+        // be moved to another register as well. Otherwise the register would
+        // be preserved by SaveRestoreVolatilesHelper, and restored over the
+        // return value after the call.
         if (this->m_storage.GetStorageClass() != StorageClass::Direct
-            || !this->m_storage.GetDirectRegister().IsSameHardwareRegister(m_destination))
+            || !this->m_storage.GetDirectRegister().IsSameHardwareRegister(m_destination)
+            || (!this->m_storage.IsSoleDataOwner()
+                && m_destination.IsSameHardwareRegister(tree.GetResultRegister<R>())))
         {
             ExpressionTree::Storage<T> regStorage = tree.Direct<T>(m_destination);
             CodeGenHelpers::Emit<OpCode::Mov>(tree.GetCodeGenerator(), m_destination, this->m_storage);
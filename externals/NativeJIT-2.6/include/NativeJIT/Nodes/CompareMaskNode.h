@@ -0,0 +1,115 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2016, Microsoft
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#pragma once
+
+#include "NativeJIT/CodeGen/X64CodeGenerator.h"     // OpCode type.
+#include "NativeJIT/Nodes/Node.h"
+
+
+namespace NativeJIT
+{
+    // Implements a node for the CMPSD/CMPSS instructions. Unlike the
+    // RelationalOperatorNode which sets the flags, the result is a value
+    // with all the bits set if the comparison is true and cleared otherwise,
+    // which can be combined with the other values by the bitwise operators.
+    template <typename T>
+    class CompareMaskNode : public Node<T>
+    {
+    public:
+        CompareMaskNode(ExpressionTree& tree,
+                        Node<T>& left,
+                        Node<T>& right,
+                        CompareType type);
+
+        virtual Storage<T> CodeGenValue(ExpressionTree& tree) override;
+
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        static_assert(std::is_floating_point<T>::value,
+                      "CompareMaskNode only supports floating point values.");
+
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~CompareMaskNode();
+
+        Node<T>& m_left;
+        Node<T>& m_right;
+        const CompareType m_type;
+    };
+
+
+    //*************************************************************************
+    //
+    // Template definitions for CompareMaskNode
+    //
+    //*************************************************************************
+    template <typename T>
+    CompareMaskNode<T>::CompareMaskNode(ExpressionTree& tree,
+                                        Node<T>& left,
+                                        Node<T>& right,
+                                        CompareType type)
+        : Node<T>(tree),
+          m_left(left),
+          m_right(right),
+          m_type(type)
+    {
+        m_left.IncrementParentCount();
+        m_right.IncrementParentCount();
+    }
+
+
+    template <typename T>
+    Storage<T> CompareMaskNode<T>::CodeGenValue(ExpressionTree& tree)
+    {
+        Storage<T> sLeft;
+        Storage<T> sRight;
+
+        this->CodeGenInOrder(tree,
+                             m_left, sLeft,
+                             m_right, sRight);
+
+        auto leftReg = sLeft.ConvertToDirect(true);
+        ReferenceCounter leftPin = sLeft.GetPin();
+        auto rightReg = (sLeft == sRight) ? leftReg : sRight.ConvertToDirect(false);
+
+        tree.GetCodeGenerator().EmitImmediate<OpCode::CmpMask>(
+            leftReg, rightReg, static_cast<uint8_t>(m_type));
+
+        return sLeft;
+    }
+
+
+    template <typename T>
+    void CompareMaskNode<T>::Print(std::ostream& out) const
+    {
+        this->PrintCoreProperties(out, "CompareMask");
+
+        out << ", left = " << m_left.GetId()
+            << ", right = " << m_right.GetId()
+            << ", type = " << static_cast<unsigned>(m_type);
+    }
+}
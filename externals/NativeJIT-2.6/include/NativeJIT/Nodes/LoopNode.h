@@ -0,0 +1,362 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2016, Microsoft
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>    // For std::min.
+#include <cstdint>
+
+#include "NativeJIT/CodeGen/X64CodeGenerator.h"
+#include "NativeJIT/ExpressionTree.h"
+#include "NativeJIT/Nodes/Node.h"
+
+
+namespace NativeJIT
+{
+    // A value that is owned by a LoopNode and that can be referenced by the
+    // nodes of the loop body, f. ex. the offset of the current element. The
+    // value lives in a stack slot for the duration of the loop and every
+    // evaluation loads it into a fresh register, so the body is free to
+    // modify or spill the result without affecting the loop itself.
+    template <typename T>
+    class LoopVariableNode : public Node<T>
+    {
+    public:
+        LoopVariableNode(ExpressionTree& tree);
+
+        // Called by the owning LoopNode before the loop body is evaluated.
+        void SetStorage(Storage<T> const & storage);
+
+        //
+        // Overrides of Node methods
+        //
+
+        virtual bool CanBeOptimizedAway() const override;
+        virtual Storage<T> CodeGenValue(ExpressionTree& tree) override;
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~LoopVariableNode();
+
+        Storage<T> m_storage;
+    };
+
+
+    // Evaluates the body once for each of the first count elements of the
+    // output array and stores the results there. Returns the count.
+    //
+    // The loop body consists of all the nodes created after the first of the
+    // two loop variables and before the LoopNode itself. Inside the body, the
+    // offset variable holds the byte offset of the current element (i.e. the
+    // element index multiplied by sizeof(T)) and the context variable holds the
+    // value of the contextValue node. The output, count and contextValue nodes
+    // are evaluated once before the loop and must therefore be created before
+    // the loop variables.
+    //
+    // Shared nodes from the body are evaluated at the top of every iteration
+    // rather than in Pass2. Values from outside the loop are kept in stack
+    // slots so that no register is live across the back edge: the register
+    // allocation state at the end of the body must match the one at its start.
+    template <typename T, typename CONTEXT>
+    class LoopNode : public Node<uint64_t>
+    {
+    public:
+        LoopNode(ExpressionTree& tree,
+                 LoopVariableNode<uint64_t>& offset,
+                 LoopVariableNode<CONTEXT>& context,
+                 Node<T>& body,
+                 Node<T*>& output,
+                 Node<uint64_t>& count,
+                 Node<CONTEXT>& contextValue);
+
+        //
+        // Overrides of Node methods
+        //
+
+        virtual Storage<uint64_t> CodeGenValue(ExpressionTree& tree) override;
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~LoopNode();
+
+        // Stores the value into a newly allocated temporary and returns the
+        // temporary.
+        template <typename U>
+        static Storage<U> MoveToTemporary(ExpressionTree& tree, Storage<U> value);
+
+        // Returns a direct storage with a copy of the temporary's value.
+        template <typename U>
+        static Storage<U> Load(ExpressionTree& tree, Storage<U> const & temporary);
+
+        LoopVariableNode<uint64_t>& m_offset;
+        LoopVariableNode<CONTEXT>& m_context;
+        Node<T>& m_body;
+        Node<T*>& m_output;
+        Node<uint64_t>& m_count;
+        Node<CONTEXT>& m_contextValue;
+
+        // ID of the first node of the loop body.
+        unsigned m_firstBodyId;
+    };
+
+
+    //*************************************************************************
+    //
+    // Template definitions for LoopVariableNode
+    //
+    //*************************************************************************
+    template <typename T>
+    LoopVariableNode<T>::LoopVariableNode(ExpressionTree& tree)
+        : Node<T>(tree)
+    {
+    }
+
+
+    template <typename T>
+    void LoopVariableNode<T>::SetStorage(Storage<T> const & storage)
+    {
+        m_storage = storage;
+    }
+
+
+    template <typename T>
+    bool LoopVariableNode<T>::CanBeOptimizedAway() const
+    {
+        // The variable is owned by its loop even if the body does not use it.
+        return false;
+    }
+
+
+    template <typename T>
+    typename ExpressionTree::Storage<T> LoopVariableNode<T>::CodeGenValue(ExpressionTree& tree)
+    {
+        LogThrowAssert(!m_storage.IsNull(),
+                       "Loop variable %u used outside of its loop",
+                       this->GetId());
+
+        // Do not hand out copies of m_storage: converting a shared indirect
+        // storage to direct would convert all of its owners, including the
+        // loop's own reference to the stack slot.
+        auto result = tree.Direct<T>();
+        tree.GetCodeGenerator().template Emit<OpCode::Mov>(result.GetDirectRegister(),
+                                                           m_storage.GetBaseRegister(),
+                                                           m_storage.GetOffset());
+        return result;
+    }
+
+
+    template <typename T>
+    void LoopVariableNode<T>::Print(std::ostream& out) const
+    {
+        this->PrintCoreProperties(out, "LoopVariableNode");
+
+        if (!m_storage.IsNull())
+        {
+            out << ", offset " << m_storage.GetOffset()
+                << " off " << m_storage.GetBaseRegister().GetName();
+        }
+        else
+        {
+            out << ", storage not yet assigned";
+        }
+    }
+
+
+    //*************************************************************************
+    //
+    // Template definitions for LoopNode
+    //
+    //*************************************************************************
+    template <typename T, typename CONTEXT>
+    LoopNode<T, CONTEXT>::LoopNode(ExpressionTree& tree,
+                                   LoopVariableNode<uint64_t>& offset,
+                                   LoopVariableNode<CONTEXT>& context,
+                                   Node<T>& body,
+                                   Node<T*>& output,
+                                   Node<uint64_t>& count,
+                                   Node<CONTEXT>& contextValue)
+        : Node<uint64_t>(tree),
+          m_offset(offset),
+          m_context(context),
+          m_body(body),
+          m_output(output),
+          m_count(count),
+          m_contextValue(contextValue),
+          m_firstBodyId((std::min)(offset.GetId(), context.GetId()))
+    {
+        LogThrowAssert(m_body.GetId() >= m_firstBodyId,
+                       "Body of the loop %u must be created after the loop variables",
+                       GetId());
+        LogThrowAssert(m_output.GetId() < m_firstBodyId
+                       && m_count.GetId() < m_firstBodyId
+                       && m_contextValue.GetId() < m_firstBodyId,
+                       "Parameters of the loop %u must be created before the loop variables",
+                       GetId());
+
+        m_body.IncrementParentCount();
+        m_output.IncrementParentCount();
+        m_count.IncrementParentCount();
+        m_contextValue.IncrementParentCount();
+
+        // The loop variables are used through SetStorage() rather than
+        // CodeGen() and it is legal for the body not to use them at all.
+        m_offset.MarkReferenced();
+        m_context.MarkReferenced();
+
+        tree.AddLoopBody(m_firstBodyId, GetId());
+    }
+
+
+    template <typename T, typename CONTEXT>
+    template <typename U>
+    typename ExpressionTree::Storage<U>
+    LoopNode<T, CONTEXT>::MoveToTemporary(ExpressionTree& tree, Storage<U> value)
+    {
+        auto temporary = tree.Temporary<U>();
+        auto reg = value.ConvertToDirect(false);
+
+        tree.GetCodeGenerator().template Emit<OpCode::Mov>(temporary.GetBaseRegister(),
+                                                           temporary.GetOffset(),
+                                                           reg);
+        return temporary;
+    }
+
+
+    template <typename T, typename CONTEXT>
+    template <typename U>
+    typename ExpressionTree::Storage<U>
+    LoopNode<T, CONTEXT>::Load(ExpressionTree& tree, Storage<U> const & temporary)
+    {
+        auto result = tree.Direct<U>();
+
+        tree.GetCodeGenerator().template Emit<OpCode::Mov>(result.GetDirectRegister(),
+                                                           temporary.GetBaseRegister(),
+                                                           temporary.GetOffset());
+        return result;
+    }
+
+
+    template <typename T, typename CONTEXT>
+    typename ExpressionTree::Storage<uint64_t> LoopNode<T, CONTEXT>::CodeGenValue(ExpressionTree& tree)
+    {
+        static_assert(sizeof(T) <= INT32_MAX, "Unsupported element type");
+
+        X64CodeGenerator& code = tree.GetCodeGenerator();
+
+        Label loopStart = code.AllocateLabel();
+        Label loopEnd = code.AllocateLabel();
+
+        // Evaluate the loop invariants up front and move them to the stack.
+        auto output = MoveToTemporary(tree, m_output.CodeGen(tree));
+        auto count = MoveToTemporary(tree, m_count.CodeGen(tree));
+        auto context = MoveToTemporary(tree, m_contextValue.CodeGen(tree));
+
+        // Byte offset of the end of the output. The loop stops when the offset
+        // of the current element reaches it.
+        Storage<uint64_t> end;
+        {
+            auto value = Load(tree, count);
+            code.EmitImmediate<OpCode::IMul>(value.GetDirectRegister(),
+                                             static_cast<int32_t>(sizeof(T)));
+            end = MoveToTemporary(tree, value);
+        }
+
+        // Start at offset zero and skip the loop altogether if it is empty.
+        auto offset = tree.Temporary<uint64_t>();
+        {
+            auto zero = tree.Direct<uint64_t>();
+            auto reg = zero.GetDirectRegister();
+
+            code.Emit<OpCode::Xor>(reg, reg);
+            code.Emit<OpCode::Mov>(offset.GetBaseRegister(), offset.GetOffset(), reg);
+            code.Emit<OpCode::Cmp>(reg, end.GetBaseRegister(), end.GetOffset());
+            code.EmitConditionalJump<JccType::JAE>(loopEnd);
+        }
+
+        m_offset.SetStorage(offset);
+        m_context.SetStorage(context);
+
+        const unsigned rxxUsedMask = tree.GetRXXUsedMask();
+        const unsigned xmmUsedMask = tree.GetXMMUsedMask();
+
+        code.PlaceLabel(loopStart);
+
+        tree.CodeGenSharedNodes(m_firstBodyId, GetId());
+
+        {
+            auto value = m_body.CodeGen(tree);
+            auto valueRegister = value.ConvertToDirect(false);
+
+            // Make sure that allocating the address does not spill the value.
+            ReferenceCounter valuePin = value.GetPin();
+
+            auto address = Load(tree, output);
+            auto addressRegister = address.GetDirectRegister();
+
+            code.Emit<OpCode::Add>(addressRegister, offset.GetBaseRegister(), offset.GetOffset());
+            code.Emit<OpCode::Mov>(addressRegister, 0, valueRegister);
+        }
+
+        LogThrowAssert(tree.GetRXXUsedMask() == rxxUsedMask
+                       && tree.GetXMMUsedMask() == xmmUsedMask,
+                       "Register allocation at the end of the loop %u body differs from its start",
+                       GetId());
+
+        // Advance to the next element and loop back unless at the end.
+        {
+            auto next = Load(tree, offset);
+            auto reg = next.GetDirectRegister();
+
+            code.EmitImmediate<OpCode::Add>(reg, static_cast<int32_t>(sizeof(T)));
+            code.Emit<OpCode::Mov>(offset.GetBaseRegister(), offset.GetOffset(), reg);
+            code.Emit<OpCode::Cmp>(reg, end.GetBaseRegister(), end.GetOffset());
+            code.EmitConditionalJump<JccType::JB>(loopStart);
+        }
+
+        code.PlaceLabel(loopEnd);
+
+        m_offset.SetStorage(Storage<uint64_t>());
+        m_context.SetStorage(Storage<CONTEXT>());
+
+        return count;
+    }
+
+
+    template <typename T, typename CONTEXT>
+    void LoopNode<T, CONTEXT>::Print(std::ostream& out) const
+    {
+        this->PrintCoreProperties(out, "LoopNode");
+
+        out << ", body = " << m_body.GetId()
+            << ", output = " << m_output.GetId()
+            << ", count = " << m_count.GetId()
+            << ", context = " << m_contextValue.GetId()
+            << ", body nodes = [" << m_firstBodyId << ", " << GetId() << ")";
+    }
+}
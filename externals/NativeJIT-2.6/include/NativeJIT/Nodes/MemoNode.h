@@ -0,0 +1,190 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2016, Microsoft
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#pragma once
+
+#include <cstdint>
+
+#include "NativeJIT/CodeGen/X64CodeGenerator.h"
+#include "NativeJIT/ExpressionTree.h"
+#include "NativeJIT/Nodes/CallNode.h"   // SaveRestoreVolatilesHelper.
+#include "NativeJIT/Nodes/Node.h"
+
+
+namespace NativeJIT
+{
+    // Returns the value a function has returned by its last call, calling the
+    // function again only once any of the counters differs from its copy taken
+    // at that call. The copies, the counters and the value are read and written
+    // in place, so they must outlive the generated code. A null counter is
+    // treated as always changed.
+    //
+    // Unlike a ConditionalNode, the function is not called when the counters
+    // are unchanged: the jump skips the call. The registers allocation is the
+    // same on both paths, since the volatile registers are preserved around
+    // the call and the node's own registers are loaded again after it.
+    template <typename T>
+    class MemoNode : public Node<T>, public SaveRestoreVolatilesHelper
+    {
+    public:
+        typedef T (*FunctionPointer)();
+
+        MemoNode(ExpressionTree& tree,
+                 FunctionPointer function,
+                 T* value,
+                 uint64_t const * const * counters,
+                 uint64_t* copies,
+                 unsigned count);
+
+        //
+        // Overrides of Node methods
+        //
+
+        virtual Storage<T> CodeGenValue(ExpressionTree& tree) override;
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~MemoNode();
+
+        FunctionPointer m_function;
+        T* m_value;
+        uint64_t const * const * m_counters;
+        uint64_t* m_copies;
+        unsigned m_count;
+    };
+
+
+    //*************************************************************************
+    //
+    // Template definitions for MemoNode
+    //
+    //*************************************************************************
+    template <typename T>
+    MemoNode<T>::MemoNode(ExpressionTree& tree,
+                          FunctionPointer function,
+                          T* value,
+                          uint64_t const * const * counters,
+                          uint64_t* copies,
+                          unsigned count)
+        : Node<T>(tree),
+          SaveRestoreVolatilesHelper(tree.GetAllocator()),
+          m_function(function),
+          m_value(value),
+          m_counters(counters),
+          m_copies(copies),
+          m_count(count)
+    {
+        static_assert(sizeof(T) <= 8, "Unsupported value type");
+        LogThrowAssert(count <= INT32_MAX / sizeof(uint64_t), "Too many counters");
+
+        tree.ReportFunctionCallNode(0);
+    }
+
+
+    template <typename T>
+    typename ExpressionTree::Storage<T> MemoNode<T>::CodeGenValue(ExpressionTree& tree)
+    {
+        X64CodeGenerator& code = tree.GetCodeGenerator();
+
+        Label call = code.AllocateLabel();
+        Label load = code.AllocateLabel();
+
+        auto result = tree.Direct<T>();
+        ReferenceCounter resultPin = result.GetPin();
+        auto resultRegister = result.GetDirectRegister();
+
+        auto address = tree.Direct<uint64_t*>();
+        ReferenceCounter addressPin = address.GetPin();
+        auto addressRegister = address.GetDirectRegister();
+
+        auto counter = tree.Direct<uint64_t>();
+        ReferenceCounter counterPin = counter.GetPin();
+        auto counterRegister = counter.GetDirectRegister();
+
+        // Compare the counters with their copies.
+        code.EmitImmediate<OpCode::Mov>(addressRegister, reinterpret_cast<uint64_t>(m_copies));
+        for (unsigned i = 0; i < m_count; ++i)
+        {
+            if (m_counters[i] == nullptr)
+            {
+                code.Jmp(call);
+                break;
+            }
+
+            code.EmitImmediate<OpCode::Mov>(counterRegister, reinterpret_cast<uint64_t>(m_counters[i]));
+            code.Emit<OpCode::Mov>(counterRegister, counterRegister, 0);
+            code.Emit<OpCode::Cmp>(counterRegister,
+                                   addressRegister,
+                                   static_cast<int32_t>(i * sizeof(uint64_t)));
+            code.EmitConditionalJump<JccType::JNE>(call);
+        }
+        code.Jmp(load);
+
+        // Take the copies of the counters and call the function.
+        code.PlaceLabel(call);
+        for (unsigned i = 0; i < m_count; ++i)
+        {
+            if (m_counters[i] != nullptr)
+            {
+                code.EmitImmediate<OpCode::Mov>(counterRegister, reinterpret_cast<uint64_t>(m_counters[i]));
+                code.Emit<OpCode::Mov>(counterRegister, counterRegister, 0);
+                code.Emit<OpCode::Mov>(addressRegister,
+                                       static_cast<int32_t>(i * sizeof(uint64_t)),
+                                       counterRegister);
+            }
+        }
+
+        // The node's registers are loaded again after the call, so that
+        // they do not need to be preserved.
+        RecordCallRegister(resultRegister, true);
+        RecordCallRegister(addressRegister, true);
+        RecordCallRegister(counterRegister, true);
+
+        SaveVolatiles(tree);
+        code.EmitImmediate<OpCode::Mov>(counterRegister, reinterpret_cast<uint64_t>(m_function));
+        code.Emit<OpCode::Call>(counterRegister);
+        code.EmitImmediate<OpCode::Mov>(addressRegister, reinterpret_cast<uint64_t>(m_value));
+        code.Emit<OpCode::Mov>(addressRegister, 0, tree.GetResultRegister<T>());
+        RestoreVolatiles(tree);
+
+        code.PlaceLabel(load);
+        code.EmitImmediate<OpCode::Mov>(addressRegister, reinterpret_cast<uint64_t>(m_value));
+        code.Emit<OpCode::Mov>(resultRegister, addressRegister, 0);
+
+        return result;
+    }
+
+
+    template <typename T>
+    void MemoNode<T>::Print(std::ostream& out) const
+    {
+        this->PrintCoreProperties(out, "MemoNode");
+
+        out << ", value = " << static_cast<void*>(m_value)
+            << ", counters = " << m_count;
+    }
+}
@@ -0,0 +1,99 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2016, Microsoft
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#pragma once
+
+#include "NativeJIT/CodeGen/X64CodeGenerator.h"     // OpCode type.
+#include "NativeJIT/Nodes/Node.h"
+
+
+namespace NativeJIT
+{
+    // Implements a node for the SSE4.1 ROUNDSD/ROUNDSS instructions. The
+    // caller is responsible for checking that the CPU supports SSE4.1.
+    template <typename T>
+    class RoundNode : public Node<T>
+    {
+    public:
+        RoundNode(ExpressionTree& tree, Node<T>& value, RoundingMode mode);
+
+        virtual Storage<T> CodeGenValue(ExpressionTree& tree) override;
+
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        static_assert(std::is_floating_point<T>::value,
+                      "RoundNode only supports floating point values.");
+
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~RoundNode();
+
+        Node<T>& m_value;
+        const RoundingMode m_mode;
+    };
+
+
+    //*************************************************************************
+    //
+    // Template definitions for RoundNode
+    //
+    //*************************************************************************
+    template <typename T>
+    RoundNode<T>::RoundNode(ExpressionTree& tree,
+                            Node<T>& value,
+                            RoundingMode mode)
+        : Node<T>(tree),
+          m_value(value),
+          m_mode(mode)
+    {
+        m_value.IncrementParentCount();
+    }
+
+
+    template <typename T>
+    Storage<T> RoundNode<T>::CodeGenValue(ExpressionTree& tree)
+    {
+        Storage<T> value = m_value.CodeGen(tree);
+
+        // Bit 3 of the immediate suppresses the precision exception, as
+        // required for floor() and ceil() by the C standard.
+        auto reg = value.ConvertToDirect(true);
+        tree.GetCodeGenerator().EmitImmediate<OpCode::Round>(
+            reg, reg, static_cast<uint8_t>(static_cast<uint8_t>(m_mode) | 0x08));
+
+        return value;
+    }
+
+
+    template <typename T>
+    void RoundNode<T>::Print(std::ostream& out) const
+    {
+        this->PrintCoreProperties(out, "Round");
+
+        out << ", value = " << m_value.GetId()
+            << ", mode = " << static_cast<unsigned>(m_mode);
+    }
+}
@@ -0,0 +1,99 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2016, Microsoft
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#include "NativeJIT/ExpressionTree.h"
+#include "NativeJIT/Nodes/Node.h"
+
+
+namespace NativeJIT
+{
+    // Evaluates the first node, discards its value, then evaluates and returns
+    // the second node. Used to evaluate the nodes having side effects, f. ex.
+    // StoreNodes, whose values are not needed.
+    template <typename L, typename R>
+    class SequenceNode : public Node<R>
+    {
+    public:
+        SequenceNode(ExpressionTree& tree,
+                     Node<L>& first,
+                     Node<R>& second);
+
+        //
+        // Overrides of Node methods
+        //
+
+        virtual Storage<R> CodeGenValue(ExpressionTree& tree) override;
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~SequenceNode();
+
+        Node<L>& m_first;
+        Node<R>& m_second;
+    };
+
+
+    //*************************************************************************
+    //
+    // Template definitions for SequenceNode
+    //
+    //*************************************************************************
+    template <typename L, typename R>
+    SequenceNode<L, R>::SequenceNode(ExpressionTree& tree,
+                                     Node<L>& first,
+                                     Node<R>& second)
+        : Node<R>(tree),
+          m_first(first),
+          m_second(second)
+    {
+        m_first.IncrementParentCount();
+        m_second.IncrementParentCount();
+    }
+
+
+    template <typename L, typename R>
+    typename ExpressionTree::Storage<R> SequenceNode<L, R>::CodeGenValue(ExpressionTree& tree)
+    {
+        {
+            // The first value is released before the second is evaluated.
+            auto first = m_first.CodeGen(tree);
+        }
+
+        return m_second.CodeGen(tree);
+    }
+
+
+    template <typename L, typename R>
+    void SequenceNode<L, R>::Print(std::ostream& out) const
+    {
+        this->PrintCoreProperties(out, "SequenceNode");
+
+        out << ", first = " << m_first.GetId()
+            << ", second = " << m_second.GetId();
+    }
+}
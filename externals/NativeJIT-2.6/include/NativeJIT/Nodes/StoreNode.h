@@ -0,0 +1,113 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2016, Microsoft
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#include <cstdint>
+
+#include "NativeJIT/CodeGen/X64CodeGenerator.h"
+#include "NativeJIT/ExpressionTree.h"
+#include "NativeJIT/Nodes/Node.h"
+
+
+namespace NativeJIT
+{
+    // Stores the value at the given offset from the address and returns the
+    // value. The store is a side effect: the node has to be referenced, f. ex.
+    // by a SequenceNode, for it to be evaluated.
+    template <typename T>
+    class StoreNode : public Node<T>
+    {
+    public:
+        StoreNode(ExpressionTree& tree,
+                  Node<T*>& address,
+                  int32_t offset,
+                  Node<T>& value);
+
+        //
+        // Overrides of Node methods
+        //
+
+        virtual Storage<T> CodeGenValue(ExpressionTree& tree) override;
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~StoreNode();
+
+        Node<T*>& m_address;
+        int32_t m_offset;
+        Node<T>& m_value;
+    };
+
+
+    //*************************************************************************
+    //
+    // Template definitions for StoreNode
+    //
+    //*************************************************************************
+    template <typename T>
+    StoreNode<T>::StoreNode(ExpressionTree& tree,
+                            Node<T*>& address,
+                            int32_t offset,
+                            Node<T>& value)
+        : Node<T>(tree),
+          m_address(address),
+          m_offset(offset),
+          m_value(value)
+    {
+        m_address.IncrementParentCount();
+        m_value.IncrementParentCount();
+    }
+
+
+    template <typename T>
+    typename ExpressionTree::Storage<T> StoreNode<T>::CodeGenValue(ExpressionTree& tree)
+    {
+        auto value = m_value.CodeGen(tree);
+        auto valueRegister = value.ConvertToDirect(false);
+
+        // Make sure that evaluating the address does not spill the value.
+        ReferenceCounter valuePin = value.GetPin();
+
+        auto address = m_address.CodeGen(tree);
+        auto addressRegister = address.ConvertToDirect(false);
+
+        tree.GetCodeGenerator().template Emit<OpCode::Mov>(addressRegister, m_offset, valueRegister);
+
+        return value;
+    }
+
+
+    template <typename T>
+    void StoreNode<T>::Print(std::ostream& out) const
+    {
+        this->PrintCoreProperties(out, "StoreNode");
+
+        out << ", address = " << m_address.GetId()
+            << ", offset = " << m_offset
+            << ", value = " << m_value.GetId();
+    }
+}
@@ -0,0 +1,109 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2016, Microsoft
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#pragma once
+
+#include "NativeJIT/CodeGen/X64CodeGenerator.h"     // OpCode type.
+#include "NativeJIT/CodeGenHelpers.h"
+#include "NativeJIT/Nodes/Node.h"
+
+
+namespace NativeJIT
+{
+    // Implements a node for the floating point instructions with a single
+    // operand, such as SqrtSD.
+    template <OpCode OP, typename T>
+    class UnaryNode : public Node<T>
+    {
+    public:
+        UnaryNode(ExpressionTree& tree, Node<T>& operand);
+
+        virtual Storage<T> CodeGenValue(ExpressionTree& tree) override;
+
+        virtual void Print(std::ostream& out) const override;
+
+    private:
+        static_assert(std::is_floating_point<T>::value,
+                      "UnaryNode only supports floating point operands.");
+
+        // WARNING: This class is designed to be allocated by an arena allocator,
+        // so its destructor will never be called. Therefore, it should hold no
+        // resources other than memory from the arena allocator.
+        ~UnaryNode();
+
+        Node<T>& m_operand;
+    };
+
+
+    //*************************************************************************
+    //
+    // Template definitions for UnaryNode
+    //
+    //*************************************************************************
+    template <OpCode OP, typename T>
+    UnaryNode<OP, T>::UnaryNode(ExpressionTree& tree, Node<T>& operand)
+        : Node<T>(tree),
+          m_operand(operand)
+    {
+        m_operand.IncrementParentCount();
+    }
+
+
+    template <OpCode OP, typename T>
+    Storage<T> UnaryNode<OP, T>::CodeGenValue(ExpressionTree& tree)
+    {
+        Storage<T> source = m_operand.CodeGen(tree);
+
+        // The operand may be either a register or a memory location, so
+        // the result goes to a new register unless the source register
+        // can be reused.
+        if (source.GetStorageClass() == StorageClass::Direct && source.IsSoleDataOwner())
+        {
+            auto reg = source.ConvertToDirect(true);
+            tree.GetCodeGenerator().Emit<OP>(reg, reg);
+
+            return source;
+        }
+
+        auto target = tree.Direct<T>();
+
+        CodeGenHelpers::Emit<OP>(tree.GetCodeGenerator(),
+                                 target.GetDirectRegister(),
+                                 source);
+
+        return target;
+    }
+
+
+    template <OpCode OP, typename T>
+    void UnaryNode<OP, T>::Print(std::ostream& out) const
+    {
+        const std::string name = std::string("Operation (")
+            + X64CodeGenerator::OpCodeName(OP)
+            + ") ";
+        this->PrintCoreProperties(out, name.c_str());
+
+        out << ", operand = " << m_operand.GetId();
+    }
+}
@@ -84,6 +84,8 @@ namespace NativeJIT
 
     void Allocator::DebugInitialize()
     {
+#ifdef _DEBUG
         memset(m_buffer.get(), 0xcc, m_bufferSize);
+#endif
     }
 }
@@ -22,6 +22,7 @@
 
 
 #include <algorithm>    // For std::min.
+#include <limits>
 #include <stdexcept>
 
 #include "NativeJIT/BitOperations.h"
@@ -23,6 +23,7 @@
 
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 
 #include "NativeJIT/CodeGen/X64CodeGenerator.h"
 
@@ -124,6 +125,7 @@ namespace NativeJIT
         static char const * names[] = {
             "add",
             "and",
+            "andn",
             "bsf",
             "bsr",
             "bt",
@@ -132,13 +134,17 @@ namespace NativeJIT
             "bts",
             "call",
             "cmp",
+            "cmpmask",
             "cvtfp2fp",
             "cvtfp2si",
             "cvtsi2fp",
             "dec",
+            "div",
             "imul",
             "inc",
             "lea",
+            "max",
+            "min",
             "mov",
             "movsx",
             "movzx",
@@ -152,9 +158,11 @@ namespace NativeJIT
             "rep",
             "ret",
             "rol",
+            "round",
             "shl",
             "shld",
             "shr",
+            "sqrt",
             "stosq",
             "sub",
             "xor",
@@ -197,6 +205,30 @@ namespace NativeJIT
     }
 
 
+    char const * X64CodeGenerator::PackedOpCodeName(PackedOpCode op, VectorWidth width)
+    {
+        char const * name = nullptr;
+
+        switch (op)
+        {
+        case PackedOpCode::Sqrt:    name = "vsqrtpd"; break;
+        case PackedOpCode::And:     name = (width == VectorWidth::Zmm) ? "vpandq" : "vandpd"; break;
+        case PackedOpCode::AndNot:  name = (width == VectorWidth::Zmm) ? "vpandnq" : "vandnpd"; break;
+        case PackedOpCode::Or:      name = (width == VectorWidth::Zmm) ? "vporq" : "vorpd"; break;
+        case PackedOpCode::Add:     name = "vaddpd"; break;
+        case PackedOpCode::Mul:     name = "vmulpd"; break;
+        case PackedOpCode::Sub:     name = "vsubpd"; break;
+        case PackedOpCode::Min:     name = "vminpd"; break;
+        case PackedOpCode::Div:     name = "vdivpd"; break;
+        case PackedOpCode::Max:     name = "vmaxpd"; break;
+        }
+
+        LogThrowAssert(name != nullptr, "Invalid PackedOpCode");
+
+        return name;
+    }
+
+
     bool X64CodeGenerator::IsDiagnosticsStreamAvailable() const
     {
         return m_diagnosticsStream != nullptr;
@@ -254,6 +286,330 @@ namespace NativeJIT
     }
 
 
+    //*************************************************************************
+    //
+    // X64CodeGenerator packed vector instructions.
+    //
+    //*************************************************************************
+    void X64CodeGenerator::EmitPacked(PackedOpCode op,
+                                      VectorWidth width,
+                                      unsigned dest,
+                                      unsigned src1,
+                                      unsigned src2)
+    {
+        CodePrinter printer(*this);
+
+        // Unary instructions require vvvv to be 1111b, which is an encoding
+        // of register 0.
+        const bool isUnary = (op == PackedOpCode::Sqrt);
+
+        uint8_t opcode = static_cast<uint8_t>(op);
+        if (width == VectorWidth::Zmm && op == PackedOpCode::And)
+        {
+            opcode = 0xdb;
+        }
+        else if (width == VectorWidth::Zmm && op == PackedOpCode::AndNot)
+        {
+            opcode = 0xdf;
+        }
+        else if (width == VectorWidth::Zmm && op == PackedOpCode::Or)
+        {
+            opcode = 0xeb;
+        }
+
+        EmitPackedPrefix(width, 1, dest, isUnary ? 0 : src1, src2, 0, false);
+        Emit8(opcode);
+        Emit8(0xc0 | ((dest & 7) << 3) | (src2 & 7));
+
+        if (IsDiagnosticsStreamAvailable())
+        {
+            std::ostringstream operands;
+            operands << CodePrinter::GetVectorRegisterName(width, dest);
+            if (!isUnary)
+            {
+                operands << ", " << CodePrinter::GetVectorRegisterName(width, src1);
+            }
+            operands << ", " << CodePrinter::GetVectorRegisterName(width, src2);
+            printer.Print(PackedOpCodeName(op, width), operands.str());
+        }
+    }
+
+
+    void X64CodeGenerator::EmitPackedRound(VectorWidth width,
+                                           unsigned dest,
+                                           unsigned src,
+                                           uint8_t mode)
+    {
+        CodePrinter printer(*this);
+
+        // Both vroundpd and vrndscalepd are 66 0F3A 09 /r ib. The upper
+        // bits of the vrndscalepd immediate (the scale) are zero.
+        EmitPackedPrefix(width, 3, dest, 0, src, 0, false);
+        Emit8(0x09);
+        Emit8(0xc0 | ((dest & 7) << 3) | (src & 7));
+        Emit8(mode & 0x0f);
+
+        if (IsDiagnosticsStreamAvailable())
+        {
+            std::ostringstream operands;
+            operands << CodePrinter::GetVectorRegisterName(width, dest)
+                     << ", " << CodePrinter::GetVectorRegisterName(width, src)
+                     << ", " << static_cast<unsigned>(mode & 0x0f);
+            printer.Print(width == VectorWidth::Zmm ? "vrndscalepd" : "vroundpd",
+                          operands.str());
+        }
+    }
+
+
+    void X64CodeGenerator::EmitPackedCompare(VectorWidth width,
+                                             unsigned dest,
+                                             unsigned src1,
+                                             unsigned src2,
+                                             CompareType type)
+    {
+        CodePrinter printer(*this);
+
+        // 66 0F C2 /r ib. The zmm form writes an opmask register, k1 here,
+        // selected by the ModR/M reg field.
+        const unsigned compareDest = (width == VectorWidth::Zmm) ? 1 : dest;
+        EmitPackedPrefix(width, 1, compareDest, src1, src2, 0, false);
+        Emit8(0xc2);
+        Emit8(0xc0 | ((compareDest & 7) << 3) | (src2 & 7));
+        Emit8(static_cast<uint8_t>(type));
+
+        if (IsDiagnosticsStreamAvailable())
+        {
+            std::ostringstream operands;
+            operands << (width == VectorWidth::Zmm ? std::string("k1") : CodePrinter::GetVectorRegisterName(width, dest))
+                     << ", " << CodePrinter::GetVectorRegisterName(width, src1)
+                     << ", " << CodePrinter::GetVectorRegisterName(width, src2)
+                     << ", " << static_cast<unsigned>(type);
+            printer.Print("vcmppd", operands.str());
+        }
+
+        if (width == VectorWidth::Zmm)
+        {
+            CodePrinter expandPrinter(*this);
+
+            // vpternlogq dest {k1}{z}, dest, dest, 0xff: 66 0F3A 25 /r ib.
+            // Truth table 0xff sets all the bits of the unmasked elements.
+            EmitPackedPrefix(width, 3, dest, dest, dest, 0, false, 1);
+            Emit8(0x25);
+            Emit8(0xc0 | ((dest & 7) << 3) | (dest & 7));
+            Emit8(0xff);
+
+            if (IsDiagnosticsStreamAvailable())
+            {
+                const std::string name = CodePrinter::GetVectorRegisterName(width, dest);
+                expandPrinter.Print("vpternlogq", name + " {k1}{z}, " + name + ", " + name + ", 255");
+            }
+        }
+    }
+
+
+    void X64CodeGenerator::EmitPackedLoad(VectorWidth width,
+                                          unsigned dest,
+                                          Register<8, false> base,
+                                          Register<8, false> index,
+                                          SIB scale,
+                                          int32_t offset)
+    {
+        CodePrinter printer(*this);
+
+        EmitPackedPrefix(width, 1, dest, 0, base.GetId(), index.GetId(), true);
+        Emit8(0x10);
+        EmitPackedModRMOffset(dest, base, true, index, scale, offset,
+                              width == VectorWidth::Zmm ? 64 : 1);
+
+        if (IsDiagnosticsStreamAvailable())
+        {
+            std::ostringstream operands;
+            operands << CodePrinter::GetVectorRegisterName(width, dest)
+                     << ", [" << base.GetName() << " + " << index.GetName()
+                     << "*" << (1 << static_cast<unsigned>(scale))
+                     << " + " << offset << "]";
+            printer.Print("vmovupd", operands.str());
+        }
+    }
+
+
+    void X64CodeGenerator::EmitPackedStore(VectorWidth width,
+                                           Register<8, false> base,
+                                           Register<8, false> index,
+                                           SIB scale,
+                                           int32_t offset,
+                                           unsigned src)
+    {
+        CodePrinter printer(*this);
+
+        EmitPackedPrefix(width, 1, src, 0, base.GetId(), index.GetId(), true);
+        Emit8(0x11);
+        EmitPackedModRMOffset(src, base, true, index, scale, offset,
+                              width == VectorWidth::Zmm ? 64 : 1);
+
+        if (IsDiagnosticsStreamAvailable())
+        {
+            std::ostringstream operands;
+            operands << "[" << base.GetName() << " + " << index.GetName()
+                     << "*" << (1 << static_cast<unsigned>(scale))
+                     << " + " << offset << "], "
+                     << CodePrinter::GetVectorRegisterName(width, src);
+            printer.Print("vmovupd", operands.str());
+        }
+    }
+
+
+    void X64CodeGenerator::EmitPackedBroadcast(VectorWidth width,
+                                               unsigned dest,
+                                               Register<8, false> base,
+                                               int32_t offset)
+    {
+        CodePrinter printer(*this);
+
+        EmitPackedPrefix(width, 2, dest, 0, base.GetId(), 0, true);
+        Emit8(0x19);
+        EmitPackedModRMOffset(dest, base, false, base, SIB::Scale1, offset,
+                              width == VectorWidth::Zmm ? 8 : 1);
+
+        if (IsDiagnosticsStreamAvailable())
+        {
+            std::ostringstream operands;
+            operands << CodePrinter::GetVectorRegisterName(width, dest)
+                     << ", qword ptr [" << base.GetName() << " + " << offset << "]";
+            printer.Print("vbroadcastsd", operands.str());
+        }
+    }
+
+
+    void X64CodeGenerator::EmitVZeroUpper()
+    {
+        CodePrinter printer(*this);
+
+        Emit8(0xc5);
+        Emit8(0xf8);
+        Emit8(0x77);
+
+        printer.Print("vzeroupper", "");
+    }
+
+
+    void X64CodeGenerator::EmitPackedPrefix(VectorWidth width,
+                                            uint8_t map,
+                                            unsigned reg,
+                                            unsigned vvvv,
+                                            unsigned rm,
+                                            unsigned index,
+                                            bool isMemory,
+                                            unsigned opmask)
+    {
+        // The R, X, B, R' and V' register extension bits as well as vvvv are
+        // stored inverted in both prefixes.
+        if (width == VectorWidth::Ymm)
+        {
+            LogThrowAssert(reg < 16 && vvvv < 16 && (isMemory || rm < 16),
+                           "Invalid ymm register");
+            LogThrowAssert(opmask == 0, "Opmask requires zmm");
+
+            // Three byte VEX: C4 RXBmmmmm WvvvvLpp, with W = 0, L = 1 (256
+            // bits) and pp = 01 (0x66).
+            uint8_t byte1 = map;
+            byte1 |= (reg & 8) ? 0 : 0x80;
+            byte1 |= (index & 8) ? 0 : 0x40;
+            byte1 |= (rm & 8) ? 0 : 0x20;
+
+            Emit8(0xc4);
+            Emit8(byte1);
+            Emit8(static_cast<uint8_t>(((~vvvv & 0xf) << 3) | 0x04 | 0x01));
+        }
+        else
+        {
+            LogThrowAssert(reg < 32 && vvvv < 32 && (isMemory || rm < 32),
+                           "Invalid zmm register");
+
+            // EVEX: 62 RXBR'00mm Wvvvv1pp zL'LbV'aaa, with W = 1, pp = 01
+            // (0x66), L'L = 10 (512 bits) and no broadcast. The opmask is aaa,
+            // with z set for zeroing-masking. For a register operand, X
+            // extends rm to 32 registers.
+            LogThrowAssert(opmask < 8, "Invalid opmask register");
+
+            uint8_t p0 = map;
+            p0 |= (reg & 8) ? 0 : 0x80;
+            p0 |= ((isMemory ? index : (rm >> 1)) & 8) ? 0 : 0x40;
+            p0 |= (rm & 8) ? 0 : 0x20;
+            p0 |= (reg & 16) ? 0 : 0x10;
+
+            Emit8(0x62);
+            Emit8(p0);
+            Emit8(static_cast<uint8_t>(0x80 | ((~vvvv & 0xf) << 3) | 0x04 | 0x01));
+            Emit8(static_cast<uint8_t>(((vvvv & 16) ? 0x40 : 0x48)
+                                       | (opmask != 0 ? 0x80 | opmask : 0)));
+        }
+    }
+
+
+    void X64CodeGenerator::EmitPackedModRMOffset(unsigned reg,
+                                                 Register<8, false> base,
+                                                 bool hasIndex,
+                                                 Register<8, false> index,
+                                                 SIB scale,
+                                                 int32_t offset,
+                                                 int32_t disp8Scale)
+    {
+        const uint8_t regField = reg & 7;
+
+        if (base.IsRIP())
+        {
+            LogThrowAssert(!hasIndex, "RIP-relative addressing can't have an index");
+
+            // RIP-relative addressing. Hard-code mod = 0 and rmField = 5.
+            Emit8((regField << 3) | 5);
+            Emit32(offset - CurrentPosition() - 4);
+            return;
+        }
+
+        // The combination of rmField == 5 && mod == 0 is a special case which
+        // is used for RIP-relative addressing. Use an 8-bit displacement of 0.
+        uint8_t mod = 2;
+        if (offset == 0 && base.GetId8() != 5)
+        {
+            mod = 0;
+        }
+        else if (offset % disp8Scale == 0
+                 && offset / disp8Scale >= -128
+                 && offset / disp8Scale <= 127)
+        {
+            mod = 1;
+        }
+
+        if (hasIndex)
+        {
+            LogThrowAssert(!index.IsStackPointer(), "RSP can't be used as an index");
+
+            Emit8((mod << 6) | (regField << 3) | 4);
+            Emit8((static_cast<uint8_t>(scale) << 6) | (index.GetId8() << 3) | base.GetId8());
+        }
+        else
+        {
+            Emit8((mod << 6) | (regField << 3) | base.GetId8());
+
+            if (base.GetId8() == 4)
+            {
+                // RSP or R12 base requires an SIB byte with no index.
+                Emit8(0x24);
+            }
+        }
+
+        if (mod == 1)
+        {
+            Emit8(static_cast<uint8_t>(offset / disp8Scale));
+        }
+        else if (mod == 2)
+        {
+            Emit32(offset);
+        }
+    }
+
+
     //*************************************************************************
     //
     // X64CodeGenerator::Helper<Op> methods.
@@ -436,6 +792,28 @@ namespace NativeJIT
     }
 
 
+    void X64CodeGenerator::CodePrinter::Print(char const * mnemonic, std::string const & operands)
+    {
+        if (m_out != nullptr)
+        {
+            PrintBytes(m_startPosition, m_code.CurrentPosition());
+
+            *m_out << mnemonic;
+            if (!operands.empty())
+            {
+                *m_out << ' ' << operands;
+            }
+            *m_out << std::endl;
+        }
+    }
+
+
+    std::string X64CodeGenerator::CodePrinter::GetVectorRegisterName(VectorWidth width, unsigned id)
+    {
+        return (width == VectorWidth::Zmm ? "zmm" : "ymm") + std::to_string(id);
+    }
+
+
     char const * X64CodeGenerator::CodePrinter::GetPointerName(unsigned pointerSize)
     {
         switch (pointerSize)
@@ -46,6 +46,7 @@ namespace NativeJIT
           m_parameters(m_stlAllocator),
           m_ripRelatives(m_stlAllocator),
           m_preconditionTests(m_stlAllocator),
+          m_loopBodies(m_stlAllocator),
           m_rxxFreeList(allocator),
           m_xmmFreeList(allocator),
           m_reservedRxxRegisterStorages(m_stlAllocator),
@@ -210,6 +211,45 @@ namespace NativeJIT
     }
 
 
+    void ExpressionTree::AddLoopBody(unsigned firstId, unsigned lastId)
+    {
+        LogThrowAssert(firstId <= lastId && lastId <= m_topologicalSort.size(),
+                       "Invalid loop body range [%u, %u)",
+                       firstId,
+                       lastId);
+
+        m_loopBodies.push_back(std::make_pair(firstId, lastId));
+    }
+
+
+    void ExpressionTree::CodeGenSharedNodes(unsigned firstId, unsigned lastId)
+    {
+        for (unsigned i = firstId ; i < lastId; ++i)
+        {
+            NodeBase& node = *m_topologicalSort[i];
+
+            if (node.GetParentCount() > 1 && !node.HasBeenEvaluated())
+            {
+                node.CodeGenCache(*this);
+            }
+        }
+    }
+
+
+    bool ExpressionTree::IsInLoopBody(unsigned id) const
+    {
+        for (auto const & body : m_loopBodies)
+        {
+            if (id >= body.first && id < body.second)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
     void ExpressionTree::Compile()
     {
         // Note: the call to Reset() clears all allocated labels, so start of
@@ -386,7 +426,9 @@ namespace NativeJIT
         {
             NodeBase& node = *m_topologicalSort[i];
 
-            if (node.GetParentCount() > 1 && !node.HasBeenEvaluated())
+            if (node.GetParentCount() > 1
+                && !node.HasBeenEvaluated()
+                && !IsInLoopBody(i))
             {
                 node.CodeGenCache(*this);
             }
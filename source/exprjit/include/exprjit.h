@@ -1,8 +1,10 @@
 #ifndef EXPRJIT_H
 #define EXPRJIT_H
 
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 /**
  * @brief Evaluate math expressions via JIT compiler.
@@ -13,9 +15,11 @@ public:
 
     using Real = double;
 
+    using Function0Ptr = ExprJIT::Real (*)();
     using Function1Ptr = ExprJIT::Real (*)(ExprJIT::Real);
     using Function2Ptr = ExprJIT::Real (*)(ExprJIT::Real, ExprJIT::Real);
     using Function3Ptr = ExprJIT::Real (*)(ExprJIT::Real, ExprJIT::Real, ExprJIT::Real);
+    using Function4Ptr = ExprJIT::Real (*)(ExprJIT::Real, ExprJIT::Real, ExprJIT::Real, ExprJIT::Real);
 
     // Symbol identifier wrapper used to expose variables
     // and native functions.
@@ -32,17 +36,427 @@ public:
         std::string m_name;
     };
 
+    /**
+     * @brief Direct reference to a variable, see variable().
+     *
+     * Setting the variable through a handle does not look its name up,
+     * but stores the value and increments the variable version.
+     * Handles remain valid as long as the ExprJIT object they
+     * have been obtained from.
+     */
+    class VarHandle
+    {
+    public:
+        VarHandle& operator =(const ExprJIT::Real value)
+        {
+            *m_value = value;
+            ++*m_version;
+            return *this;
+        }
+
+        ExprJIT::Real value() const { return *m_value; }
+        operator ExprJIT::Real() const { return *m_value; }
+
+    private:
+        friend class ExprJIT;
+
+        VarHandle(ExprJIT::Real *value, uint64_t *version)
+            : m_value(value),
+              m_version(version)
+        {
+        }
+
+        ExprJIT::Real *m_value;
+        uint64_t *m_version;
+    };
+
+    /**
+     * @brief Reduction of the batch evaluation results.
+     */
+    enum class Reduction
+    {
+        None,
+        Sum,
+        Min,
+        Max
+    };
+
+    /**
+     * @brief Threads pool used for the parallel batch evaluation.
+     *
+     * The rows are split into fixed size chunks, which are distributed
+     * among the threads queues. Idle threads steal the chunks from the
+     * other queues. The pool can be shared by any number of ExprJIT
+     * objects; it runs one batch at a time though, the concurrent
+     * evaluations wait for their turn.
+     */
+    class ThreadPool
+    {
+    public:
+        /**
+         * @brief Start the pool threads.
+         * @param threads Number of threads evaluating the batches,
+         *                including the calling one. 0 for the number
+         *                of hardware threads.
+         */
+        explicit ThreadPool(size_t threads = 0);
+        ~ThreadPool();
+
+        /**
+         * @brief Number of threads evaluating the batches.
+         */
+        size_t size() const;
+
+    private:
+        friend class ExprJIT;
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator =(const ThreadPool&) = delete;
+
+        struct Impl;
+        std::unique_ptr<Impl> d;
+    };
+
+    /**
+     * @brief Statistics of the process-wide programs cache.
+     */
+    struct CacheStatistics
+    {
+        size_t hits = 0;        ///< Programs whose code was found in the cache.
+        size_t misses = 0;      ///< Programs compiled.
+        size_t evictions = 0;   ///< Least recently used code evicted.
+        size_t size = 0;        ///< Number of cached programs code.
+        size_t capacity = 0;    ///< Maximal number of cached programs code.
+        size_t loads = 0;       ///< Programs code loaded from the cache directory.
+        size_t stores = 0;      ///< Programs code stored in the cache directory.
+    };
+
+    /**
+     * @brief Statistics of the last compile() call.
+     */
+    struct CompileStatistics
+    {
+        double parseTime = 0.0;     ///< Parsing into the expression tree, in seconds.
+        double optimizeTime = 0.0;  ///< Expression tree optimization passes, in seconds.
+        double loweringTime = 0.0;  ///< NativeJIT nodes construction, in seconds.
+        double codegenTime = 0.0;   ///< Registers allocation and code generation, in seconds.
+        size_t nodes = 0;           ///< Optimized expression tree nodes.
+        size_t codeSize = 0;        ///< Generated code bytes, including the constants.
+    };
+
+    class Context;
+
+    /**
+     * @brief Immutable compiled expression.
+     *
+     * The program code does not refer to the variables of the ExprJIT
+     * object it has been compiled by, but to the slots of a frame
+     * held by a Context. The same program can be shared and evaluated
+     * concurrently by different threads, each using its own context.
+     */
+    class Program
+    {
+    public:
+        ~Program();
+
+        /**
+         * @brief Names of the variables in the frame, in the slots order.
+         */
+        const std::vector<std::string>& variables() const;
+
+    private:
+        friend class ExprJIT;
+        friend class ExprJIT::Context;
+
+        Program();
+        Program(const Program&) = delete;
+        Program& operator =(const Program&) = delete;
+
+        struct Impl;
+        std::unique_ptr<Impl> d;
+    };
+
+    /**
+     * @brief Variables frame used to evaluate a program.
+     *
+     * Contexts are cheap to create and copy. A context must not be
+     * used by several threads at once, but any number of contexts
+     * of the same program can.
+     */
+    class Context
+    {
+    public:
+        /**
+         * @brief Create a frame for a program.
+         *
+         * The variables are initialized with the values they had
+         * when the program was compiled.
+         */
+        explicit Context(std::shared_ptr<const Program> program);
+
+        /**
+         * @brief Set a variable value.
+         * @return false if the variable is not used by the program.
+         */
+        bool set(const std::string &name, const ExprJIT::Real value);
+
+        /**
+         * @brief Access a variable by its slot in the Program::variables() order.
+         */
+        ExprJIT::Real& operator[](size_t slot) { return m_frame[slot]; }
+        ExprJIT::Real operator[](size_t slot) const { return m_frame[slot]; }
+
+        /**
+         * @brief Evaluate the program with this frame variables.
+         */
+        ExprJIT::Real eval() const;
+        ExprJIT::Real operator()() const { return eval(); }
+
+    private:
+        std::shared_ptr<const Program> m_program;
+        std::vector<ExprJIT::Real> m_frame;
+    };
+
+    /**
+     * @brief Immutable set of compiled expressions.
+     *
+     * The code of all the expressions is packed into one executable
+     * memory block, and the expressions are called through a table
+     * of their entry points. As for a program, the variables are read
+     * from a frame, which is shared by all the module expressions.
+     * The module can be evaluated concurrently with different frames.
+     */
+    class Module
+    {
+    public:
+        ~Module();
+
+        /**
+         * @brief Number of the expressions.
+         */
+        size_t size() const;
+
+        /**
+         * @brief Names of the variables in the frame, in the slots order.
+         */
+        const std::vector<std::string>& variables() const;
+
+        /**
+         * @brief Frame initialized with the values the variables had
+         *        when the module was compiled.
+         */
+        const std::vector<ExprJIT::Real>& frame() const;
+
+        /**
+         * @brief Evaluate an expression.
+         * @param index Expression index, in the compileModule() order.
+         * @param frame Variables values, in the variables() order.
+         */
+        ExprJIT::Real eval(size_t index, const ExprJIT::Real *frame) const;
+
+        /**
+         * @brief Evaluate all the expressions.
+         * @param frame Variables values, in the variables() order.
+         * @param out Output array of size() values.
+         */
+        void evalAll(const ExprJIT::Real *frame, ExprJIT::Real *out) const;
+
+        /**
+         * @brief Evaluate some of the expressions.
+         * @param indices Expressions indices.
+         * @param frame Variables values, in the variables() order.
+         * @param out Output array, one value per index.
+         */
+        void eval(const std::vector<size_t> &indices, const ExprJIT::Real *frame, ExprJIT::Real *out) const;
+
+    private:
+        friend class ExprJIT;
+
+        Module();
+        Module(const Module&) = delete;
+        Module& operator =(const Module&) = delete;
+
+        struct Impl;
+        std::unique_ptr<Impl> d;
+    };
+
+    /**
+     * @brief Variables shared by many ExprJIT objects.
+     *
+     * The objects created with an environment read and write their
+     * variables in it, so that a variable set once is seen by all their
+     * compiled expressions. The values are stored contiguously, in the
+     * order the variables are defined. The environment is not meant
+     * to be used by several threads at once.
+     */
+    class Environment
+    {
+    public:
+        Environment();
+        ~Environment();
+
+        /**
+         * @brief Get a handle to a variable, see ExprJIT::variable().
+         */
+        VarHandle variable(const std::string &name);
+
+        /**
+         * @brief Set a variable value, defining the variable if needed.
+         */
+        void set(const std::string &name, const ExprJIT::Real value);
+
+    private:
+        friend class ExprJIT;
+
+        Environment(const Environment&) = delete;
+        Environment& operator =(const Environment&) = delete;
+
+        struct Impl;
+        std::unique_ptr<Impl> d;
+    };
+
     ExprJIT();
+
+    /**
+     * @brief Create an object using shared variables.
+     *
+     * The variables remain valid after the environment destruction,
+     * as long as any object created with it. The functions are not
+     * shared, each object defines its own ones.
+     */
+    explicit ExprJIT(Environment &environment);
     ~ExprJIT();
 
     /**
      * @brief Compile an expression.
+     *
+     * With memoize() enabled, the subexpressions calling pure functions,
+     * and depending on some of the expression variables only, are
+     * memoized: eval() reuses their values as long as their variables
+     * are not set. The standard functions are pure, the user ones only
+     * once marked by setPure().
+     *
      * @param expression Expression to be compiled.
      * @return true on successful compilation, false on error.
      */
     bool compile(const std::string &expression);
     bool operator()(const std::string &expression) { return compile(expression); }
 
+    /**
+     * @brief Compile an expression for batch evaluation.
+     *
+     * Variables listed in columns are bound to the input columns
+     * passed to evalBatch(), in the same order. Other variables are
+     * taken from the symbols table as usual.
+     *
+     * @param expression Expression to be compiled.
+     * @param columns Names of the variables bound to input columns.
+     * @return true on successful compilation, false on error.
+     */
+    bool compileBatch(const std::string &expression, const std::vector<std::string> &columns);
+
+    /**
+     * @brief Compile several expressions into one function.
+     *
+     * The expressions are optimized together, so the subexpressions
+     * they have in common are evaluated once. All of them are evaluated
+     * by a single evalFused() call.
+     *
+     * @param expressions Expressions to be compiled.
+     * @return true on successful compilation, false on error.
+     */
+    bool compileFused(const std::vector<std::string> &expressions);
+
+    /**
+     * @brief Compile a function of positional parameters.
+     *
+     * The expression is written as "(x, y) -> x*y + 1", with up to
+     * 4 parameters. The parameters are passed to the compiled function
+     * in registers, and take precedence over the variables of the same
+     * names. Other variables are taken from the symbols table as usual.
+     *
+     * @param expression Function expression to be compiled.
+     * @return true on successful compilation, false on error.
+     */
+    bool compileFunction(const std::string &expression);
+
+    /**
+     * @brief Compile an expression into a shareable program.
+     *
+     * The variables used by the expression must be defined, their
+     * current values become the program contexts initial ones.
+     * The code already compiled for the same expression is reused,
+     * see cacheStatistics().
+     *
+     * @param expression Expression to be compiled.
+     * @return Compiled program, or nullptr on error.
+     */
+    std::shared_ptr<const Program> compileProgram(const std::string &expression);
+
+    /**
+     * @brief Compile expressions into a module.
+     *
+     * The variables used by the expressions must be defined, their
+     * current values become the module frame initial ones.
+     *
+     * @param expressions Expressions to be compiled.
+     * @return Compiled module, or nullptr if any of the expressions
+     *         fails to compile.
+     */
+    std::shared_ptr<const Module> compileModule(const std::vector<std::string> &expressions);
+
+    /**
+     * @brief Returns statistics of the process-wide programs cache.
+     *
+     * Programs compiled from the expressions which are the same once
+     * optimized, like "x*2 + 1" and "1 + 2.0*x", share the cached code.
+     */
+    static CacheStatistics cacheStatistics();
+
+    /**
+     * @brief Set the maximal number of the cached programs code.
+     *
+     * The least recently used code is evicted first. The evicted code
+     * is released once there are no programs referring it.
+     * 0 disables the cache.
+     */
+    static void setCacheCapacity(size_t capacity);
+
+    /**
+     * @brief Set the directory the programs code is stored in.
+     *
+     * The compiled programs code is stored in the directory, and loaded
+     * from there instead of being compiled, by this or another process.
+     * The stored code calls the functions by their names: the process
+     * loading it must define the same functions under the same names.
+     * The directory must exist. Empty directory disables the storage,
+     * which is the default.
+     */
+    static void setCacheDirectory(const std::string &directory);
+
+    /**
+     * @brief Remove all the programs code from the cache, and reset its statistics.
+     *
+     * The code stored in the cache directory is kept.
+     */
+    static void clearCache();
+
+    /**
+     * @brief Returns statistics of the last compile() call.
+     *
+     * The statistics are reset by a failed compilation, apart from
+     * the parse time.
+     */
+    CompileStatistics compileStatistics() const;
+
+    /**
+     * @brief Returns the names of the variables the expression
+     *        compiled by compile() depends on.
+     *
+     * The variables optimized out of the expression are not listed.
+     */
+    std::vector<std::string> dependencies() const;
+
     /**
      * @brief Returns compilation error message.
      * @return
@@ -51,11 +465,79 @@ public:
 
     /**
      * @brief Evaluate previously compiled expression.
+     *
+     * The memoized subexpressions, see memoize(), whose variables have
+     * not been set since the previous evaluation, are not evaluated
+     * again but their previous values are reused.
+     *
+     * The expression can be evaluated by several threads at once, as
+     * long as its variables are not changed meanwhile. The evaluations
+     * of an expression with specialized variables are serialized, since
+     * they may compile it again. An expression with memoized
+     * subexpressions must not be evaluated by several threads at once,
+     * since the evaluation updates their values.
+     *
      * @return
      */
     Real eval() const;
     Real operator()() const { return eval(); }
 
+    /**
+     * @brief Evaluate previously compiled batch expression.
+     *
+     * The loop over the rows runs in the generated code.
+     *
+     * @param columns Input columns, one per variable bound in compileBatch().
+     * @param out Output array of n values.
+     * @param n Number of rows.
+     */
+    void evalBatch(const Real* const* columns, Real *out, size_t n) const;
+
+    /**
+     * @brief Evaluate previously compiled fused expressions.
+     * @param out Output array, one value per expression passed
+     *            to compileFused(), in the same order.
+     */
+    void evalFused(Real *out) const;
+
+    /**
+     * @brief Evaluate previously compiled batch expression in parallel.
+     *
+     * The output values are the same as the ones of the single threaded
+     * evaluation, each row being written at its position. The reduction
+     * is made of the chunks partial results combined in the chunks
+     * order, so it does not depend on the number of threads either.
+     * The variables must not be changed during the evaluation.
+     *
+     * @param pool Threads pool.
+     * @param columns Input columns, one per variable bound in compileBatch().
+     * @param out Output array of n values, may be nullptr if only
+     *            the reduction is needed.
+     * @param n Number of rows.
+     * @param reduction Reduction of the output values.
+     * @return Reduction result: 0 for Reduction::None, 0, +inf or -inf
+     *         for the Sum, Min and Max of no rows.
+     */
+    Real evalBatch(ThreadPool &pool, const Real* const* columns, Real *out, size_t n,
+                   Reduction reduction = Reduction::None) const;
+
+    /**
+     * @brief Get previously compiled function.
+     *
+     * The native function can be called directly, without going through
+     * this object. It remains valid until the next compileFunction() call
+     * or this object destruction.
+     *
+     * @param func Function pointer to be set, of the compiled function arity.
+     * @return false if there is no compiled function of this arity,
+     *         in which case func is set to nullptr.
+     */
+    bool function(Function0Ptr &func) const;
+    bool function(Function1Ptr &func) const;
+    bool function(Function2Ptr &func) const;
+    bool function(Function3Ptr &func) const;
+    bool function(Function4Ptr &func) const;
+
     /**
      * @brief Access symbol by its identifier.
      *
@@ -69,9 +551,77 @@ public:
      */
     SymbolReference operator[](const std::string &name);
 
+    /**
+     * @brief Get a handle to a variable.
+     *
+     * The variable is defined with 0 value if it does not exist yet.
+     * Changing variables through their handles is faster than through
+     * the operator[], meant for the evaluation loops.
+     *
+     * @param name Variable name.
+     */
+    VarHandle variable(const std::string &name);
+
+    /**
+     * @brief Mark a user function as pure.
+     *
+     * A pure function returns the same value for the same arguments,
+     * and has no side effects. The calls of the pure functions may be
+     * evaluated during the compilation when their arguments are constant,
+     * shared, or memoized, see memoize(), while the other functions are
+     * called on every evaluation. Takes effect on the next compilation.
+     *
+     * @param name Function name.
+     * @param pure false to have the function called on every evaluation.
+     */
+    void setPure(const std::string &name, bool pure = true);
+
+    /**
+     * @brief Define a named constant.
+     *
+     * Constants are compiled as the literal numbers, and folded with
+     * the rest of the expression. They take precedence over the
+     * variables of the same names, and are used by the next compilations
+     * only. The standard constants pi, e and inf are defined as well,
+     * unless there are variables of the same names.
+     *
+     * @param name Constant name.
+     * @param value Constant value.
+     */
+    void setConstant(const std::string &name, const ExprJIT::Real value);
+
+    /**
+     * @brief Compile a variable as a constant of its current value.
+     *
+     * Specialized variables are folded with the rest of the expression
+     * by compile(). Once any of them is changed, the expression is
+     * compiled again by the next eval() call, so they are meant for
+     * the values which rarely change. The other compile methods read
+     * these variables as usual. Takes effect on the next compilation.
+     *
+     * @param name Variable name.
+     * @param enabled false to compile the variable as a memory read again.
+     */
+    void specialize(const std::string &name, bool enabled = true);
+
+    /**
+     * @brief Memoize the subexpressions of the compiled expressions.
+     *
+     * The memoized subexpressions are compiled separately, and their
+     * values are kept between the evaluations. The generated code
+     * checks whether any of their variables has been set since, and
+     * evaluates them again only then. This pays off for the costly
+     * subexpressions of the variables which rarely change, and costs
+     * the checks otherwise. Takes effect on the next compilation.
+     *
+     * @param enabled false to evaluate the whole expression every time.
+     */
+    void memoize(bool enabled = true);
+
 private:
 
     friend class ExprJIT::SymbolReference;
+    friend struct ExprJITDetail;
 
     ExprJIT(const ExprJIT&) = delete;
     ExprJIT& operator =(const ExprJIT&) = delete;
@@ -1,18 +1,99 @@
+#include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <istream>
+#include <random>
 #include <sstream>
 #include <map>
+#include <set>
+#include <tuple>
 #include <functional>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+#endif
 
-#include "NativeJIT/CodeGen/ExecutionBuffer.h"
 #include "NativeJIT/CodeGen/FunctionBuffer.h"
+#include "NativeJIT/CodeGen/FunctionSpecification.h"
 #include "NativeJIT/Function.h"
 
 #include "exprjit.h"
+#include "exprjit_detail.h"
 
 // Size of the JIT compiler buffers
 constexpr size_t CODE_BUFFER_SIZE = 16384;
 
+// Maximal size of the generated code
+constexpr size_t CODE_BUFFER_MAX_SIZE = 1 << 30;
+
+// Estimated generated code bytes per expression tree node
+constexpr size_t CODE_BYTES_PER_NODE = 32;
+
+// Maximal number of the shared subexpressions. NativeJIT keeps their
+// values in the stack frame, which is limited to 4 KB.
+constexpr size_t CSE_MAX_SHARED_NODES = 384;
+
+// Maximal number of the operands of a sum or product evaluated in order.
+// Longer chains are split into a balanced tree of such chains, since the
+// NativeJIT code generation recursion is as deep as the expression tree.
+constexpr size_t CHAIN_MAX_LENGTH = 256;
+
+// Maximal number of the memoized subtrees of an expression
+constexpr size_t MEMO_MAX_SUBTREES = 8;
+
+// Number of variables per chunk of the variables storage
+constexpr size_t VARIABLES_CHUNK_SIZE = 64;
+
+// Size of the executable memory chunks shared by the compiled code
+constexpr size_t CODE_ARENA_CHUNK_SIZE = 1 << 20;
+
+// Alignment of the compiled code in the executable memory
+constexpr size_t CODE_ARENA_ALIGNMENT = 64;
+
+// Default number of the process-wide cached programs
+constexpr size_t PROGRAM_CACHE_CAPACITY = 256;
+
+// Version of the stored programs code format
+constexpr uint32_t PROGRAM_STORE_VERSION = 1;
+
+// Number of rows of the parallel batch evaluation chunks.
+// This is a multiple of the vector lanes count.
+constexpr size_t BATCH_CHUNK_ROWS = 16384;
+
+// Number of the batch columns offset on the stack for the rows
+// left over by the vector kernel
+constexpr size_t BATCH_STACK_COLUMNS = 32;
+
 namespace nj = NativeJIT;
 
 // Enable generated code assembly output
@@ -86,751 +167,5034 @@ static ExprJIT::Real atan2(ExprJIT::Real x, ExprJIT::Real y) { return ::atan2(x,
 static ExprJIT::Real hypot(ExprJIT::Real x, ExprJIT::Real y) { return ::hypot(x, y); }
 
 // 3-argument functions
+// Same as the inlined maxsd(a, minsd(b, x)), so that the constant
+// folding gives the same results.
 static ExprJIT::Real clamp(ExprJIT::Real x, ExprJIT::Real a, ExprJIT::Real b)
 {
-    if (x < a) {
-        return a;
-    } else if (x > b) {
-        return b;
+    return max(a, min(b, x));
+}
+
+template <typename F>
+struct Builtin
+{
+    const char *name;
+    F func;
+};
+
+// Standard functions shared by all the symbols tables, sorted by name.
+static const Builtin<ExprJIT::Function1Ptr> builtins1[] = {
+    { "abs",    abs },
+    { "acos",   acos },
+    { "acosh",  acosh },
+    { "asin",   asin },
+    { "asinh",  asinh },
+    { "atan",   atan },
+    { "atanh",  atanh },
+    { "ceil",   ceil },
+    { "cos",    cos },
+    { "cosh",   cosh },
+    { "exp",    exp },
+    { "exp2",   exp2 },
+    { "floor",  floor },
+    { "log",    log },
+    { "log10",  log10 },
+    { "log2",   log2 },
+    { "round",  round },
+    { "sin",    sin },
+    { "sinh",   sinh },
+    { "sqrt",   sqrt },
+    { "tan",    tan },
+    { "tanh",   tanh }
+};
+
+static const Builtin<ExprJIT::Function2Ptr> builtins2[] = {
+    { "atan2",  atan2 },
+    { "hypot",  hypot },
+    { "max",    max },
+    { "min",    min },
+    { "mod",    mod },
+    { "pow",    pow }
+};
+
+static const Builtin<ExprJIT::Function3Ptr> builtins3[] = {
+    { "clamp",  clamp }
+};
+
+struct Constant
+{
+    const char *name;
+    ExprJIT::Real value;
+};
+
+// Standard constants, which the variables of the same names hide.
+static const Constant constants[] = {
+    { "e",      2.718281828459045 },
+    { "inf",    std::numeric_limits<ExprJIT::Real>::infinity() },
+    { "pi",     3.141592653589793 }
+};
+
+/**
+ * @brief Find a standard constant by its name.
+ * @return false if there is no such constant.
+ */
+static bool constant(const std::string &name, ExprJIT::Real &value)
+{
+    for (const auto &c : constants) {
+        if (name == c.name) {
+            value = c.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Find a standard function by its name.
+ * @return Function pointer, nullptr if there is no such function.
+ */
+template <typename F, size_t N>
+static F builtin(const Builtin<F> (&builtins)[N], const std::string &name)
+{
+    const auto it = std::lower_bound(std::begin(builtins), std::end(builtins), name,
+        [](const Builtin<F> &b, const std::string &n) { return n.compare(b.name) > 0; });
+    return (it != std::end(builtins) && name == it->name) ? it->func : nullptr;
+}
+
+/**
+ * @brief Find the name of a standard function.
+ * @return Function name, nullptr if it is not a standard function.
+ */
+template <typename F, size_t N>
+static const char* builtinName(const Builtin<F> (&builtins)[N], F func)
+{
+    for (const auto &b : builtins) {
+        if (b.func == func) {
+            return b.name;
+        }
     }
-    return x;
+    return nullptr;
 }
 
 } // namespace func
 
 //----------------------------------------------------------
-//  Symbols table
+//  Variables storage
 //----------------------------------------------------------
-class SymbolTable
+
+/**
+ * @brief Values and versions of named variables.
+ *
+ * The values are stored contiguously, in the variables definition
+ * order, in cache line aligned chunks which are never moved: the
+ * compiled code and the variable handles refer to them directly.
+ * The storage can be shared by the symbols tables of many ExprJIT
+ * objects, see ExprJIT::Environment.
+ */
+class VariableStorage final
 {
 public:
 
-    SymbolTable()
-        : m_vars()
+    VariableStorage()
+        : m_index(),
+          m_names(),
+          m_chunks()
     {
-        defineStandardFunctions();
     }
 
-    void defineStandardFunctions()
+    /**
+     * @brief Returns a variable value pointer, nullptr if it is not defined.
+     */
+    ExprJIT::Real* find(const std::string &name) const
     {
-        setFunc("abs",      func::abs);
-        setFunc("sqrt",     func::sqrt);
-        setFunc("exp",      func::exp);
-        setFunc("exp2",     func::exp2);
-        setFunc("log",      func::log);
-        setFunc("log2",     func::log2);
-        setFunc("log10",    func::log10);
-        setFunc("sin",      func::sin);
-        setFunc("cos",      func::cos);
-        setFunc("tan",      func::tan);
-        setFunc("asin",     func::asin);
-        setFunc("acos",     func::acos);
-        setFunc("atan",     func::atan);
-        setFunc("sinh",     func::sinh);
-        setFunc("cosh",     func::cosh);
-        setFunc("tanh",     func::tanh);
-        setFunc("asinh",    func::asinh);
-        setFunc("acosh",    func::acosh);
-        setFunc("atanh",    func::atanh);
-        setFunc("round",    func::round);
-        setFunc("ceil",     func::ceil);
-        setFunc("floor",    func::floor);
-
-        setFunc("min",      func::min);
-        setFunc("max",      func::max);
-        setFunc("pow",      func::pow);
-        setFunc("mod",      func::mod);
-        setFunc("atan2",    func::atan2);
-        setFunc("hypot",    func::hypot);
-
-        setFunc("clamp",    func::clamp);
+        const auto it = m_index.find(name);
+        return (it != m_index.end()) ? value(it->second) : nullptr;
     }
 
-    ExprJIT::Real* varPtr(const std::string &name)
+    /**
+     * @brief Returns a variable value pointer, the variable being
+     *        defined with 0 value if it does not exist yet.
+     */
+    ExprJIT::Real* define(const std::string &name)
     {
-        if (m_vars.find(name) != m_vars.end()) {
-            return &m_vars[name];
-        }
-        return nullptr;
+        return value(defineIndex(name));
     }
 
-    ExprJIT::Function1Ptr func1Ptr(const std::string &name)
+    void set(const std::string &name, const ExprJIT::Real value)
     {
-        if (m_func1.find(name) != m_func1.end()) {
-            return m_func1.at(name);
-        }
-        return nullptr;
+        const size_t index = defineIndex(name);
+        *this->value(index) = value;
+        ++*versionAt(index);
     }
 
-    ExprJIT::Function2Ptr func2Ptr(const std::string &name)
+    /**
+     * @brief Version of a variable, incremented whenever it is set.
+     * @return nullptr if the pointer is not a variable of this storage.
+     */
+    uint64_t* version(const ExprJIT::Real *ptr) const
     {
-        if (m_func2.find(name) != m_func2.end()) {
-            return m_func2.at(name);
-        }
-        return nullptr;
+        const size_t index = indexOf(ptr);
+        return (index < m_names.size()) ? versionAt(index) : nullptr;
     }
 
-    ExprJIT::Function3Ptr func3Ptr(const std::string &name)
+    std::string name(const ExprJIT::Real *ptr) const
     {
-        if (m_func3.find(name) != m_func3.end()) {
-            return m_func3.at(name);
-        }
-        return nullptr;
+        const size_t index = indexOf(ptr);
+        return (index < m_names.size()) ? m_names[index] : std::string();
     }
 
-    void setVar(const std::string &name, const ExprJIT::Real value)
+private:
+
+    struct alignas(64) Chunk
     {
-        m_vars[name] = value;
-    }
+        ExprJIT::Real values[VARIABLES_CHUNK_SIZE] = {};
+        uint64_t versions[VARIABLES_CHUNK_SIZE] = {};
+    };
 
-    void setFunc(const std::string &name, ExprJIT::Function1Ptr func)
+    ExprJIT::Real* value(size_t index) const
     {
-        m_func1[name] = func;
+        return &m_chunks[index / VARIABLES_CHUNK_SIZE]->values[index % VARIABLES_CHUNK_SIZE];
     }
 
-    void setFunc(const std::string &name, ExprJIT::Function2Ptr func)
+    uint64_t* versionAt(size_t index) const
     {
-        m_func2[name] = func;
+        return &m_chunks[index / VARIABLES_CHUNK_SIZE]->versions[index % VARIABLES_CHUNK_SIZE];
     }
 
-    void setFunc(const std::string &name, ExprJIT::Function3Ptr func)
+    /// Index of a variable, defined with 0 value if it does not exist yet.
+    size_t defineIndex(const std::string &name)
     {
-        m_func3[name] = func;
-    }
+        const auto it = m_index.find(name);
+        if (it != m_index.end()) {
+            return it->second;
+        }
 
-private:
+        const size_t index = m_names.size();
+        if (index % VARIABLES_CHUNK_SIZE == 0) {
+            m_chunks.emplace_back(new Chunk());
+        }
+        m_names.push_back(name);
+        m_index.emplace(name, index);
+        return index;
+    }
 
-    std::map<std::string, ExprJIT::Real> m_vars;
-    std::map<std::string, ExprJIT::Function1Ptr> m_func1;   ///< With 1 argument
-    std::map<std::string, ExprJIT::Function2Ptr> m_func2;   ///< With 2 arguments
-    std::map<std::string, ExprJIT::Function3Ptr> m_func3;   ///< With 3 arguments
+    /// Index of a variable by its value pointer, the size if not found.
+    size_t indexOf(const ExprJIT::Real *ptr) const
+    {
+        for (size_t c = 0; c < m_chunks.size(); c++) {
+            const auto *values = m_chunks[c]->values;
+            if (ptr >= values && ptr < values + VARIABLES_CHUNK_SIZE) {
+                return c * VARIABLES_CHUNK_SIZE + static_cast<size_t>(ptr - values);
+            }
+        }
+        return m_names.size();
+    }
 
+    std::unordered_map<std::string, size_t> m_index;    ///< Variables indices by name.
+    std::vector<std::string> m_names;                   ///< Variables names by index.
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
 };
 
 //----------------------------------------------------------
-//  Expression parser
+//  Symbols table
 //----------------------------------------------------------
-class Parser final
+class SymbolTable
 {
 public:
-    using Node = nj::Node<ExprJIT::Real>;
 
-    Parser(nj::ExpressionNodeFactory &nodeFactory, SymbolTable &symbols)
-        : m_nodeFactory(nodeFactory),
-          m_symbols(symbols),
-          m_error(false),
-          m_message(),
-          m_symbolsCache()
+    /**
+     * @brief Create an empty table.
+     *
+     * The standard functions are not copied into the table, but looked
+     * up in the shared ones after the functions defined by the user,
+     * which take precedence.
+     *
+     * @param storage Variables storage, shared with other tables.
+     */
+    explicit SymbolTable(std::shared_ptr<VariableStorage> storage)
+        : m_vars(std::move(storage))
     {
     }
 
-    inline bool error() const { return m_error; }
-    const std::string& message() const { return m_message; }
-
-    Node& parse(const std::string &str, bool &isConstant, ExprJIT::Real &constValue)
+    const std::shared_ptr<VariableStorage>& storage() const
     {
-        m_symbolsCache.clear();
-
-        std::istringstream ss(str);
-        return parseExpression(ss, isConstant, constValue);
+        return m_vars;
     }
 
-private:
+    ExprJIT::Real* varPtr(const std::string &name) const
+    {
+        return m_vars->find(name);
+    }
 
-// Helper macro to generate parsing error messages
-#define PARSE_ERR m_error=true; MessageConstructor(m_message) << in.tellg() << ": "
+    ExprJIT::Real* defineVar(const std::string &name)
+    {
+        return m_vars->define(name);
+    }
 
-    static void markUnused(Node &node)
+    void setConst(const std::string &name, const ExprJIT::Real value)
     {
-        // TODO: What is the right way to optimize-out a node?
-        node.IncrementParentCount();
+        m_consts[name] = value;
     }
 
     /**
-     * @brief Tells whether  a character is a shitespace.
-     * @param c
-     * @return
+     * @brief Find a constant defined by the user.
+     * @return false if there is no such constant.
      */
-    static inline bool isSpace(int c)
+    bool constant(const std::string &name, ExprJIT::Real &value) const
     {
-        return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+        const auto it = m_consts.find(name);
+        if (it == m_consts.end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
     }
 
     /**
-     * @brief Skip whitespaces in the input stream.
-     *
-     * This will advance the input stream until there is a non-whitespace
-     * character in there, or end of stream.
-     *
-     * @param in
+     * @brief Mark a variable to be compiled as a constant of its value.
      */
-    static void skipSpace(std::istream &in)
+    void setSpecialized(const std::string &name, bool specialized)
     {
-        while(Parser::isSpace(in.peek())) {
-            in.get();
+        if (specialized) {
+            m_specialized.insert(name);
+        } else {
+            m_specialized.erase(name);
         }
     }
 
+    bool isSpecialized(const std::string &name) const
+    {
+        return m_specialized.find(name) != m_specialized.end();
+    }
+
     /**
-     * @brief Extract a positive integer value from the stream.
-     * @param in
-     * @param value
-     * @return
+     * @brief Mark a user function as pure, so that its calls can be memoized.
      */
-    static bool parseInteger(std::istream &in, long long int &value)
+    void setPure(const std::string &name, bool pure)
     {
-        long long int tmp = 0;
-        bool ok = false;
-        auto c = in.peek();
-        while (c >= '0' && c <= '9') {
-            tmp = 10*tmp + in.get() - '0';
-            c = in.peek();
-            ok = true;
-        }
-
-        if (ok) {
-            value = tmp;
+        if (pure) {
+            m_pure.insert(name);
+        } else {
+            m_pure.erase(name);
         }
-
-        return ok;
     }
 
     /**
-     * @brief 1/x function
-     *
-     * NativeJIT does not provide division operation, so we have
-     * to implement it as a function.
-     *
-     * @param x
-     * @return
+     * @brief Whether a function is a standard one, or a user one marked as pure.
      */
-    static ExprJIT::Real invf(ExprJIT::Real x)
+    bool isPure(ExprJIT::Function1Ptr func) const { return isPure(m_func1, func::builtins1, func); }
+    bool isPure(ExprJIT::Function2Ptr func) const { return isPure(m_func2, func::builtins2, func); }
+    bool isPure(ExprJIT::Function3Ptr func) const { return isPure(m_func3, func::builtins3, func); }
+
+    std::string varName(const ExprJIT::Real *ptr) const
+    {
+        return m_vars->name(ptr);
+    }
+
+    std::string funcName(ExprJIT::Function1Ptr func) const { return funcName(m_func1, func::builtins1, func); }
+    std::string funcName(ExprJIT::Function2Ptr func) const { return funcName(m_func2, func::builtins2, func); }
+    std::string funcName(ExprJIT::Function3Ptr func) const { return funcName(m_func3, func::builtins3, func); }
+
+    ExprJIT::Function1Ptr func1Ptr(const std::string &name) const { return funcPtr(m_func1, func::builtins1, name); }
+    ExprJIT::Function2Ptr func2Ptr(const std::string &name) const { return funcPtr(m_func2, func::builtins2, name); }
+    ExprJIT::Function3Ptr func3Ptr(const std::string &name) const { return funcPtr(m_func3, func::builtins3, name); }
+
+    void setVar(const std::string &name, const ExprJIT::Real value)
     {
-        return 1.0 / x;
+        m_vars->set(name, value);
     }
 
     /**
-     * @brief Parse a floating point number.
-     * @param in
-     * @param value Parsed value
-     * @return Floating point immediate value JIT node.
+     * @brief Version of a variable, incremented whenever it is set.
+     * @return Version counter, whose address does not change,
+     *         nullptr if the pointer is not a variable.
      */
-    Node& parseNumber(std::istream &in, ExprJIT::Real &value)
+    uint64_t* varVersion(const ExprJIT::Real *ptr) const
     {
-        ExprJIT::Real tmp = 0.0;
-        long long int tmp_i = 0;
-        long long int tmp_r = 0;
-        long long int tmp_e = 0;
-        bool neg = false;
+        return m_vars->version(ptr);
+    }
 
-        Parser::skipSpace(in);
+    void setFunc(const std::string &name, ExprJIT::Function1Ptr func)
+    {
+        m_func1[name] = func;
+    }
 
-        auto c = in.peek();
-        if (c == '-') {
-            in.get();
-            neg = true;
-        }
+    void setFunc(const std::string &name, ExprJIT::Function2Ptr func)
+    {
+        m_func2[name] = func;
+    }
 
-        bool ok = parseInteger(in, tmp_i);
-        if (ok) {
-            c = in.peek();
-            if (c == '.') {
-                in.get();
-                ok = parseInteger(in, tmp_r);
-                c = in.peek();
-            }
-            if (ok && (c == 'E' || c == 'e')) {
-                in.get();
-                c = in.peek();
-                bool neg = false;
-                if (c == '-') {
-                    in.get();
-                    neg = true;
-                }
-                ok = parseInteger(in, tmp_e);
-                if (ok && neg) {
-                    tmp_e = -tmp_e;
-                }
-            }
-        }
+    void setFunc(const std::string &name, ExprJIT::Function3Ptr func)
+    {
+        m_func3[name] = func;
+    }
 
-        if (ok) {
-            tmp = static_cast<ExprJIT::Real>(tmp_i);
-            long long int i = tmp_r;
-            long long int r = 1;
-            while (i > 0) {
-                i /= 10;
-                r *= 10;
-            }
-            tmp += static_cast<ExprJIT::Real>(tmp_r) / static_cast<ExprJIT::Real>(r);
+private:
 
-            if (tmp_e != 0) {
-                tmp *= pow(10.0, tmp_e);
-            }
+    template <typename F, size_t N>
+    static F funcPtr(const std::map<std::string, F> &funcs, const func::Builtin<F> (&builtins)[N],
+                     const std::string &name)
+    {
+        const auto it = funcs.find(name);
+        return (it != funcs.end()) ? it->second : func::builtin(builtins, name);
+    }
 
-            if (neg) {
-                tmp *= -1.0;
+    template <typename F, size_t N>
+    bool isPure(const std::map<std::string, F> &funcs, const func::Builtin<F> (&builtins)[N], F func) const
+    {
+        for (const auto &f : funcs) {
+            if (f.second == func) {
+                return m_pure.find(f.first) != m_pure.end();
             }
-        } else {
-            PARSE_ERR << "Unable to parse number";
         }
-
-        value = tmp;
-        return m_nodeFactory.Immediate(tmp);
+        return func::builtinName(builtins, func) != nullptr;
     }
 
-    /**
-     * @brief Parse an expression
-     * @param in
-     * @return
-     */
-    Node& parseExpression(std::istream &in, bool &isConstant, ExprJIT::Real &constValue)
+    template <typename F, size_t N>
+    static std::string funcName(const std::map<std::string, F> &funcs, const func::Builtin<F> (&builtins)[N],
+                                F func)
     {
-        return parseAddSub(in, isConstant, constValue);
+        for (const auto &f : funcs) {
+            if (f.second == func) {
+                return f.first;
+            }
+        }
+        const char *name = func::builtinName(builtins, func);
+        return (name != nullptr) ? std::string(name) : std::string();
     }
 
-    /**
-     * @brief Parse a symbol (function or names constant).
-     * @param in
-     * @return
-     */
-    Node& parseSymbol(std::istream &in, bool &isConstant, ExprJIT::Real &constValue)
-    {
-        isConstant = false;
+    std::shared_ptr<VariableStorage> m_vars;
+    std::map<std::string, ExprJIT::Real> m_consts;          ///< User constants
+    std::set<std::string> m_specialized;                    ///< Variables compiled as constants
+    std::set<std::string> m_pure;                           ///< User functions which can be memoized
+    std::map<std::string, ExprJIT::Function1Ptr> m_func1;   ///< User functions with 1 argument
+    std::map<std::string, ExprJIT::Function2Ptr> m_func2;   ///< User functions with 2 arguments
+    std::map<std::string, ExprJIT::Function3Ptr> m_func3;   ///< User functions with 3 arguments
 
-        skipSpace(in);
-        auto c = in.peek();
-        std::string identifier;
+};
 
-        while ((c >= 'a' && c <= 'z') ||
-               (c >= 'A' && c <= 'Z') ||
-               (c >= '0' && c <= '9') ||
-               (c == '_')) {
+//----------------------------------------------------------
+//  CPU features
+//----------------------------------------------------------
 
-            identifier += static_cast<char>(in.get());
-            c = in.peek();
+namespace cpu {
+
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; i++) {
+        regs[i] = static_cast<unsigned>(r[i]);
+    }
+#else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    __get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+}
+
+/**
+ * @brief Returns the OS-enabled register state components (XCR0).
+ */
+static uint64_t xcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax = 0;
+    uint32_t edx = 0;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+/**
+ * @brief Tells whether SSE4.1 instructions (roundsd) are available.
+ */
+static bool hasSSE41()
+{
+    static const bool detected = []() {
+        unsigned regs[4];
+        cpuid(1, 0, regs);
+        return (regs[2] & (1u << 19)) != 0;
+    }();
+
+    return detected;
+}
+
+/**
+ * @brief Widest vector registers usable for the batch kernels.
+ *
+ * Both the CPU and the OS must support the registers (the OS must
+ * preserve them on context switches).
+ *
+ * @param limit Widest registers wanted, in bits.
+ * @param width Vector width, if supported.
+ * @return false if AVX is not available at all, or not wanted.
+ */
+static bool vectorWidth(int limit, nj::VectorWidth &width)
+{
+    static const int detected = []() {
+        unsigned regs[4];
+        cpuid(0, 0, regs);
+        const unsigned maxLeaf = regs[0];
+
+        cpuid(1, 0, regs);
+        const bool osxsave = (regs[2] & (1u << 27)) != 0;
+        const bool avx = (regs[2] & (1u << 28)) != 0;
+        if (!osxsave || !avx) {
+            return 0;
         }
 
-        skipSpace(in);
-        c = in.peek();
-        if (c == '(') {
-            // Function call
-            in.get();
-            bool isC0 = false;
-            ExprJIT::Real cVal0;
-            Node &arg0 = parseTerm(in, isC0, cVal0);
-            Parser::skipSpace(in);
-            c = in.peek();
-            if (c == ')') {
-                in.get();
-                // 1-argument function
-                auto funcPtr = m_symbols.func1Ptr(identifier);
-                if (funcPtr != nullptr) {
-                    if (isC0) {
-                        isConstant = true;
-                        constValue = funcPtr(cVal0);
-                        markUnused(arg0);
-                        return m_nodeFactory.Immediate(constValue);
-                    }
-                    auto &func = m_nodeFactory.Immediate(funcPtr);
-                    return m_nodeFactory.Call(func, arg0);
+        // XMM and YMM state
+        const uint64_t xcr = xcr0();
+        if ((xcr & 0x06) != 0x06) {
+            return 0;
+        }
+
+        if (maxLeaf >= 7) {
+            cpuid(7, 0, regs);
+            const bool avx512f = (regs[1] & (1u << 16)) != 0;
+            // Opmask, upper ZMM0-15 and ZMM16-31 state
+            if (avx512f && (xcr & 0xe0) == 0xe0) {
+                return 512;
+            }
+        }
+
+        return 256;
+    }();
+
+    limit = std::min(limit, detected);
+    if (limit < 256) {
+        return false;
+    }
+
+    width = (limit >= 512) ? nj::VectorWidth::Zmm : nj::VectorWidth::Ymm;
+    return true;
+}
+
+} // namespace cpu
+
+//----------------------------------------------------------
+//  Expression tree
+//----------------------------------------------------------
+
+/**
+ * @brief Compact expression tree.
+ *
+ * The nodes are stored in a single array and refer to their operands
+ * by index. Operands always precede the nodes using them, so the array
+ * order is a valid evaluation order. The tree is built by the parser,
+ * rewritten by the optimization passes, and only then lowered to the
+ * JIT nodes or to the vector code.
+ */
+struct Ast
+{
+    using Index = uint32_t;
+
+    enum class Op : uint8_t
+    {
+        Constant,
+        Variable,
+        Column,     ///< Batch input column, or a function parameter.
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Min,
+        Max,
+        And,        ///< Bitwise and of the values representation.
+        AndNot,     ///< Bitwise and of the first operand complement and the second operand.
+        Or,         ///< Bitwise or of the values representation.
+        Sqrt,
+        Floor,
+        Ceil,
+        Trunc,
+        Less,       ///< 1.0 if true, 0.0 otherwise, as the other comparisons.
+        LessEqual,
+        Equal,
+        NotEqual,
+        Select,     ///< Second operand if the first one is non-zero, third one otherwise.
+        MaskLess,   ///< All bits set if true, cleared otherwise, as the other masks.
+        MaskLessEqual,
+        MaskEqual,
+        MaskNotEqual,
+        Call1,
+        Call2,
+        Call3
+    };
+
+    struct Node
+    {
+        Op op;
+        Index args[3];                                  ///< Operands.
+        union {
+            ExprJIT::Real value;                        ///< Constant value.
+            ExprJIT::Real *variable;                    ///< Variable pointer.
+            int32_t column;                             ///< Column or parameter index.
+            ExprJIT::Function1Ptr function1;
+            ExprJIT::Function2Ptr function2;
+            ExprJIT::Function3Ptr function3;
+        };
+    };
+
+    std::vector<Node> nodes;
+    Index root = 0;
+    std::vector<Index> outputs;     ///< Roots of the fused expressions, if any.
+
+    void clear()
+    {
+        nodes.clear();
+        root = 0;
+        outputs.clear();
+    }
+
+    const Node& operator[](Index index) const
+    {
+        return nodes[index];
+    }
+
+    bool isConstant(Index index) const
+    {
+        return nodes[index].op == Op::Constant;
+    }
+
+    /**
+     * @brief Returns the number of operands of an operation.
+     */
+    static unsigned arity(Op op)
+    {
+        switch (op) {
+        case Op::Constant:
+        case Op::Variable:
+        case Op::Column:
+            return 0;
+        case Op::Sqrt:
+        case Op::Floor:
+        case Op::Ceil:
+        case Op::Trunc:
+        case Op::Call1:
+            return 1;
+        case Op::Select:
+        case Op::Call3:
+            return 3;
+        default:
+            return 2;
+        }
+    }
+
+    static bool isCall(Op op)
+    {
+        return op == Op::Call1 || op == Op::Call2 || op == Op::Call3;
+    }
+
+    static bool isComparison(Op op)
+    {
+        return op == Op::Less || op == Op::LessEqual || op == Op::Equal || op == Op::NotEqual;
+    }
+
+    static bool isMask(Op op)
+    {
+        return op == Op::MaskLess || op == Op::MaskLessEqual || op == Op::MaskEqual || op == Op::MaskNotEqual;
+    }
+
+    static Node make(Op op, Index a = 0, Index b = 0, Index c = 0)
+    {
+        Node node;
+        node.op = op;
+        node.args[0] = a;
+        node.args[1] = b;
+        node.args[2] = c;
+        node.value = 0.0;
+        return node;
+    }
+
+    Index append(const Node &node)
+    {
+        nodes.push_back(node);
+        return static_cast<Index>(nodes.size() - 1);
+    }
+
+    /**
+     * @brief Append the nodes of another tree.
+     * @return Index of the other tree root.
+     */
+    Index append(const Ast &tree)
+    {
+        const auto offset = static_cast<Index>(nodes.size());
+        for (Node node : tree.nodes) {
+            for (unsigned k = 0; k < arity(node.op); k++) {
+                node.args[k] += offset;
+            }
+            nodes.push_back(node);
+        }
+        return tree.root + offset;
+    }
+
+    Index constant(ExprJIT::Real value)
+    {
+        Node node = make(Op::Constant);
+        node.value = value;
+        return append(node);
+    }
+
+    Index variable(ExprJIT::Real *ptr)
+    {
+        Node node = make(Op::Variable);
+        node.variable = ptr;
+        return append(node);
+    }
+
+    Index column(int32_t index)
+    {
+        Node node = make(Op::Column);
+        node.column = index;
+        return append(node);
+    }
+
+    Index operation(Op op, Index a, Index b = 0, Index c = 0)
+    {
+        return append(make(op, a, b, c));
+    }
+
+    Index call(ExprJIT::Function1Ptr func, Index a)
+    {
+        Node node = make(Op::Call1, a);
+        node.function1 = func;
+        return append(node);
+    }
+
+    Index call(ExprJIT::Function2Ptr func, Index a, Index b)
+    {
+        Node node = make(Op::Call2, a, b);
+        node.function2 = func;
+        return append(node);
+    }
+
+    Index call(ExprJIT::Function3Ptr func, Index a, Index b, Index c)
+    {
+        Node node = make(Op::Call3, a, b, c);
+        node.function3 = func;
+        return append(node);
+    }
+};
+
+//----------------------------------------------------------
+//  Optimization passes
+//----------------------------------------------------------
+
+/**
+ * @brief Base class of the expression tree passes.
+ *
+ * A pass rebuilds the tree bottom-up. Every node reachable from the root
+ * is given to rewrite() with its operands already rewritten, and the
+ * index of its replacement in the new tree is returned. Nodes which are
+ * not reachable anymore are dropped, so the folded subexpressions never
+ * make it to the JIT.
+ */
+class AstPass
+{
+public:
+
+    virtual ~AstPass() = default;
+
+    Ast run(const Ast &in)
+    {
+        prepare(in);
+
+        const auto reachable = reachableNodes(in);
+        Ast tmp;
+        std::vector<Ast::Index> map(in.nodes.size(), 0);
+        for (size_t i = 0; i < in.nodes.size(); i++) {
+            if (reachable[i]) {
+                Ast::Node node = in.nodes[i];
+                for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                    node.args[k] = map[node.args[k]];
                 }
-            } else if (c == ',') {
-                in.get();
-                bool isC1 = false;
-                ExprJIT::Real cVal1;
-                Node &arg1 = parseTerm(in, isC1, cVal1);
-                Parser::skipSpace(in);
-                c = in.peek();
-                if (c == ')') {
-                    in.get();
-                    // 2-arguments
-                    auto funcPtr = m_symbols.func2Ptr(identifier);
-                    if (funcPtr != nullptr) {
-                        if (isC0 && isC1) {
-                            isConstant = true;
-                            constValue = funcPtr(cVal0, cVal1);
-                            markUnused(arg0);
-                            markUnused(arg1);
-                            return m_nodeFactory.Immediate(constValue);
-                        }
-                        auto &func = m_nodeFactory.Immediate(funcPtr);
-                        return m_nodeFactory.Call(func, arg0, arg1);
-                    }
-                } else if (c == ',') {
-                    in.get();
-                    bool isC2 = false;
-                    ExprJIT::Real cVal2;
-                    Node &arg2 = parseTerm(in, isC2, cVal2);
-                    Parser::skipSpace(in);
-                    c = in.peek();
-                    if (c == ')') {
-                        in.get();
-                        // 3-arguments
-                        auto funcPtr = m_symbols.func3Ptr(identifier);
-                        if (funcPtr != nullptr) {
-                            if (isC0 && isC1 && isC2) {
-                                isConstant = true;
-                                constValue = funcPtr(cVal0, cVal1, cVal2);
-                                markUnused(arg0);
-                                markUnused(arg1);
-                                markUnused(arg2);
-                                return m_nodeFactory.Immediate(constValue);
-                            }
-                            auto &func = m_nodeFactory.Immediate(funcPtr);
-                            return m_nodeFactory.Call(func, arg0, arg1, arg2);
-                        }
-                    } else if (c == ',') {
-                        // Too many arguments
-                        PARSE_ERR << "Too many arguments for '" << identifier << "' function call";
-                        return m_nodeFactory.Immediate(0.0);
-                    }
+                map[i] = rewrite(tmp, node, static_cast<Ast::Index>(i));
+            }
+        }
+        tmp.root = map[in.root];
+        for (const auto output : in.outputs) {
+            tmp.outputs.push_back(map[output]);
+        }
+
+        // The rewritten nodes may have made some of the others unreachable.
+        Ast out;
+        const auto used = reachableNodes(tmp);
+        map.assign(tmp.nodes.size(), 0);
+        for (size_t i = 0; i < tmp.nodes.size(); i++) {
+            if (used[i]) {
+                Ast::Node node = tmp.nodes[i];
+                for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                    node.args[k] = map[node.args[k]];
                 }
+                map[i] = out.append(node);
             }
+        }
+        out.root = map[tmp.root];
+        for (const auto output : tmp.outputs) {
+            out.outputs.push_back(map[output]);
+        }
 
-        } else {
+        return out;
+    }
 
-            // Variable reference
-            ExprJIT::Real *ptr = m_symbols.varPtr(identifier);
-            if (ptr != nullptr) {
-                // Look of there is a cached node for this variable
-                auto it = m_symbolsCache.find(identifier);
-                if (it == m_symbolsCache.end()) {
-                    // Create the reference node and cache it
-                    auto &imm = m_nodeFactory.Immediate(ptr);
-                    auto &node = m_nodeFactory.Deref(imm);
-                    m_symbolsCache.insert(std::pair<std::string, Node&>(identifier, node));
-                    return node;
-                } else {
-                    // Return cached node
-                    return it->second;
+protected:
+
+    /**
+     * @brief Called before the tree is rewritten.
+     * @param in Original tree.
+     */
+    virtual void prepare(const Ast &in)
+    {
+        (void)in;
+    }
+
+    /**
+     * @brief Rewrite a node.
+     * @param out Tree being built.
+     * @param node Node with its operands referring to the out tree.
+     * @param index Index of the node in the original tree.
+     * @return Index of the node replacement in the out tree.
+     */
+    virtual Ast::Index rewrite(Ast &out, const Ast::Node &node, Ast::Index index) = 0;
+
+private:
+
+    static std::vector<bool> reachableNodes(const Ast &ast)
+    {
+        std::vector<bool> reachable(ast.nodes.size(), false);
+        if (ast.nodes.empty()) {
+            return reachable;
+        }
+
+        reachable[ast.root] = true;
+        for (const auto output : ast.outputs) {
+            reachable[output] = true;
+        }
+        for (size_t i = ast.nodes.size(); i-- > 0;) {
+            if (reachable[i]) {
+                const auto &node = ast.nodes[i];
+                for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                    reachable[node.args[k]] = true;
                 }
             }
         }
+        return reachable;
+    }
+};
 
-        PARSE_ERR << "Unknown symbol '" << identifier << "'";
-        return m_nodeFactory.Immediate(0.0);
+/**
+ * @brief Whether a call node calls a pure function.
+ */
+static bool isPureCall(const SymbolTable &symbols, const Ast::Node &node)
+{
+    switch (node.op) {
+    case Ast::Op::Call1:
+        return symbols.isPure(node.function1);
+    case Ast::Op::Call2:
+        return symbols.isPure(node.function2);
+    case Ast::Op::Call3:
+        return symbols.isPure(node.function3);
+    default:
+        return false;
     }
+}
+
+/**
+ * @brief Replaces operations on constants with their results.
+ *
+ * Calls of the pure functions are evaluated as well, the other ones
+ * being left to be called on every evaluation.
+ */
+class ConstantFolding final : public AstPass
+{
+public:
 
-    Node& parseTerm(std::istream &in, bool &isConstant, ExprJIT::Real &constValue)
+    explicit ConstantFolding(const SymbolTable &symbols)
+        : m_symbols(symbols)
     {
-        isConstant = false;
+    }
 
-        skipSpace(in);
-        auto c = in.peek();
-        if ((c >= '0' && c <= '9')) {
-            isConstant = true;
-            return parseNumber(in, constValue);
-        } else if (c == '-') {
-            in.get();
-            c = in.peek();
-            if ((c >= '0' && c <= '9')) {
-                in.putback('-');
-                isConstant = true;
-                return parseNumber(in, constValue);
+protected:
+
+    Ast::Index rewrite(Ast &out, const Ast::Node &node, Ast::Index) override
+    {
+        const unsigned arity = Ast::arity(node.op);
+        if (arity == 0 || (Ast::isCall(node.op) && !isPureCall(m_symbols, node))) {
+            return out.append(node);
+        }
+
+        if (node.op == Ast::Op::Select && out.isConstant(node.args[0])) {
+            return (out[node.args[0]].value != 0.0) ? node.args[1] : node.args[2];
+        }
+
+        ExprJIT::Real v[3] = { 0.0, 0.0, 0.0 };
+        for (unsigned k = 0; k < arity; k++) {
+            if (!out.isConstant(node.args[k])) {
+                return out.append(node);
+            }
+            v[k] = out[node.args[k]].value;
+        }
+
+        return out.constant(evaluate(node, v));
+    }
+
+private:
+
+    static ExprJIT::Real bitwise(Ast::Op op, ExprJIT::Real a, ExprJIT::Real b)
+    {
+        uint64_t x;
+        uint64_t y;
+        std::memcpy(&x, &a, sizeof(x));
+        std::memcpy(&y, &b, sizeof(y));
+        if (op == Ast::Op::And) {
+            x = x & y;
+        } else if (op == Ast::Op::AndNot) {
+            x = ~x & y;
+        } else {
+            x = x | y;
+        }
+        ExprJIT::Real r;
+        std::memcpy(&r, &x, sizeof(r));
+        return r;
+    }
+
+    /**
+     * @brief Evaluates an operation the same way the generated code does.
+     */
+    static ExprJIT::Real mask(bool condition)
+    {
+        const uint64_t bits = condition ? ~uint64_t(0) : 0;
+        ExprJIT::Real r;
+        std::memcpy(&r, &bits, sizeof(r));
+        return r;
+    }
+
+    static ExprJIT::Real evaluate(const Ast::Node &node, const ExprJIT::Real *v)
+    {
+        using Op = Ast::Op;
+
+        switch (node.op) {
+        case Op::Add:   return v[0] + v[1];
+        case Op::Sub:   return v[0] - v[1];
+        case Op::Mul:   return v[0] * v[1];
+        case Op::Div:   return v[0] / v[1];
+        case Op::Min:   return (v[0] < v[1]) ? v[0] : v[1];
+        case Op::Max:   return (v[0] > v[1]) ? v[0] : v[1];
+        case Op::And:
+        case Op::AndNot:
+        case Op::Or:    return bitwise(node.op, v[0], v[1]);
+        case Op::Sqrt:  return std::sqrt(v[0]);
+        case Op::Floor: return std::floor(v[0]);
+        case Op::Ceil:  return std::ceil(v[0]);
+        case Op::Trunc: return std::trunc(v[0]);
+        case Op::Less:      return (v[0] < v[1]) ? 1.0 : 0.0;
+        case Op::LessEqual: return (v[0] <= v[1]) ? 1.0 : 0.0;
+        case Op::Equal:     return (v[0] == v[1]) ? 1.0 : 0.0;
+        case Op::NotEqual:  return (v[0] != v[1]) ? 1.0 : 0.0;
+        case Op::Select:    return (v[0] != 0.0) ? v[1] : v[2];
+        case Op::MaskLess:      return mask(v[0] < v[1]);
+        case Op::MaskLessEqual: return mask(v[0] <= v[1]);
+        case Op::MaskEqual:     return mask(v[0] == v[1]);
+        case Op::MaskNotEqual:  return mask(v[0] != v[1]);
+        case Op::Call1: return node.function1(v[0]);
+        case Op::Call2: return node.function2(v[0], v[1]);
+        case Op::Call3: return node.function3(v[0], v[1], v[2]);
+        default:
+            break;
+        }
+
+        return node.value;
+    }
+
+    const SymbolTable &m_symbols;
+};
+
+/**
+ * @brief Gathers the constants of addition and multiplication chains.
+ *
+ * A chain like `2*x*y/3` is rewritten as `x*y*(2/3)`, the constant
+ * being accumulated left to right. The chain operands are the left
+ * operands of the same kind of operations, so `x*(2*y)` is not
+ * reassociated.
+ */
+class Simplification final : public AstPass
+{
+protected:
+
+    void prepare(const Ast &in) override
+    {
+        // Nodes continued by a chain are rewritten along with the chain.
+        m_chained.assign(in.nodes.size(), false);
+        for (const auto &node : in.nodes) {
+            if (kind(node.op) != Kind::None && kind(in[node.args[0]].op) == kind(node.op)) {
+                m_chained[node.args[0]] = true;
+            }
+        }
+    }
+
+    Ast::Index rewrite(Ast &out, const Ast::Node &node, Ast::Index index) override
+    {
+        const Kind k = kind(node.op);
+        if (k == Kind::None || m_chained[index]) {
+            return out.append(node);
+        }
+
+        // -0.0 is the additive identity: -0.0 + 0.0 is 0.0, while
+        // 0.0 + -0.0 would lose the sign of the result.
+        Chain chain;
+        chain.accumulator = (k == Kind::Sum) ? -0.0 : 1.0;
+        gather(out, node, chain);
+
+        return (k == Kind::Sum) ? sum(out, chain) : product(out, chain);
+    }
+
+private:
+
+    enum class Kind
+    {
+        None,
+        Sum,
+        Product
+    };
+
+    struct Chain
+    {
+        ExprJIT::Real accumulator;
+        std::vector<Ast::Index> direct;     ///< Added or multiplied operands.
+        std::vector<Ast::Index> inverse;    ///< Subtracted or divided operands.
+    };
+
+    static Kind kind(Ast::Op op)
+    {
+        switch (op) {
+        case Ast::Op::Add:
+        case Ast::Op::Sub:
+            return Kind::Sum;
+        case Ast::Op::Mul:
+        case Ast::Op::Div:
+            return Kind::Product;
+        default:
+            return Kind::None;
+        }
+    }
+
+    static void operand(const Ast &ast, Ast::Index index, bool inverse, Kind k, Chain &chain)
+    {
+        if (ast.isConstant(index)) {
+            const ExprJIT::Real v = ast[index].value;
+            if (k == Kind::Sum) {
+                chain.accumulator = inverse ? chain.accumulator - v : chain.accumulator + v;
             } else {
-                bool isC = false;
-                ExprJIT::Real cVal;
-                Node &rnode = parseTerm(in, isC, cVal);
-                if (isC) {
-                    markUnused(rnode);
-                    cVal = -cVal;
-                    isConstant = true;
-                    constValue = cVal;
-                    return m_nodeFactory.Immediate(cVal);
-                } else {
-                    Node &lnode = m_nodeFactory.Immediate(0.0);
-                    return m_nodeFactory.Sub(lnode, rnode);
-                }
+                chain.accumulator = inverse ? chain.accumulator / v : chain.accumulator * v;
             }
-        } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c == '_')) {
-            return parseSymbol(in, isConstant, constValue);
-        } else if (c == '(') {
-            in.get();
-            auto &n = parseExpression(in, isConstant, constValue);
-            if (!m_error) {
-                skipSpace(in);
-                c = in.peek();
-                if (c == ')') {
-                    in.get();
-                } else {
-                    PARSE_ERR << "Expected ')'";
-                }
+        } else if (inverse) {
+            chain.inverse.push_back(index);
+        } else {
+            chain.direct.push_back(index);
+        }
+    }
+
+    static void gather(const Ast &ast, const Ast::Node &node, Chain &chain)
+    {
+        const Kind k = kind(node.op);
+
+        // Walk down the left operands
+        std::vector<const Ast::Node*> spine { &node };
+        while (kind(ast[spine.back()->args[0]].op) == k) {
+            spine.push_back(&ast[spine.back()->args[0]]);
+        }
+
+        operand(ast, spine.back()->args[0], false, k, chain);
+        for (auto it = spine.rbegin(); it != spine.rend(); ++it) {
+            const bool inverse = (*it)->op == Ast::Op::Sub || (*it)->op == Ast::Op::Div;
+            operand(ast, (*it)->args[1], inverse, k, chain);
+        }
+    }
+
+    static Ast::Index sum(Ast &out, const Chain &chain)
+    {
+        using Op = Ast::Op;
+
+        if (!chain.direct.empty()) {
+            Ast::Index n = fold(out, Op::Add, chain.direct, 0, chain.direct.size());
+            n = unfold(out, Op::Sub, Op::Add, n, chain.inverse);
+            if (chain.accumulator != 0.0) {
+                n = out.operation(Op::Add, n, out.constant(chain.accumulator));
             }
             return n;
-        } else {
-            PARSE_ERR << "Unexpected character '" << static_cast<char>(c) << "'";
         }
 
-        return m_nodeFactory.Immediate(0.0);
-    }
+        if (!chain.inverse.empty()) {
+            return unfold(out, Op::Sub, Op::Add, out.constant(chain.accumulator), chain.inverse);
+        }
+
+        return out.constant(chain.accumulator);
+    }
+
+    static Ast::Index product(Ast &out, const Chain &chain)
+    {
+        using Op = Ast::Op;
+
+        if (!chain.direct.empty()) {
+            Ast::Index n = fold(out, Op::Mul, chain.direct, 0, chain.direct.size());
+            // Divisions are kept in order: x/y/z is not x/(y*z).
+            n = unfold(out, Op::Div, Op::Mul, n, chain.inverse);
+            if (chain.accumulator != 1.0) {
+                n = out.operation(Op::Mul, n, out.constant(chain.accumulator));
+            }
+            return n;
+        }
+
+        if (!chain.inverse.empty()) {
+            return unfold(out, Op::Div, Op::Mul, out.constant(chain.accumulator), chain.inverse);
+        }
+
+        return out.constant(chain.accumulator);
+    }
+
+    /**
+     * @brief Combine the operands in order, or as a balanced tree of
+     *        the in order chains if there are more than CHAIN_MAX_LENGTH.
+     */
+    static Ast::Index fold(Ast &out, Ast::Op op, const std::vector<Ast::Index> &operands, size_t begin, size_t end)
+    {
+        if (end - begin > CHAIN_MAX_LENGTH) {
+            const size_t middle = begin + (end - begin) / 2;
+            const auto l = fold(out, op, operands, begin, middle);
+            const auto r = fold(out, op, operands, middle, end);
+            return out.operation(op, l, r);
+        }
+
+        Ast::Index n = operands.at(begin);
+        for (size_t i = begin + 1; i < end; i++) {
+            n = out.operation(op, n, operands.at(i));
+        }
+        return n;
+    }
+
+    /**
+     * @brief Subtract (divide) the operands in order, or their folded
+     *        sum (product) if there are more than CHAIN_MAX_LENGTH.
+     */
+    static Ast::Index unfold(Ast &out, Ast::Op op, Ast::Op inverse, Ast::Index n, const std::vector<Ast::Index> &operands)
+    {
+        if (operands.size() > CHAIN_MAX_LENGTH) {
+            return out.operation(op, n, fold(out, inverse, operands, 0, operands.size()));
+        }
+
+        for (auto s : operands) {
+            n = out.operation(op, n, s);
+        }
+        return n;
+    }
+
+    std::vector<bool> m_chained;
+};
+
+/**
+ * @brief Replaces calls to the builtin functions having instruction forms.
+ */
+class BuiltinsInlining final : public AstPass
+{
+protected:
+
+    Ast::Index rewrite(Ast &out, const Ast::Node &node, Ast::Index) override
+    {
+        using Op = Ast::Op;
+        const Ast::Index *args = node.args;
+
+        switch (node.op) {
+        case Op::Call1:
+            if (node.function1 == func::sqrt) {
+                return out.operation(Op::Sqrt, args[0]);
+            } else if (node.function1 == func::abs) {
+                return abs(out, args[0]);
+            } else if (cpu::hasSSE41()) {
+                if (node.function1 == func::floor) {
+                    return out.operation(Op::Floor, args[0]);
+                } else if (node.function1 == func::ceil) {
+                    return out.operation(Op::Ceil, args[0]);
+                } else if (node.function1 == func::round) {
+                    return round(out, args[0]);
+                }
+            }
+            break;
+        case Op::Call2:
+            if (node.function2 == func::min) {
+                return out.operation(Op::Min, args[0], args[1]);
+            } else if (node.function2 == func::max) {
+                return out.operation(Op::Max, args[0], args[1]);
+            }
+            break;
+        case Op::Call3:
+            if (node.function3 == func::clamp) {
+                return out.operation(Op::Max, args[1], out.operation(Op::Min, args[2], args[0]));
+            }
+            break;
+        default:
+            break;
+        }
+
+        return out.append(node);
+    }
+
+private:
+
+    static Ast::Index abs(Ast &out, Ast::Index x)
+    {
+        // Clear the sign bit
+        const uint64_t bits = ~(uint64_t(1) << 63);
+        ExprJIT::Real mask;
+        std::memcpy(&mask, &bits, sizeof(mask));
+        return out.operation(Ast::Op::And, x, out.constant(mask));
+    }
+
+    static Ast::Index round(Ast &out, Ast::Index x)
+    {
+        // Round half away from zero: trunc(x + copysign(h, x)), where h is
+        // the largest double below 0.5. Adding 0.5 instead would round up
+        // the values just below 0.5, like 0.49999999999999994.
+        const auto sign = out.operation(Ast::Op::And, x, out.constant(-0.0));
+        const auto half = out.operation(Ast::Op::Or, sign, out.constant(0.49999999999999994));
+        return out.operation(Ast::Op::Trunc, out.operation(Ast::Op::Add, x, half));
+    }
+};
+
+/**
+ * @brief Replaces the powers having constant exponents.
+ *
+ * Integer exponents become multiplication chains, computing x^n with
+ * at most 2*log2(n) multiplications, and the negative ones their
+ * reciprocals. Exponents 0.5 and -0.5 become square roots. The results
+ * may differ from pow() in the last bits, and for -0.0 and -inf raised
+ * to 0.5, pow() giving +0.0 and +inf.
+ */
+class PowerReduction final : public AstPass
+{
+protected:
+
+    Ast::Index rewrite(Ast &out, const Ast::Node &node, Ast::Index) override
+    {
+        using Op = Ast::Op;
+
+        if (node.op != Op::Call2 || node.function2 != func::pow || !out.isConstant(node.args[1])) {
+            return out.append(node);
+        }
+
+        const Ast::Index x = node.args[0];
+        const ExprJIT::Real exponent = out[node.args[1]].value;
+        const ExprJIT::Real magnitude = std::fabs(exponent);
+
+        if (magnitude == 0.5) {
+            const auto root = out.operation(Op::Sqrt, x);
+            return (exponent < 0.0) ? out.operation(Op::Div, out.constant(1.0), root) : root;
+        }
+
+        if (magnitude > maxExponent || magnitude != std::floor(magnitude)) {
+            return out.append(node);
+        }
+
+        if (magnitude == 0.0) {
+            // pow(x, 0) is 1 for any x, NaN included.
+            return out.constant(1.0);
+        }
+
+        const auto power = multiplications(out, x, static_cast<unsigned>(magnitude));
+        return (exponent < 0.0) ? out.operation(Op::Div, out.constant(1.0), power) : power;
+    }
+
+private:
+
+    /// Larger exponents are left to pow(), the chains accumulating rounding errors.
+    static constexpr ExprJIT::Real maxExponent = 32.0;
+
+    /**
+     * @brief Builds x^n by squaring.
+     */
+    static Ast::Index multiplications(Ast &out, Ast::Index x, unsigned n)
+    {
+        Ast::Index square = x;
+        Ast::Index result = 0;
+        bool first = true;
+
+        while (true) {
+            if (n & 1) {
+                result = first ? square : out.operation(Ast::Op::Mul, result, square);
+                first = false;
+            }
+            n >>= 1;
+            if (n == 0) {
+                break;
+            }
+            square = out.operation(Ast::Op::Mul, square, square);
+        }
+
+        return result;
+    }
+};
+
+/**
+ * @brief Shares the structurally identical subexpressions.
+ *
+ * The tree is hash-consed: a node having the same operation, operands
+ * and payload as a preceding one is replaced by it. Operands being
+ * shared first, the identical subtrees of any depth are found in one
+ * pass. The shared nodes become the DAG nodes NativeJIT evaluates once.
+ *
+ * Calls of the pure functions are shared as well, as for the constant
+ * folding. Every call of the other functions is kept.
+ */
+class CommonSubexpressions final : public AstPass
+{
+public:
+
+    explicit CommonSubexpressions(const SymbolTable &symbols)
+        : m_symbols(symbols)
+    {
+    }
+
+protected:
+
+    void prepare(const Ast&) override
+    {
+        m_nodes.clear();
+    }
+
+    Ast::Index rewrite(Ast &out, const Ast::Node &node, Ast::Index) override
+    {
+        if (Ast::isCall(node.op) && !isPureCall(m_symbols, node)) {
+            return out.append(node);
+        }
+
+        const auto key = makeKey(node);
+        auto it = m_nodes.find(key);
+        if (it != m_nodes.end()) {
+            return it->second;
+        }
+
+        const auto index = out.append(node);
+        m_nodes.insert(std::make_pair(key, index));
+        return index;
+    }
+
+private:
+
+    using Key = std::tuple<Ast::Op, Ast::Index, Ast::Index, Ast::Index, uint64_t>;
+
+    static Key makeKey(const Ast::Node &node)
+    {
+        using Op = Ast::Op;
+
+        uint64_t payload = 0;
+        switch (node.op) {
+        case Op::Constant:
+            // Compare the representations, so that 0.0 and -0.0 differ.
+            std::memcpy(&payload, &node.value, sizeof(payload));
+            break;
+        case Op::Variable:
+            payload = reinterpret_cast<uint64_t>(node.variable);
+            break;
+        case Op::Column:
+            payload = static_cast<uint64_t>(node.column);
+            break;
+        case Op::Call1:
+            payload = reinterpret_cast<uint64_t>(node.function1);
+            break;
+        case Op::Call2:
+            payload = reinterpret_cast<uint64_t>(node.function2);
+            break;
+        case Op::Call3:
+            payload = reinterpret_cast<uint64_t>(node.function3);
+            break;
+        default:
+            break;
+        }
+
+        const unsigned arity = Ast::arity(node.op);
+        Ast::Index args[3] = { 0, 0, 0 };
+        for (unsigned k = 0; k < arity; k++) {
+            args[k] = node.args[k];
+        }
+
+        // x*y is y*x. Not so for min and max, which return the second
+        // operand when either is NaN.
+        if ((node.op == Op::Add || node.op == Op::Mul) && args[1] < args[0]) {
+            std::swap(args[0], args[1]);
+        }
+
+        return std::make_tuple(node.op, args[0], args[1], args[2], payload);
+    }
+
+    const SymbolTable &m_symbols;
+    std::map<Key, Ast::Index> m_nodes;
+};
+
+/**
+ * @brief Limits the number of the shared nodes.
+ *
+ * NativeJIT evaluates the shared nodes first and keeps their values in
+ * the stack frame until their last use, the frame being limited to 4 KB.
+ * If there are more than CSE_MAX_SHARED_NODES of them, the ones which
+ * would be the most expensive to evaluate again are kept shared, and
+ * the others are copied for every parent.
+ */
+class SharingLimit final
+{
+public:
+
+    Ast run(const Ast &in)
+    {
+        const size_t count = in.nodes.size();
+
+        // Sizes of the subtrees once all their nodes copied
+        std::vector<unsigned> parents(count, 0);
+        std::vector<double> sizes(count, 1.0);
+        for (size_t i = 0; i < count; i++) {
+            const auto &node = in.nodes[i];
+            for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                parents[node.args[k]]++;
+                sizes[i] += sizes[node.args[k]];
+            }
+        }
+
+        std::vector<Ast::Index> shared;
+        for (size_t i = 0; i < count; i++) {
+            if (parents[i] > 1) {
+                shared.push_back(static_cast<Ast::Index>(i));
+            }
+        }
+        if (shared.size() <= CSE_MAX_SHARED_NODES) {
+            return in;
+        }
+
+        std::stable_sort(shared.begin(), shared.end(), [&](Ast::Index a, Ast::Index b) {
+            return (parents[a] - 1) * sizes[a] > (parents[b] - 1) * sizes[b];
+        });
+        m_keep.assign(count, false);
+        for (size_t i = 0; i < CSE_MAX_SHARED_NODES; i++) {
+            m_keep[shared[i]] = true;
+        }
+
+        m_kept.assign(count, NONE);
+        Ast out;
+        out.root = copy(in, out, in.root);
+        for (const auto output : in.outputs) {
+            out.outputs.push_back(copy(in, out, output));
+        }
+        return out;
+    }
+
+private:
+
+    static constexpr Ast::Index NONE = std::numeric_limits<Ast::Index>::max();
+
+    Ast::Index copy(const Ast &in, Ast &out, Ast::Index index)
+    {
+        if (m_kept[index] != NONE) {
+            return m_kept[index];
+        }
+
+        Ast::Node node = in[index];
+        for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+            node.args[k] = copy(in, out, node.args[k]);
+        }
+
+        const auto n = out.append(node);
+        if (m_keep[index]) {
+            m_kept[index] = n;
+        }
+        return n;
+    }
+
+    std::vector<bool> m_keep;           ///< Nodes kept shared.
+    std::vector<Ast::Index> m_kept;     ///< Copies of the nodes kept shared.
+};
+
+/**
+ * @brief Splits the subtrees worth memoizing out of an expression tree.
+ *
+ * A subtree calling a pure function, and depending on some of the
+ * expression variables only, is compiled on its own. The standard
+ * functions are pure, the user ones only once marked so; the subtrees
+ * calling any other function are not memoized. Its value is kept in a slot
+ * read by the expression as a variable. The code reading the slot, see
+ * Lowering::bindMemos(), calls the subtree function again only once any
+ * of its variables has changed. The largest subtrees depending
+ * on the same variables are taken, the outermost ones first. Trees of
+ * more than 64 variables are not split.
+ */
+class Memoization final
+{
+public:
+
+    struct Subtree
+    {
+        Ast ast;
+        ExprJIT::Real *slot;                    ///< Slot of the subtree value.
+        std::vector<ExprJIT::Real*> variables;  ///< Variables the subtree depends on.
+    };
+
+    /**
+     * @brief Split the memoized subtrees.
+     * @param in Optimized expression tree.
+     * @param symbols Symbols table telling the pure functions.
+     * @param slots Slots of the subtrees values, MEMO_MAX_SUBTREES of them.
+     * @param subtrees Memoized subtrees, in the evaluation order.
+     * @return Expression tree reading the subtrees values from the slots.
+     */
+    static Ast split(const Ast &in, const SymbolTable &symbols, ExprJIT::Real *slots, std::vector<Subtree> &subtrees)
+    {
+        subtrees.clear();
+
+        const size_t count = in.nodes.size();
+        std::vector<ExprJIT::Real*> variables;
+        std::vector<uint64_t> deps(count, 0);
+        std::vector<bool> calls(count, false);      // Calls a pure function.
+        std::vector<bool> impure(count, false);     // Calls another function.
+        for (size_t i = 0; i < count; i++) {
+            const auto &node = in.nodes[i];
+            if (node.op == Ast::Op::Variable) {
+                auto it = std::find(variables.begin(), variables.end(), node.variable);
+                if (it == variables.end()) {
+                    if (variables.size() == 64) {
+                        return in;
+                    }
+                    it = variables.insert(it, node.variable);
+                }
+                deps[i] = uint64_t(1) << (it - variables.begin());
+            }
+            if (Ast::isCall(node.op)) {
+                calls[i] = isPureCall(symbols, node);
+                impure[i] = !calls[i];
+            }
+            for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                deps[i] |= deps[node.args[k]];
+                calls[i] = calls[i] || calls[node.args[k]];
+                impure[i] = impure[i] || impure[node.args[k]];
+            }
+        }
+
+        // Subtrees used by a parent not depending on the same variables
+        std::vector<bool> candidate(count, false);
+        std::vector<bool> exposed(count, false);
+        for (size_t i = 0; i < count; i++) {
+            candidate[i] = calls[i] && !impure[i] && deps[i] != 0 && deps[i] != deps[in.root];
+            const auto &node = in.nodes[i];
+            for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                if (!candidate[i] || deps[node.args[k]] != deps[i]) {
+                    exposed[node.args[k]] = true;
+                }
+            }
+        }
+
+        std::vector<ExprJIT::Real*> replaced(count, nullptr);
+        std::vector<Ast::Index> memoized;
+        for (size_t i = count; i-- > 0 && memoized.size() < MEMO_MAX_SUBTREES;) {
+            if (candidate[i] && exposed[i]) {
+                replaced[i] = &slots[memoized.size()];
+                memoized.push_back(static_cast<Ast::Index>(i));
+            }
+        }
+
+        // Inner subtrees are evaluated first
+        for (auto it = memoized.rbegin(); it != memoized.rend(); ++it) {
+            Subtree subtree;
+            subtree.ast = extract(in, *it, replaced);
+            subtree.slot = replaced[*it];
+            for (size_t v = 0; v < variables.size(); v++) {
+                if (deps[*it] & (uint64_t(1) << v)) {
+                    subtree.variables.push_back(variables[v]);
+                }
+            }
+            subtrees.push_back(std::move(subtree));
+        }
+
+        return extract(in, in.root, replaced);
+    }
+
+private:
+
+    /// Copy a subtree, the replaced nodes below its root becoming variables.
+    static Ast extract(const Ast &in, Ast::Index root, const std::vector<ExprJIT::Real*> &replaced)
+    {
+        std::vector<bool> used(root + 1, false);
+        used[root] = true;
+        for (size_t i = root + 1; i-- > 0;) {
+            if (used[i] && (i == root || replaced[i] == nullptr)) {
+                const auto &node = in.nodes[i];
+                for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                    used[node.args[k]] = true;
+                }
+            }
+        }
+
+        Ast out;
+        std::vector<Ast::Index> map(root + 1, 0);
+        for (size_t i = 0; i <= root; i++) {
+            if (!used[i]) {
+                continue;
+            }
+            if (i != root && replaced[i] != nullptr) {
+                map[i] = out.variable(replaced[i]);
+                continue;
+            }
+            Ast::Node node = in.nodes[i];
+            for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                node.args[k] = map[node.args[k]];
+            }
+            map[i] = out.append(node);
+        }
+        out.root = map[root];
+        return out;
+    }
+};
+
+/**
+ * @brief Replaces the comparisons and selects with bitwise operations.
+ *
+ * Used for the vector code, which can not branch. A comparison becomes
+ * a mask with all the bits set where it is true, and c ? a : b becomes
+ * (mask & a) | (~mask & b).
+ */
+class MaskLowering final : public AstPass
+{
+protected:
+
+    Ast::Index rewrite(Ast &out, const Ast::Node &node, Ast::Index) override
+    {
+        using Op = Ast::Op;
+        const Ast::Index *args = node.args;
+
+        switch (node.op) {
+        case Op::Less:
+            return value(out, out.operation(Op::MaskLess, args[0], args[1]));
+        case Op::LessEqual:
+            return value(out, out.operation(Op::MaskLessEqual, args[0], args[1]));
+        case Op::Equal:
+            return value(out, out.operation(Op::MaskEqual, args[0], args[1]));
+        case Op::NotEqual:
+            return value(out, out.operation(Op::MaskNotEqual, args[0], args[1]));
+        case Op::Select: {
+            const auto m = mask(out, args[0]);
+            return out.operation(Op::Or,
+                                 out.operation(Op::And, m, args[1]),
+                                 out.operation(Op::AndNot, m, args[2]));
+        }
+        default:
+            break;
+        }
+
+        return out.append(node);
+    }
+
+private:
+
+    static Ast::Index value(Ast &out, Ast::Index mask)
+    {
+        return out.operation(Ast::Op::And, mask, out.constant(1.0));
+    }
+
+    static Ast::Index mask(Ast &out, Ast::Index condition)
+    {
+        // The comparisons have been replaced with their values already.
+        const auto &node = out[condition];
+        if (node.op == Ast::Op::And && Ast::isMask(out[node.args[0]].op) &&
+            out.isConstant(node.args[1]) && out[node.args[1]].value == 1.0) {
+            return node.args[0];
+        }
+
+        return out.operation(Ast::Op::MaskNotEqual, condition, out.constant(0.0));
+    }
+};
+
+/**
+ * @brief Runs the optimization passes over a parsed expression tree.
+ * @param ast Parsed expression tree.
+ * @param symbols Symbols table telling the pure functions.
+ */
+static Ast optimize(const Ast &ast, const SymbolTable &symbols)
+{
+    Ast out = BuiltinsInlining().run(ast);
+    out = ConstantFolding(symbols).run(out);
+    out = PowerReduction().run(out);
+    out = Simplification().run(out);
+    out = CommonSubexpressions(symbols).run(out);
+    return SharingLimit().run(out);
+}
+
+//----------------------------------------------------------
+//  Expression parser
+//----------------------------------------------------------
+class Parser final
+{
+public:
+
+    Parser(SymbolTable &symbols)
+        : m_symbols(symbols),
+          m_error(false),
+          m_message(),
+          m_columns(),
+          m_ast(nullptr)
+    {
+    }
+
+    inline bool error() const { return m_error; }
+    const std::string& message() const { return m_message; }
+    const SymbolTable& symbols() const { return m_symbols; }
+
+
+    /**
+     * @brief Bind variables to batch input columns.
+     *
+     * Bound variables are read from the columns array at the
+     * current row instead of from the symbols table.
+     * Column variables take precedence over the symbols table ones.
+     *
+     * @param columns Variables names, in the columns array order.
+     */
+    void bindColumns(const std::vector<std::string> &columns)
+    {
+        m_columns.clear();
+        for (size_t i = 0; i < columns.size(); i++) {
+            m_columns.insert(std::make_pair(columns.at(i), static_cast<int32_t>(i)));
+        }
+    }
+
+    /**
+     * @brief Parse an expression.
+     * @param str Expression string.
+     * @param ast Expression tree to be built.
+     * @return true if parsed successfully.
+     */
+    bool parse(const std::string &str, Ast &ast)
+    {
+        m_error = false;
+        m_message.clear();
+        m_ast = &ast;
+        m_ast->clear();
+
+        std::istringstream ss(str);
+        m_ast->root = parseExpression(ss);
+
+        m_ast = nullptr;
+        return !m_error;
+    }
+
+    /**
+     * @brief Parse a function, (x, y) -> expression.
+     *
+     * The parameters are bound the same way as the batch columns,
+     * in the parameters list order.
+     *
+     * @param str Function string.
+     * @param ast Expression tree to be built.
+     * @param arity Number of the function parameters.
+     * @return true if parsed successfully.
+     */
+    bool parseFunction(const std::string &str, Ast &ast, size_t &arity)
+    {
+        m_error = false;
+        m_message.clear();
+        m_ast = &ast;
+        m_ast->clear();
+
+        std::istringstream ss(str);
+        std::vector<std::string> parameters;
+        if (parseParameters(ss, parameters)) {
+            bindColumns(parameters);
+            m_ast->root = parseExpression(ss);
+        }
+        arity = parameters.size();
+
+        m_ast = nullptr;
+        return !m_error;
+    }
+
+    /// Maximal number of a function parameters.
+    static constexpr size_t MAX_PARAMETERS = 4;
+
+private:
+
+// Helper macro to generate parsing error messages
+#define PARSE_ERR m_error=true; MessageConstructor(m_message) << in.tellg() << ": "
+
+    /**
+     * @brief Tells whether  a character is a shitespace.
+     * @param c
+     * @return
+     */
+    static inline bool isSpace(int c)
+    {
+        return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+    }
+
+    /**
+     * @brief Skip whitespaces in the input stream.
+     *
+     * This will advance the input stream until there is a non-whitespace
+     * character in there, or end of stream.
+     *
+     * @param in
+     */
+    static void skipSpace(std::istream &in)
+    {
+        while(Parser::isSpace(in.peek())) {
+            in.get();
+        }
+    }
+
+    /**
+     * @brief Extract a positive integer value from the stream.
+     * @param in
+     * @param value
+     * @param digits Number of the digits read, leading zeros included.
+     * @return
+     */
+    static bool parseInteger(std::istream &in, long long int &value, int *digits = nullptr)
+    {
+        long long int tmp = 0;
+        bool ok = false;
+        int count = 0;
+        auto c = in.peek();
+        while (c >= '0' && c <= '9') {
+            tmp = 10*tmp + in.get() - '0';
+            c = in.peek();
+            ok = true;
+            count++;
+        }
+        if (digits != nullptr) {
+            *digits = count;
+        }
+
+        if (ok) {
+            value = tmp;
+        }
+
+        return ok;
+    }
+
+    /**
+     * @brief Parse a floating point number.
+     * @param in
+     * @return Constant node.
+     */
+    Ast::Index parseNumber(std::istream &in)
+    {
+        ExprJIT::Real tmp = 0.0;
+        long long int tmp_i = 0;
+        long long int tmp_r = 0;
+        long long int tmp_e = 0;
+        int digits_r = 0;
+        bool neg = false;
+
+        Parser::skipSpace(in);
+
+        auto c = in.peek();
+        if (c == '-') {
+            in.get();
+            neg = true;
+        }
+
+        bool ok = parseInteger(in, tmp_i);
+        if (ok) {
+            c = in.peek();
+            if (c == '.') {
+                in.get();
+                ok = parseInteger(in, tmp_r, &digits_r);
+                c = in.peek();
+            }
+            if (ok && (c == 'E' || c == 'e')) {
+                in.get();
+                c = in.peek();
+                bool neg = false;
+                if (c == '-') {
+                    in.get();
+                    neg = true;
+                }
+                ok = parseInteger(in, tmp_e);
+                if (ok && neg) {
+                    tmp_e = -tmp_e;
+                }
+            }
+        }
+
+        if (ok) {
+            tmp = static_cast<ExprJIT::Real>(tmp_i);
+            tmp += static_cast<ExprJIT::Real>(tmp_r) / pow(10.0, digits_r);
+
+            if (tmp_e != 0) {
+                tmp *= pow(10.0, tmp_e);
+            }
+
+            if (neg) {
+                tmp *= -1.0;
+            }
+        } else {
+            PARSE_ERR << "Unable to parse number";
+        }
+
+        return m_ast->constant(tmp);
+    }
+
+    /**
+     * @brief Parse an expression
+     * @param in
+     * @return
+     */
+    Ast::Index parseExpression(std::istream &in)
+    {
+        return parseConditional(in);
+    }
+
+    /**
+     * @brief Extract an identifier from the stream.
+     * @param in
+     * @return Identifier, empty if there is none.
+     */
+    static std::string parseIdentifier(std::istream &in)
+    {
+        skipSpace(in);
+        auto c = in.peek();
+        std::string identifier;
+
+        if (c >= '0' && c <= '9') {
+            return identifier;
+        }
+
+        while ((c >= 'a' && c <= 'z') ||
+               (c >= 'A' && c <= 'Z') ||
+               (c >= '0' && c <= '9') ||
+               (c == '_')) {
+
+            identifier += static_cast<char>(in.get());
+            c = in.peek();
+        }
+
+        return identifier;
+    }
+
+    /**
+     * @brief Parse a function parameters list, (x, y) ->
+     * @param in
+     * @param parameters Parameters names.
+     * @return true if parsed successfully.
+     */
+    bool parseParameters(std::istream &in, std::vector<std::string> &parameters)
+    {
+        skipSpace(in);
+        if (in.peek() != '(') {
+            PARSE_ERR << "Expected '('";
+            return false;
+        }
+        in.get();
+
+        skipSpace(in);
+        if (in.peek() == ')') {
+            in.get();
+        } else {
+            while (true) {
+                const auto name = parseIdentifier(in);
+                if (name.empty()) {
+                    PARSE_ERR << "Expected parameter name";
+                    return false;
+                }
+                if (std::find(parameters.begin(), parameters.end(), name) != parameters.end()) {
+                    PARSE_ERR << "Duplicate parameter '" << name << "'";
+                    return false;
+                }
+                if (parameters.size() == MAX_PARAMETERS) {
+                    PARSE_ERR << "Too many parameters";
+                    return false;
+                }
+                parameters.push_back(name);
+
+                skipSpace(in);
+                const auto c = in.peek();
+                if (c != ',' && c != ')') {
+                    PARSE_ERR << "Expected ')'";
+                    return false;
+                }
+                in.get();
+                if (c == ')') {
+                    break;
+                }
+            }
+        }
+
+        skipSpace(in);
+        if (in.peek() == '-') {
+            in.get();
+            if (in.peek() == '>') {
+                in.get();
+                return true;
+            }
+        }
+
+        PARSE_ERR << "Expected '->'";
+        return false;
+    }
+
+    /**
+     * @brief Parse a symbol (function or names constant).
+     * @param in
+     * @return
+     */
+    Ast::Index parseSymbol(std::istream &in)
+    {
+        const std::string identifier = parseIdentifier(in);
+
+        skipSpace(in);
+        auto c = in.peek();
+        if (c == '(') {
+            // Function call
+            Ast::Index args[3];
+            size_t count = 0;
+            do {
+                in.get();
+                if (count == 3) {
+                    PARSE_ERR << "Too many arguments for '" << identifier << "' function call";
+                    return m_ast->constant(0.0);
+                }
+                args[count++] = parseExpression(in);
+                if (m_error) {
+                    return m_ast->constant(0.0);
+                }
+                skipSpace(in);
+                c = in.peek();
+            } while (c == ',');
+
+            if (c != ')') {
+                PARSE_ERR << "Expected ')'";
+                return m_ast->constant(0.0);
+            }
+            in.get();
+
+            if (count == 1) {
+                auto funcPtr = m_symbols.func1Ptr(identifier);
+                if (funcPtr != nullptr) {
+                    return m_ast->call(funcPtr, args[0]);
+                }
+            } else if (count == 2) {
+                auto funcPtr = m_symbols.func2Ptr(identifier);
+                if (funcPtr != nullptr) {
+                    return m_ast->call(funcPtr, args[0], args[1]);
+                }
+            } else {
+                auto funcPtr = m_symbols.func3Ptr(identifier);
+                if (funcPtr != nullptr) {
+                    return m_ast->call(funcPtr, args[0], args[1], args[2]);
+                }
+            }
+
+        } else {
+
+            // Column reference
+            auto col = m_columns.find(identifier);
+            if (col != m_columns.end()) {
+                return m_ast->column(col->second);
+            }
+
+            // Constants are folded like the literal numbers
+            ExprJIT::Real value = 0.0;
+            if (m_symbols.constant(identifier, value)) {
+                return m_ast->constant(value);
+            }
+
+            // Variable reference
+            ExprJIT::Real *ptr = m_symbols.varPtr(identifier);
+            if (ptr != nullptr) {
+                return m_ast->variable(ptr);
+            }
+
+            if (func::constant(identifier, value)) {
+                return m_ast->constant(value);
+            }
+        }
+
+        PARSE_ERR << "Unknown symbol '" << identifier << "'";
+        return m_ast->constant(0.0);
+    }
+
+    Ast::Index parseTerm(std::istream &in)
+    {
+        skipSpace(in);
+        auto c = in.peek();
+        if ((c >= '0' && c <= '9')) {
+            return parseNumber(in);
+        } else if (c == '-') {
+            // -x^y is -(x^y), negative numbers included. -0.0 - x is
+            // an exact negation, which is folded for the constants.
+            in.get();
+            const auto zero = m_ast->constant(-0.0);
+            const auto rnode = parsePower(in);
+            return m_ast->operation(Ast::Op::Sub, zero, rnode);
+        } else if (c == '!') {
+            in.get();
+            const auto rnode = parsePower(in);
+            return m_ast->operation(Ast::Op::Equal, rnode, m_ast->constant(0.0));
+        } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c == '_')) {
+            return parseSymbol(in);
+        } else if (c == '(') {
+            in.get();
+            const auto n = parseExpression(in);
+            if (!m_error) {
+                skipSpace(in);
+                c = in.peek();
+                if (c == ')') {
+                    in.get();
+                } else {
+                    PARSE_ERR << "Expected ')'";
+                }
+            }
+            return n;
+        } else {
+            PARSE_ERR << "Unexpected character '" << static_cast<char>(c) << "'";
+        }
+
+        return m_ast->constant(0.0);
+    }
+
+    /**
+     * @brief Parse a power, x^y or x**y.
+     *
+     * Powers are right associative: x^y^z is x^(y^z).
+     */
+    Ast::Index parsePower(std::istream &in)
+    {
+        const auto base = parseTerm(in);
+        if (m_error) {
+            return base;
+        }
+
+        skipSpace(in);
+        auto c = in.peek();
+        if (c == '^') {
+            in.get();
+        } else if (c == '*') {
+            in.get();
+            if (in.peek() != '*') {
+                in.putback('*');
+                return base;
+            }
+            in.get();
+        } else {
+            return base;
+        }
+
+        const auto exponent = parsePower(in);
+        return m_ast->call(func::pow, base, exponent);
+    }
+
+    Ast::Index parseMulDiv(std::istream &in)
+    {
+        auto lnode = parsePower(in);
+
+        while (!m_error) {
+            skipSpace(in);
+            auto c = in.peek();
+            if (c == '*') {
+                in.get();
+                const auto rnode = parsePower(in);
+                lnode = m_ast->operation(Ast::Op::Mul, lnode, rnode);
+            } else if (c == '/') {
+                in.get();
+                const auto rnode = parsePower(in);
+                lnode = m_ast->operation(Ast::Op::Div, lnode, rnode);
+            } else {
+                break;
+            }
+        }
+
+        return lnode;
+    }
+
+    Ast::Index parseAddSub(std::istream &in)
+    {
+        auto lnode = parseMulDiv(in);
+
+        while (!m_error) {
+            skipSpace(in);
+            auto c = in.peek();
+            if (c == '+') {
+                in.get();
+                const auto rnode = parseMulDiv(in);
+                lnode = m_ast->operation(Ast::Op::Add, lnode, rnode);
+            } else if (c == '-') {
+                in.get();
+                const auto rnode = parseMulDiv(in);
+                lnode = m_ast->operation(Ast::Op::Sub, lnode, rnode);
+            } else {
+                break;
+            }
+        }
+
+        return lnode;
+    }
+
+    Ast::Index parseRelational(std::istream &in)
+    {
+        auto lnode = parseAddSub(in);
+
+        while (!m_error) {
+            skipSpace(in);
+            auto c = in.peek();
+            if (c != '<' && c != '>') {
+                break;
+            }
+            in.get();
+            const bool orEqual = (in.peek() == '=');
+            if (orEqual) {
+                in.get();
+            }
+            const auto rnode = parseAddSub(in);
+            const auto op = orEqual ? Ast::Op::LessEqual : Ast::Op::Less;
+
+            // a > b is b < a, which is also false for NaN.
+            lnode = (c == '<') ? m_ast->operation(op, lnode, rnode)
+                               : m_ast->operation(op, rnode, lnode);
+        }
+
+        return lnode;
+    }
+
+    Ast::Index parseEquality(std::istream &in)
+    {
+        auto lnode = parseRelational(in);
+
+        while (!m_error) {
+            skipSpace(in);
+            auto c = in.peek();
+            if (c != '=' && c != '!') {
+                break;
+            }
+            in.get();
+            if (in.peek() != '=') {
+                PARSE_ERR << "Expected '" << static_cast<char>(c) << "='";
+                break;
+            }
+            in.get();
+            const auto rnode = parseRelational(in);
+            lnode = m_ast->operation(c == '=' ? Ast::Op::Equal : Ast::Op::NotEqual, lnode, rnode);
+        }
+
+        return lnode;
+    }
+
+    /**
+     * @brief Parse a logical and.
+     *
+     * Operands are true if non-zero, the result is 1.0 or 0.0. Both operands
+     * are evaluated, there is no short-circuit.
+     */
+    Ast::Index parseAnd(std::istream &in)
+    {
+        auto lnode = parseEquality(in);
+
+        while (!m_error) {
+            skipSpace(in);
+            if (in.peek() != '&') {
+                break;
+            }
+            in.get();
+            if (in.peek() != '&') {
+                PARSE_ERR << "Expected '&&'";
+                break;
+            }
+            in.get();
+            const auto rnode = parseEquality(in);
+
+            // a ? (b != 0) : 0
+            const auto r = m_ast->operation(Ast::Op::NotEqual, rnode, m_ast->constant(0.0));
+            lnode = m_ast->operation(Ast::Op::Select, lnode, r, m_ast->constant(0.0));
+        }
+
+        return lnode;
+    }
+
+    /**
+     * @brief Parse a logical or, see parseAnd().
+     */
+    Ast::Index parseOr(std::istream &in)
+    {
+        auto lnode = parseAnd(in);
+
+        while (!m_error) {
+            skipSpace(in);
+            if (in.peek() != '|') {
+                break;
+            }
+            in.get();
+            if (in.peek() != '|') {
+                PARSE_ERR << "Expected '||'";
+                break;
+            }
+            in.get();
+            const auto rnode = parseAnd(in);
+
+            // a ? 1 : (b != 0)
+            const auto r = m_ast->operation(Ast::Op::NotEqual, rnode, m_ast->constant(0.0));
+            lnode = m_ast->operation(Ast::Op::Select, lnode, m_ast->constant(1.0), r);
+        }
+
+        return lnode;
+    }
+
+    /**
+     * @brief Parse a conditional expression, c ? a : b.
+     *
+     * The condition is true if non-zero. Conditionals are right
+     * associative: a ? b : c ? d : e is a ? b : (c ? d : e).
+     */
+    Ast::Index parseConditional(std::istream &in)
+    {
+        const auto condition = parseOr(in);
+        if (m_error) {
+            return condition;
+        }
+
+        skipSpace(in);
+        if (in.peek() != '?') {
+            return condition;
+        }
+        in.get();
+
+        const auto trueValue = parseExpression(in);
+        if (m_error) {
+            return trueValue;
+        }
+
+        skipSpace(in);
+        if (in.peek() != ':') {
+            PARSE_ERR << "Expected ':'";
+            return m_ast->constant(0.0);
+        }
+        in.get();
+
+        const auto falseValue = parseConditional(in);
+        return m_ast->operation(Ast::Op::Select, condition, trueValue, falseValue);
+    }
+
+#undef PARSE_ERR
+
+    SymbolTable &m_symbols; ///< External variables.
+    bool m_error;           ///< Parsing error flag.
+    std::string m_message;  ///< Error message.
+
+    /// Batch columns indices by variable name.
+    std::map<std::string, int32_t> m_columns;
+
+    Ast *m_ast;             ///< Expression tree being built.
+};
+
+//----------------------------------------------------------
+//  Expression tree lowering
+//----------------------------------------------------------
+
+/**
+ * @brief Constructs the NativeJIT nodes of an optimized expression tree.
+ *
+ * Selects are either NativeJIT conditionals testing the comisd flags,
+ * or made of the masks set by cmpsd. Either way both values are
+ * evaluated: a conditional computes both of them before the jump picking
+ * one, so no work is skipped, whatever the cost of the value not taken.
+ * The choice is only about how the selection waits for the comparison.
+ * The flags are used for the < and <= (> and >=) comparisons of the
+ * values not depending on the batch columns, whose jump is predicted
+ * from row to row. The other comparisons may be mispredicted on every
+ * row, and the flags do not tell NaN from the equality without an
+ * additional parity test, so equality and non-comparison conditions
+ * use the masks.
+ */
+class Lowering final
+{
+public:
+    using Node = nj::Node<ExprJIT::Real>;
+
+    /// Memoized subtree value, see Memoization.
+    struct Memo
+    {
+        ExprJIT::Real (*func)();            ///< Function evaluating the subtree into the slot.
+        const uint64_t* const *versions;    ///< Versions of the subtree variables.
+        uint64_t *seen;                     ///< Versions the slot value is of.
+        unsigned count;                     ///< Number of the variables.
+    };
+
+    Lowering(nj::ExpressionNodeFactory &nodeFactory)
+        : m_nodeFactory(nodeFactory),
+          m_columnsNode(nullptr),
+          m_rowOffsetNode(nullptr),
+          m_parameters(),
+          m_frameNode(nullptr),
+          m_slots(),
+          m_memos()
+    {
+    }
+
+    /**
+     * @brief Bind the column references to the batch loop variables.
+     * @param columnsNode Columns array node.
+     * @param rowOffsetNode Current row byte offset node.
+     */
+    void bindColumns(nj::Node<ExprJIT::Real**> &columnsNode,
+                     nj::Node<uint64_t> &rowOffsetNode)
+    {
+        m_columnsNode = &columnsNode;
+        m_rowOffsetNode = &rowOffsetNode;
+    }
+
+    /**
+     * @brief Bind the variables to the slots of a frame.
+     *
+     * Bound variables are read relative to the frame pointer instead
+     * of from their absolute addresses.
+     *
+     * @param frameNode Frame pointer node.
+     * @param variables Variables pointers, in the frame slots order.
+     */
+    void bindFrame(nj::Node<ExprJIT::Real*> &frameNode,
+                   const std::vector<ExprJIT::Real*> &variables)
+    {
+        m_frameNode = &frameNode;
+        m_slots.clear();
+        for (size_t i = 0; i < variables.size(); i++) {
+            m_slots.insert(std::make_pair(variables.at(i), static_cast<int32_t>(i)));
+        }
+    }
+
+    /**
+     * @brief Bind the variables to the memoized subtrees values.
+     *
+     * Bound variables are read after the subtree function has been
+     * called again, if any of its variables has changed.
+     *
+     * @param memos Memoized subtrees, by their value slot.
+     */
+    void bindMemos(const std::map<ExprJIT::Real*, Memo> &memos)
+    {
+        m_memos = memos;
+    }
+
+    /**
+     * @brief Bind the column references to the function parameters.
+     * @param parameters Parameter nodes, in the parameters list order.
+     */
+    void bindParameters(const std::vector<Node*> &parameters)
+    {
+        m_parameters = parameters;
+    }
+
+    /**
+     * @brief Construct the expression nodes.
+     *
+     * Every tree node is lowered at most once, so the shared
+     * subexpressions are evaluated once as well. The tree must not
+     * contain unreachable nodes, which is the case once optimized.
+     *
+     * @return Expression root node.
+     */
+    Node& lower(const Ast &ast)
+    {
+        return *lowerValues(ast)[ast.root];
+    }
+
+    /**
+     * @brief Construct the expression nodes of fused expressions.
+     * @return Expressions root nodes, in the Ast::outputs order.
+     */
+    std::vector<Node*> lowerOutputs(const Ast &ast)
+    {
+        const auto values = lowerValues(ast);
+        std::vector<Node*> outputs;
+        for (const auto output : ast.outputs) {
+            outputs.push_back(values[output]);
+        }
+        return outputs;
+    }
+
+private:
+
+    std::vector<Node*> lowerValues(const Ast &ast)
+    {
+        const size_t count = ast.nodes.size();
+
+        // Select nodes testing the comparison flags
+        std::vector<bool> varying(count, false);
+        std::vector<bool> flags(count, false);
+        for (size_t i = 0; i < count; i++) {
+            const auto &node = ast.nodes[i];
+            varying[i] = (node.op == Ast::Op::Column);
+            for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                varying[i] = varying[i] || varying[node.args[k]];
+            }
+            if (node.op == Ast::Op::Select) {
+                const auto c = node.args[0];
+                const auto op = ast[c].op;
+                flags[i] = (op == Ast::Op::Less || op == Ast::Op::LessEqual) && !varying[c];
+            }
+        }
+
+        // Nodes whose values or masks are used. NativeJIT nodes must not
+        // be constructed unless they are used.
+        std::vector<bool> needValue(count, false);
+        std::vector<bool> needMask(count, false);
+        needValue[ast.root] = true;
+        for (const auto output : ast.outputs) {
+            needValue[output] = true;
+        }
+        for (size_t i = count; i-- > 0;) {
+            const auto &node = ast.nodes[i];
+            if (Ast::isComparison(node.op)) {
+                // The value of a comparison is made of its mask
+                needMask[i] = needMask[i] || needValue[i];
+                if (needMask[i]) {
+                    needValue[node.args[0]] = true;
+                    needValue[node.args[1]] = true;
+                }
+                continue;
+            }
+
+            needValue[i] = needValue[i] || needMask[i];
+            if (!needValue[i]) {
+                continue;
+            }
+
+            if (node.op == Ast::Op::Select) {
+                const auto &condition = ast[node.args[0]];
+                needValue[node.args[1]] = true;
+                needValue[node.args[2]] = true;
+                if (flags[i]) {
+                    needValue[condition.args[0]] = true;
+                    needValue[condition.args[1]] = true;
+                } else {
+                    needMask[node.args[0]] = true;
+                }
+            } else {
+                for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                    needValue[node.args[k]] = true;
+                }
+            }
+        }
+
+        std::vector<Node*> values(count, nullptr);
+        std::vector<Node*> masks(count, nullptr);
+        for (size_t i = 0; i < count; i++) {
+            const auto &node = ast.nodes[i];
+            if (needMask[i] && Ast::isComparison(node.op)) {
+                masks[i] = &compareMask(node.op, *values[node.args[0]], *values[node.args[1]]);
+            }
+            if (needValue[i]) {
+                values[i] = &lower(ast, i, flags[i], values, masks);
+            }
+            if (needMask[i] && !Ast::isComparison(node.op)) {
+                masks[i] = &m_nodeFactory.CompareMask(*values[i], m_nodeFactory.Immediate(0.0), nj::CompareType::NotEqual);
+            }
+        }
+
+        return values;
+    }
+
+    Node& lower(const Ast &ast,
+                size_t index,
+                bool flags,
+                const std::vector<Node*> &values,
+                const std::vector<Node*> &masks)
+    {
+        using Op = Ast::Op;
+
+        const auto &node = ast.nodes[index];
+        Node *args[3] = { nullptr, nullptr, nullptr };
+        for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+            args[k] = values[node.args[k]];
+        }
+
+        switch (node.op) {
+        case Op::Constant:
+            return m_nodeFactory.Immediate(node.value);
+        case Op::Variable: {
+            if (m_frameNode != nullptr) {
+                return m_nodeFactory.Deref(*m_frameNode, m_slots.at(node.variable));
+            }
+            const auto it = m_memos.find(node.variable);
+            if (it != m_memos.end()) {
+                const auto &memo = it->second;
+                return m_nodeFactory.Memo(memo.func, node.variable, memo.versions, memo.seen, memo.count);
+            }
+            return m_nodeFactory.Deref(m_nodeFactory.Immediate(node.variable));
+        }
+        case Op::Column:
+            if (m_columnsNode == nullptr) {
+                return *m_parameters[node.column];
+            }
+            return column(node.column);
+        case Op::Add:
+            return m_nodeFactory.Add(*args[0], *args[1]);
+        case Op::Sub:
+            return m_nodeFactory.Sub(*args[0], *args[1]);
+        case Op::Mul:
+            return m_nodeFactory.Mul(*args[0], *args[1]);
+        case Op::Div:
+            return m_nodeFactory.Div(*args[0], *args[1]);
+        case Op::Min:
+            return m_nodeFactory.Min(*args[0], *args[1]);
+        case Op::Max:
+            return m_nodeFactory.Max(*args[0], *args[1]);
+        case Op::And:
+            return m_nodeFactory.And(*args[0], *args[1]);
+        case Op::AndNot:
+            return m_nodeFactory.AndNot(*args[0], *args[1]);
+        case Op::Or:
+            return m_nodeFactory.Or(*args[0], *args[1]);
+        case Op::Sqrt:
+            return m_nodeFactory.Sqrt(*args[0]);
+        case Op::Floor:
+            return m_nodeFactory.Round(*args[0], nj::RoundingMode::Floor);
+        case Op::Ceil:
+            return m_nodeFactory.Round(*args[0], nj::RoundingMode::Ceil);
+        case Op::Trunc:
+            return m_nodeFactory.Round(*args[0], nj::RoundingMode::Truncate);
+        case Op::Less:
+        case Op::LessEqual:
+        case Op::Equal:
+        case Op::NotEqual:
+            return m_nodeFactory.And(*masks[index], m_nodeFactory.Immediate(1.0));
+        case Op::Select:
+            if (flags) {
+                // a < b is b > a, the unsigned comisd conditions being false for NaN.
+                const auto &condition = ast[node.args[0]];
+                auto &a = *values[condition.args[0]];
+                auto &b = *values[condition.args[1]];
+                if (condition.op == Op::Less) {
+                    return m_nodeFactory.Conditional(m_nodeFactory.Compare<nj::JccType::JA>(b, a), *args[1], *args[2]);
+                }
+                return m_nodeFactory.Conditional(m_nodeFactory.Compare<nj::JccType::JAE>(b, a), *args[1], *args[2]);
+            } else {
+                auto &mask = *masks[node.args[0]];
+                return m_nodeFactory.Or(m_nodeFactory.And(mask, *args[1]), m_nodeFactory.AndNot(mask, *args[2]));
+            }
+        case Op::MaskLess:
+        case Op::MaskLessEqual:
+        case Op::MaskEqual:
+        case Op::MaskNotEqual:
+            return compareMask(node.op, *args[0], *args[1]);
+        case Op::Call1:
+            return m_nodeFactory.Call(m_nodeFactory.Immediate(node.function1), *args[0]);
+        case Op::Call2:
+            return m_nodeFactory.Call(m_nodeFactory.Immediate(node.function2), *args[0], *args[1]);
+        case Op::Call3:
+            return m_nodeFactory.Call(m_nodeFactory.Immediate(node.function3), *args[0], *args[1], *args[2]);
+        }
+
+        return m_nodeFactory.Immediate(0.0);
+    }
+
+    Node& compareMask(Ast::Op op, Node &l, Node &r)
+    {
+        nj::CompareType type = nj::CompareType::NotEqual;
+        if (op == Ast::Op::Less || op == Ast::Op::MaskLess) {
+            type = nj::CompareType::Less;
+        } else if (op == Ast::Op::LessEqual || op == Ast::Op::MaskLessEqual) {
+            type = nj::CompareType::LessEqual;
+        } else if (op == Ast::Op::Equal || op == Ast::Op::MaskEqual) {
+            type = nj::CompareType::Equal;
+        }
+        return m_nodeFactory.CompareMask(l, r, type);
+    }
+
+    Node& column(int32_t index)
+    {
+        // columns[index] + offset
+        auto &columnPtr = m_nodeFactory.Deref(*m_columnsNode, index);
+        auto &address = m_nodeFactory.Add(m_nodeFactory.Cast<uint64_t>(columnPtr), *m_rowOffsetNode);
+        return m_nodeFactory.Deref(m_nodeFactory.Cast<ExprJIT::Real*>(address));
+    }
+
+    nj::ExpressionNodeFactory &m_nodeFactory;
+    nj::Node<ExprJIT::Real**> *m_columnsNode;   ///< Columns array.
+    nj::Node<uint64_t> *m_rowOffsetNode;        ///< Current row offset in bytes.
+    std::vector<Node*> m_parameters;            ///< Function parameters.
+    nj::Node<ExprJIT::Real*> *m_frameNode;      ///< Variables frame.
+    std::map<ExprJIT::Real*, int32_t> m_slots;  ///< Frame slots by variable.
+    std::map<ExprJIT::Real*, Memo> m_memos;     ///< Memoized subtrees by slot.
+};
+
+//----------------------------------------------------------
+//  Executable memory arena
+//----------------------------------------------------------
+
+/**
+ * @brief Process-wide executable memory shared by the compiled code.
+ *
+ * The code of many expressions is packed into large chunks, rather than
+ * each expression taking its own mapping. The memory is never writable
+ * and executable at the same time. Where possible (Linux) each chunk is
+ * mapped twice, for writing and for execution, so new code can be added
+ * while the code of other expressions on the same pages is running.
+ * Otherwise each code gets its own pages, which are written and then
+ * protected as read+execute.
+ */
+class CodeArena final
+{
+public:
+
+    struct Chunk;
+
+    /// Code copied to the arena, released on destruction.
+    class Block final
+    {
+    public:
+        Block() = default;
+        Block(const Block&) = delete;
+        Block& operator =(const Block&) = delete;
+
+        ~Block()
+        {
+            release();
+        }
+
+        /// Copy the code to the arena, replacing the previous one.
+        void assign(const uint8_t *bytes, size_t size)
+        {
+            release();
+            CodeArena::instance().allocate(*this, bytes, size);
+        }
+
+        void release()
+        {
+            if (m_chunk != nullptr) {
+                CodeArena::instance().release(*this);
+            }
+        }
+
+        const uint8_t* start() const { return m_start; }
+        size_t size() const { return m_size; }
+
+    private:
+        friend class CodeArena;
+
+        Chunk *m_chunk = nullptr;
+        const uint8_t *m_start = nullptr;   ///< Executable code start.
+        size_t m_size = 0;                  ///< Code size.
+        size_t m_reserved = 0;              ///< Bytes taken in the chunk.
+    };
+
+    struct Chunk
+    {
+        uint8_t *exec;      ///< Read+execute view.
+        uint8_t *write;     ///< Writable view, nullptr if the chunk holds a single block.
+        size_t size;
+        size_t used;
+        std::map<size_t, size_t> free;      ///< Free ranges sizes, by offset.
+    };
+
+    static CodeArena& instance()
+    {
+        // Never destroyed, the code of static objects is released
+        // after the static arena would be.
+        static CodeArena *arena = new CodeArena();
+        return *arena;
+    }
+
+private:
+
+    CodeArena()
+        : m_mutex(),
+          m_chunks(),
+          m_shared(true),
+          m_pageSize(pageSize())
+    {
+    }
+
+    void allocate(Block &block, const uint8_t *bytes, size_t size)
+    {
+        const size_t reserved = roundUp(std::max<size_t>(size, 1), CODE_ARENA_ALIGNMENT);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        Chunk *chunk = nullptr;
+        size_t offset = 0;
+        if (m_shared) {
+            // First fit
+            for (auto &c : m_chunks) {
+                if (c->write != nullptr && take(*c, reserved, offset)) {
+                    chunk = c.get();
+                    break;
+                }
+            }
+            if (chunk == nullptr) {
+                chunk = mapShared(std::max(CODE_ARENA_CHUNK_SIZE, roundUp(reserved, m_pageSize)));
+                if (chunk != nullptr) {
+                    take(*chunk, reserved, offset);
+                } else {
+                    m_shared = false;
+                }
+            }
+        }
+
+        if (chunk != nullptr) {
+            std::memcpy(chunk->write + offset, bytes, size);
+        } else {
+            chunk = mapPrivate(bytes, size, roundUp(reserved, m_pageSize));
+        }
+
+        block.m_chunk = chunk;
+        block.m_start = chunk->exec + offset;
+        block.m_size = size;
+        block.m_reserved = reserved;
+    }
+
+    void release(Block &block)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        Chunk &chunk = *block.m_chunk;
+        const size_t offset = static_cast<size_t>(block.m_start - chunk.exec);
+        block.m_chunk = nullptr;
+        block.m_start = nullptr;
+
+        if (chunk.write != nullptr) {
+            // Return the range, merged with the adjacent free ones
+            auto next = chunk.free.emplace(offset, block.m_reserved).first;
+            if (next != chunk.free.begin()) {
+                auto prev = std::prev(next);
+                if (prev->first + prev->second == next->first) {
+                    prev->second += next->second;
+                    chunk.free.erase(next);
+                    next = prev;
+                }
+            }
+            auto after = std::next(next);
+            if (after != chunk.free.end() && next->first + next->second == after->first) {
+                next->second += after->second;
+                chunk.free.erase(after);
+            }
+            chunk.used -= block.m_reserved;
+
+            // The last empty chunk is kept for the next code.
+            if (chunk.used != 0 || m_chunks.size() == 1) {
+                return;
+            }
+        }
+
+        unmap(chunk);
+        m_chunks.erase(std::find_if(m_chunks.begin(), m_chunks.end(),
+                                    [&chunk](const std::unique_ptr<Chunk> &c) { return c.get() == &chunk; }));
+    }
+
+    static bool take(Chunk &chunk, size_t size, size_t &offset)
+    {
+        for (auto it = chunk.free.begin(); it != chunk.free.end(); ++it) {
+            if (it->second >= size) {
+                offset = it->first;
+                if (it->second > size) {
+                    chunk.free.emplace(it->first + size, it->second - size);
+                }
+                chunk.free.erase(it);
+                chunk.used += size;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static size_t roundUp(size_t size, size_t alignment)
+    {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+#ifdef _WIN32
+
+    static size_t pageSize()
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+    }
+
+    Chunk* mapShared(size_t)
+    {
+        return nullptr;
+    }
+
+    Chunk* mapPrivate(const uint8_t *bytes, size_t size, size_t mapSize)
+    {
+        auto *memory = static_cast<uint8_t*>(VirtualAlloc(nullptr, mapSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+        if (memory == nullptr) {
+            throw std::bad_alloc();
+        }
+        std::memcpy(memory, bytes, size);
+        DWORD protection = 0;
+        if (!VirtualProtect(memory, mapSize, PAGE_EXECUTE_READ, &protection)) {
+            VirtualFree(memory, 0, MEM_RELEASE);
+            throw std::bad_alloc();
+        }
+        FlushInstructionCache(GetCurrentProcess(), memory, mapSize);
+        m_chunks.push_back(std::unique_ptr<Chunk>(new Chunk{ memory, nullptr, mapSize, mapSize, {} }));
+        return m_chunks.back().get();
+    }
+
+    static void unmap(Chunk &chunk)
+    {
+        VirtualFree(chunk.exec, 0, MEM_RELEASE);
+    }
+
+#else
+
+    static size_t pageSize()
+    {
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    Chunk* mapShared(size_t mapSize)
+    {
+#if defined(__linux__) && defined(SYS_memfd_create)
+        const int fd = static_cast<int>(syscall(SYS_memfd_create, "exprjit", MFD_CLOEXEC));
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        void *write = MAP_FAILED;
+        void *exec = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(mapSize)) == 0) {
+            write = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            exec = mmap(nullptr, mapSize, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        }
+        // The mappings keep the memory alive.
+        close(fd);
+
+        if (write == MAP_FAILED || exec == MAP_FAILED) {
+            if (write != MAP_FAILED) {
+                munmap(write, mapSize);
+            }
+            if (exec != MAP_FAILED) {
+                munmap(exec, mapSize);
+            }
+            return nullptr;
+        }
+
+        std::unique_ptr<Chunk> chunk(new Chunk{ static_cast<uint8_t*>(exec), static_cast<uint8_t*>(write), mapSize, 0, {} });
+        chunk->free.emplace(0, mapSize);
+        m_chunks.push_back(std::move(chunk));
+        return m_chunks.back().get();
+#else
+        (void)mapSize;
+        return nullptr;
+#endif
+    }
+
+    Chunk* mapPrivate(const uint8_t *bytes, size_t size, size_t mapSize)
+    {
+        void *memory = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        std::memcpy(memory, bytes, size);
+        if (mprotect(memory, mapSize, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, mapSize);
+            throw std::bad_alloc();
+        }
+        m_chunks.push_back(std::unique_ptr<Chunk>(new Chunk{ static_cast<uint8_t*>(memory), nullptr, mapSize, mapSize, {} }));
+        return m_chunks.back().get();
+    }
+
+    static void unmap(Chunk &chunk)
+    {
+        if (chunk.write != nullptr) {
+            munmap(chunk.write, chunk.size);
+        }
+        munmap(chunk.exec, chunk.size);
+    }
+
+#endif
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
+    bool m_shared;          ///< Whether the chunks can be shared.
+    size_t m_pageSize;
+};
+
+/**
+ * @brief Growable allocator of the NativeJIT nodes.
+ *
+ * The memory is taken from chunks allocated on demand, so the number
+ * of nodes is not limited. Nothing is freed but by Reset(), which
+ * keeps the first chunk only.
+ */
+class NodesAllocator final : public Allocators::IAllocator
+{
+public:
+
+    explicit NodesAllocator(size_t chunkSize)
+        : m_chunkSize(chunkSize),
+          m_chunks(),
+          m_used(0),
+          m_available(0)
+    {
+    }
+
+    void* Allocate(size_t size) override
+    {
+        size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        if (m_used + size > m_available) {
+            m_available = std::max(m_chunkSize, size);
+            m_chunks.push_back(std::make_unique<char[]>(m_available));
+            m_used = 0;
+        }
+        void *block = m_chunks.back().get() + m_used;
+        m_used += size;
+        return block;
+    }
+
+    void Deallocate(void*) override
+    {
+    }
+
+    size_t MaxSize() const override
+    {
+        return std::numeric_limits<size_t>::max();
+    }
+
+    void Reset() override
+    {
+        if (m_chunks.size() > 1) {
+            m_chunks.resize(1);
+            m_available = m_chunkSize;
+        }
+        m_used = 0;
+    }
+
+private:
+
+    static constexpr size_t ALIGNMENT = alignof(std::max_align_t);
+
+    size_t m_chunkSize;
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    size_t m_used;          ///< Bytes used in the last chunk.
+    size_t m_available;     ///< Size of the last chunk.
+};
+
+/**
+ * @brief NativeJIT code generation buffers.
+ *
+ * The code is generated into an ordinary memory buffer and then copied
+ * to the executable memory arena, so the buffers are only needed
+ * during the compilation. The generated code only refers to itself
+ * relative to the instruction pointer, so it can be moved.
+ */
+struct CodeGenerator
+{
+    size_t capacity;
+    nj::Allocator codeAllocator;
+    NodesAllocator allocator;
+    nj::FunctionBuffer code;
+
+    explicit CodeGenerator(const size_t capacity = CODE_BUFFER_SIZE)
+        : capacity(capacity),
+          codeAllocator(capacity),
+          allocator(CODE_BUFFER_SIZE),
+          code(codeAllocator, static_cast<unsigned>(capacity))
+    {
+        // This will output generated assembly
+#ifdef EXPRJIT_ENABLE_ASM_OUTPUT
+        code.EnableDiagnostics(std::cout);
+#endif
+    }
+
+    /**
+     * @brief Copy the generated code to the arena.
+     * @return Entry point of the copied code.
+     */
+    template <typename F>
+    F commit(CodeArena::Block &block) const
+    {
+        block.assign(code.BufferStart(), code.CurrentPosition());
+        const auto entry = static_cast<const uint8_t*>(code.GetEntryPoint()) - code.BufferStart();
+        return reinterpret_cast<F>(block.start() + entry);
+    }
+
+    /// Prepare the buffers for another code.
+    void reset()
+    {
+        allocator.Reset();
+        code.Reset();
+    }
+
+    /// Whether the code generation has failed for the lack of space.
+    bool overflown() const
+    {
+        // Largest piece of code emitted at once is the function prolog
+        return code.CurrentPosition() + 1024 > capacity;
+    }
+};
+
+/**
+ * @brief Code generator of the calling thread.
+ *
+ * The generation buffers are reused by the consecutive compilations
+ * of a thread rather than allocated by each one. Only the buffers of the
+ * default size are kept, the ones of the large expressions are released.
+ * A nested compilation, like the one of a function called while folding
+ * the constants, gets its own buffers.
+ */
+class ThreadCodeGenerator final
+{
+public:
+
+    explicit ThreadCodeGenerator(const size_t capacity = CODE_BUFFER_SIZE)
+        : m_generator(capacity == CODE_BUFFER_SIZE ? std::move(cached()) : nullptr)
+    {
+        if (m_generator == nullptr) {
+            m_generator = std::make_unique<CodeGenerator>(capacity);
+        }
+    }
+
+    ~ThreadCodeGenerator()
+    {
+        if (m_generator->capacity == CODE_BUFFER_SIZE) {
+            m_generator->reset();
+            cached() = std::move(m_generator);
+        }
+    }
+
+    ThreadCodeGenerator(const ThreadCodeGenerator&) = delete;
+    ThreadCodeGenerator& operator =(const ThreadCodeGenerator&) = delete;
+
+    CodeGenerator& operator *() const { return *m_generator; }
+    CodeGenerator* operator ->() const { return m_generator.get(); }
+
+private:
+
+    static std::unique_ptr<CodeGenerator>& cached()
+    {
+        thread_local std::unique_ptr<CodeGenerator> generator;
+        return generator;
+    }
+
+    std::unique_ptr<CodeGenerator> m_generator;
+};
+
+/**
+ * @brief Generate the code of an expression tree.
+ *
+ * The code buffer size is estimated from the tree size. NativeJIT
+ * cannot move the code buffer during the generation, since it refers
+ * to the code by its addresses, so when the code does not fit it is
+ * generated again into a buffer twice as large.
+ *
+ * @param nodes Number of the expression tree nodes.
+ * @param generate Function generating and committing the code.
+ */
+template <typename F>
+void generateCode(size_t nodes, F &&generate)
+{
+    size_t capacity = CODE_BUFFER_SIZE;
+    while (capacity < nodes * CODE_BYTES_PER_NODE && capacity < CODE_BUFFER_MAX_SIZE) {
+        capacity *= 2;
+    }
+
+    for (;;) {
+        ThreadCodeGenerator generator(capacity);
+        try {
+            generate(*generator);
+            return;
+        } catch (const std::runtime_error&) {
+            if (!generator->overflown() || capacity >= CODE_BUFFER_MAX_SIZE) {
+                throw;
+            }
+        }
+        capacity *= 2;
+    }
+}
+
+//----------------------------------------------------------
+//  NativeJIT compiler wrapper
+//----------------------------------------------------------
+struct Compiler
+{
+    using Expression = nj::Function<ExprJIT::Real>;
+
+    /**
+     * @brief Memoized subtree code, see Memoization.
+     *
+     * The versions are compared with the seen ones by the generated
+     * code reading the subtree value, see nj::MemoNode.
+     */
+    struct Memo
+    {
+        Expression::FunctionType func = nullptr;
+        CodeArena::Block block;
+        std::vector<const uint64_t*> versions;  ///< Variables versions counters, nullptr if untracked.
+        std::vector<uint64_t> seen;             ///< Versions of the slot value.
+    };
+
+    Expression::FunctionType func = nullptr;
+    CodeArena::Block block;
+    std::vector<std::unique_ptr<Memo>> memos;
+    ExprJIT::Real slots[MEMO_MAX_SUBTREES];
+    std::vector<std::string> dependencies;
+    ExprJIT::CompileStatistics statistics;
+    bool memoized = false;  ///< Whether the subtrees are memoized.
+
+    /// Specialized variables with the values compiled as constants.
+    std::vector<std::pair<const ExprJIT::Real*, ExprJIT::Real>> guards;
+    Ast tree;               ///< Parsed expression, built again once a guard fails.
+
+    /// Evaluations checking the guards are serialized, since they may build the code again.
+    std::mutex mutex;
+
+    SymbolTable &symbols;
+    Parser parser;
+
+    static ExprJIT::Real returnZero()
+    {
+        return 0.0;
+    }
+
+    Compiler(SymbolTable &symbols)
+        : func(Compiler::returnZero),
+          block(),
+          memos(),
+          slots(),
+          dependencies(),
+          statistics(),
+          guards(),
+          tree(),
+          mutex(),
+          symbols(symbols),
+          parser(symbols)
+    {
+    }
+
+    /// Compile an expression tree, returning its function.
+    Expression::FunctionType compileTree(const Ast &ast, CodeArena::Block &code,
+                                         const std::map<ExprJIT::Real*, Lowering::Memo> &values)
+    {
+        Expression::FunctionType f = nullptr;
+        generateCode(ast.nodes.size(), [&](CodeGenerator &generator) {
+            Expression expression(generator.allocator, generator.code);
+            Lowering lowering(expression);
+            lowering.bindMemos(values);
+            expression.Compile(lowering.lower(ast));
+            f = generator.commit<Expression::FunctionType>(code);
+        });
+        return f;
+    }
+
+    using Clock = std::chrono::steady_clock;
+
+    static double seconds(Clock::time_point from, Clock::time_point to)
+    {
+        return std::chrono::duration<double>(to - from).count();
+    }
+
+    /**
+     * @brief Compile an expression.
+     * @param str Expression string.
+     * @param memoize Whether to memoize the subtrees.
+     * @return true if compiled successfully.
+     */
+    bool compile(const std::string &str, bool memoize)
+    {
+        statistics = ExprJIT::CompileStatistics();
+        guards.clear();
+        memoized = memoize;
+        const auto parseStart = Clock::now();
+        if (!parser.parse(str, tree)) {
+            tree.clear();
+            memos.clear();
+            dependencies.clear();
+            func = Compiler::returnZero;
+            block.release();
+            statistics.parseTime = seconds(parseStart, Clock::now());
+            return false;
+        }
+        statistics.parseTime = seconds(parseStart, Clock::now());
+
+        for (const auto &node : tree.nodes) {
+            if (node.op == Ast::Op::Variable && symbols.isSpecialized(symbols.varName(node.variable))) {
+                const auto it = std::find_if(guards.begin(), guards.end(), [&node](const auto &guard) {
+                    return guard.first == node.variable;
+                });
+                if (it == guards.end()) {
+                    guards.emplace_back(node.variable, *node.variable);
+                }
+            }
+        }
+
+        build();
+        return true;
+    }
+
+    /**
+     * @brief Compile the parsed tree, the specialized variables
+     *        being replaced by the guarded values.
+     *
+     * The tree has been parsed already, so that this does not depend
+     * on the symbols defined since, and does not fail.
+     */
+    void build()
+    {
+        const double parseTime = statistics.parseTime;
+        statistics = ExprJIT::CompileStatistics();
+        statistics.parseTime = parseTime;
+        memos.clear();
+        dependencies.clear();
+
+        const auto optimizeStart = Clock::now();
+        Ast ast = tree;
+        for (auto &node : ast.nodes) {
+            if (node.op != Ast::Op::Variable) {
+                continue;
+            }
+            for (const auto &guard : guards) {
+                if (guard.first == node.variable) {
+                    node = Ast::make(Ast::Op::Constant);
+                    node.value = guard.second;
+                    break;
+                }
+            }
+        }
+        for (const auto &guard : guards) {
+            dependencies.push_back(symbols.varName(guard.first));
+        }
+        ast = optimize(ast, symbols);
+
+        for (const auto &node : ast.nodes) {
+            if (node.op == Ast::Op::Variable) {
+                const auto name = symbols.varName(node.variable);
+                if (std::find(dependencies.begin(), dependencies.end(), name) == dependencies.end()) {
+                    dependencies.push_back(name);
+                }
+            }
+        }
+
+        std::vector<Memoization::Subtree> subtrees;
+        if (memoized) {
+            ast = Memoization::split(ast, symbols, slots, subtrees);
+        }
+
+        const auto loweringStart = Clock::now();
+        statistics.optimizeTime = seconds(optimizeStart, loweringStart);
+
+        // Inner subtrees are compiled first, so that the outer ones can read them.
+        std::map<ExprJIT::Real*, Lowering::Memo> values;
+        for (const auto &subtree : subtrees) {
+            memos.emplace_back(new Memo());
+            auto &memo = *memos.back();
+            memo.func = compileTree(subtree.ast, memo.block, values);
+            for (const auto *var : subtree.variables) {
+                memo.versions.push_back(symbols.varVersion(var));
+            }
+            // Versions never reach the initial seen ones.
+            memo.seen.assign(memo.versions.size(), std::numeric_limits<uint64_t>::max());
+            values[subtree.slot] = Lowering::Memo{ memo.func, memo.versions.data(), memo.seen.data(),
+                                                   static_cast<unsigned>(memo.versions.size()) };
+            statistics.nodes += subtree.ast.nodes.size();
+            statistics.codeSize += memo.block.size();
+        }
+
+        generateCode(ast.nodes.size(), [&](CodeGenerator &generator) {
+            const auto start = Clock::now();
+            Expression expression(generator.allocator, generator.code);
+            Lowering lowering(expression);
+            lowering.bindMemos(values);
+            auto &root = lowering.lower(ast);
+
+            const auto codegenStart = Clock::now();
+            expression.Compile(root);
+            func = generator.commit<Expression::FunctionType>(block);
+
+            statistics.loweringTime = seconds(start, codegenStart);
+            statistics.codegenTime = seconds(codegenStart, Clock::now());
+        });
+
+        statistics.nodes += ast.nodes.size();
+        statistics.codeSize += block.size();
+    }
+
+    /**
+     * @brief Whether the specialized variables still have their compiled values.
+     *
+     * The values are compared bitwise, so a NaN does not fail the guard.
+     */
+    bool guarded() const
+    {
+        for (const auto &guard : guards) {
+            if (std::memcmp(guard.first, &guard.second, sizeof(ExprJIT::Real)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Evaluate the expression.
+     *
+     * The expressions without guards are evaluated concurrently, the
+     * other ones one at a time. The memoized subtrees are checked by
+     * the generated code.
+     */
+    ExprJIT::Real eval()
+    {
+        if (guards.empty()) {
+            return func();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!guarded()) {
+            for (auto &guard : guards) {
+                guard.second = *guard.first;
+            }
+            build();
+        }
+        // func should always point to a valid function,
+        // either to returnZero() one or the one being compiled.
+        return func();
+    }
+
+};
+
+//----------------------------------------------------------
+//  NativeJIT function compiler wrapper
+//----------------------------------------------------------
+
+/**
+ * @brief Compiles a function of positional parameters.
+ *
+ * The parameters are the NativeJIT function parameters, so they
+ * are passed in the XMM registers rather than through the memory.
+ * The compiled function can be called directly by the client code.
+ */
+struct FunctionCompiler
+{
+    using Node = nj::Node<ExprJIT::Real>;
+    using Real = ExprJIT::Real;
+
+    /// Compiled function entry, to be cast to the pointer of its arity.
+    const uint8_t *entry = nullptr;
+    size_t arity = 0;
+    CodeArena::Block block;
+
+    Parser parser;
+
+    FunctionCompiler(SymbolTable &symbols)
+        : block(),
+          parser(symbols)
+    {
+    }
+
+    bool compile(const std::string &str)
+    {
+        Ast ast;
+        if (!parser.parseFunction(str, ast, arity)) {
+            entry = nullptr;
+            block.release();
+            return false;
+        }
+        ast = optimize(ast, parser.symbols());
+
+        generateCode(ast.nodes.size(), [&](CodeGenerator &generator) {
+            auto &allocator = generator.allocator;
+            auto &code = generator.code;
+
+            switch (arity) {
+            case 0: {
+                nj::Function<Real> f(allocator, code);
+                compile(f, {}, ast);
+                break;
+            }
+            case 1: {
+                nj::Function<Real, Real> f(allocator, code);
+                compile(f, { &f.GetP1() }, ast);
+                break;
+            }
+            case 2: {
+                nj::Function<Real, Real, Real> f(allocator, code);
+                compile(f, { &f.GetP1(), &f.GetP2() }, ast);
+                break;
+            }
+            case 3: {
+                nj::Function<Real, Real, Real, Real> f(allocator, code);
+                compile(f, { &f.GetP1(), &f.GetP2(), &f.GetP3() }, ast);
+                break;
+            }
+            default: {
+                nj::Function<Real, Real, Real, Real, Real> f(allocator, code);
+                compile(f, { &f.GetP1(), &f.GetP2(), &f.GetP3(), &f.GetP4() }, ast);
+                break;
+            }
+            }
+
+            entry = generator.commit<const uint8_t*>(block);
+        });
+        return true;
+    }
+
+    template <typename F>
+    F function(size_t functionArity) const
+    {
+        return (entry != nullptr && functionArity == arity) ? reinterpret_cast<F>(entry) : nullptr;
+    }
+
+private:
+
+    template <typename Function>
+    static void compile(Function &f, const std::vector<Node*> &parameters, const Ast &ast)
+    {
+        Lowering lowering(f);
+        lowering.bindParameters(parameters);
+        f.Compile(lowering.lower(ast));
+    }
+};
+
+//----------------------------------------------------------
+//  Vector batch compiler
+//----------------------------------------------------------
+
+/**
+ * @brief Compiles an expression tree into a packed AVX/AVX-512 kernel.
+ *
+ * The kernel evaluates 4 (ymm) or 8 (zmm) rows per instruction. It has
+ * the same arguments as the batch kernel, but the number of rows must
+ * be a multiple of the vector lanes count. Constants and variables are
+ * broadcast into the vector registers before the loop.
+ *
+ * All the values are kept in registers; if there are not enough
+ * of them the compilation fails and the scalar kernel should be used.
+ */
+struct VectorCompiler
+{
+    using Kernel = void (*)(const ExprJIT::Real* const*, ExprJIT::Real*, uint64_t);
+
+    nj::VectorWidth width;
+    size_t lanes;
+    Kernel func = nullptr;
+    CodeArena::Block block;
+
+    VectorCompiler(nj::VectorWidth vectorWidth)
+        : width(vectorWidth),
+          lanes(vectorWidth == nj::VectorWidth::Zmm ? 8 : 4),
+          block()
+    {
+    }
+
+    bool compile(const Ast &tree, const SymbolTable &symbols)
+    {
+        using Op = Ast::Op;
+
+        // There are no branches in the vector code
+        const Ast ast = CommonSubexpressions(symbols).run(MaskLowering().run(tree));
+        const auto &ops = ast.nodes;
+        const size_t count = ops.size();
+
+        if (count == 0) {
+            return false;
+        }
+
+        // Loop invariant operations are evaluated before the loop
+        std::vector<bool> invariant(count, false);
+        for (size_t i = 0; i < count; i++) {
+            const auto &op = ops[i];
+            if (Ast::isCall(op.op)) {
+                // No vector form
+                return false;
+            }
+            invariant[i] = (op.op != Op::Column);
+            for (unsigned k = 0; k < Ast::arity(op.op); k++) {
+                invariant[i] = invariant[i] && invariant[op.args[k]];
+            }
+        }
+
+        std::vector<uint32_t> order;
+        for (int loop = 0; loop < 2; loop++) {
+            for (size_t i = 0; i < count; i++) {
+                if (invariant[i] == (loop == 0)) {
+                    order.push_back(static_cast<uint32_t>(i));
+                }
+            }
+        }
+
+        // Position of the last use of each value. Values computed before
+        // the loop and used inside it, as well as the result, must stay
+        // in their registers till the end.
+        constexpr size_t forever = std::numeric_limits<size_t>::max();
+        std::vector<size_t> lastUse(count, 0);
+        for (size_t pos = 0; pos < order.size(); pos++) {
+            const auto i = order[pos];
+            const auto &op = ops[i];
+            for (unsigned k = 0; k < Ast::arity(op.op); k++) {
+                const auto arg = op.args[k];
+                lastUse[arg] = (invariant[arg] && !invariant[i]) ? forever : std::max(lastUse[arg], pos);
+            }
+        }
+        lastUse[ast.root] = forever;
+
+        // Linear scan registers allocation
+        const unsigned registersCount = (width == nj::VectorWidth::Zmm) ? 32 : 16;
+        std::vector<unsigned> freeRegisters;
+        for (unsigned r = registersCount; r-- > 0;) {
+            freeRegisters.push_back(r);
+        }
+
+        std::vector<unsigned> reg(count, 0);
+        unsigned usedMask = 0;
+        for (size_t pos = 0; pos < order.size(); pos++) {
+            const auto i = order[pos];
+            const auto &op = ops[i];
+            const unsigned arity = Ast::arity(op.op);
+            for (unsigned k = 0; k < arity; k++) {
+                const auto arg = op.args[k];
+                const bool repeated = (k > 0 && arg == op.args[0]);
+                if (!repeated && lastUse[arg] == pos) {
+                    freeRegisters.push_back(reg[arg]);
+                }
+            }
+            if (freeRegisters.empty()) {
+                return false;
+            }
+            reg[i] = freeRegisters.back();
+            freeRegisters.pop_back();
+            if (reg[i] < 16) {
+                usedMask |= 1u << reg[i];
+            }
+        }
+
+        generateCode(count, [&](CodeGenerator &generator) {
+            auto &allocator = generator.allocator;
+            auto &code = generator.code;
+
+            // Constants pool
+            std::vector<int32_t> constantOffset(count, 0);
+            for (auto i : order) {
+                if (ops[i].op == Op::Constant) {
+                    code.AdvanceToAlignment<ExprJIT::Real>();
+                    constantOffset[i] = static_cast<int32_t>(code.CurrentPosition());
+                    code.EmitBytes(ops[i].value);
+                }
+            }
+
+            code.BeginFunctionBodyGeneration();
+
+            nj::Register<8, false> columns;
+            nj::Register<8, false> out;
+            nj::Register<8, false> rows;
+            nj::GetParameterRegister(0, columns);
+            nj::GetParameterRegister(1, out);
+            nj::GetParameterRegister(2, rows);
+            const auto index = nj::r10;
+            const auto address = nj::r11;
+
+            auto emit = [&](uint32_t i) {
+                const auto &op = ops[i];
+                switch (op.op) {
+                case Op::Constant:
+                    code.EmitPackedBroadcast(width, reg[i], nj::rip, constantOffset[i]);
+                    break;
+                case Op::Variable:
+                    code.EmitImmediate<nj::OpCode::Mov>(address, reinterpret_cast<uint64_t>(op.variable));
+                    code.EmitPackedBroadcast(width, reg[i], address, 0);
+                    break;
+                case Op::Column:
+                    code.Emit<nj::OpCode::Mov>(address, columns, op.column * static_cast<int32_t>(sizeof(ExprJIT::Real*)));
+                    code.EmitPackedLoad(width, reg[i], address, index, nj::SIB::Scale8, 0);
+                    break;
+                case Op::Add:
+                    code.EmitPacked(nj::PackedOpCode::Add, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::Sub:
+                    code.EmitPacked(nj::PackedOpCode::Sub, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::Mul:
+                    code.EmitPacked(nj::PackedOpCode::Mul, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::Div:
+                    code.EmitPacked(nj::PackedOpCode::Div, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::Sqrt:
+                    code.EmitPacked(nj::PackedOpCode::Sqrt, width, reg[i], 0, reg[op.args[0]]);
+                    break;
+                case Op::Min:
+                    code.EmitPacked(nj::PackedOpCode::Min, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::Max:
+                    code.EmitPacked(nj::PackedOpCode::Max, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::And:
+                    code.EmitPacked(nj::PackedOpCode::And, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::AndNot:
+                    code.EmitPacked(nj::PackedOpCode::AndNot, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::Or:
+                    code.EmitPacked(nj::PackedOpCode::Or, width, reg[i], reg[op.args[0]], reg[op.args[1]]);
+                    break;
+                case Op::MaskLess:
+                    code.EmitPackedCompare(width, reg[i], reg[op.args[0]], reg[op.args[1]], nj::CompareType::Less);
+                    break;
+                case Op::MaskLessEqual:
+                    code.EmitPackedCompare(width, reg[i], reg[op.args[0]], reg[op.args[1]], nj::CompareType::LessEqual);
+                    break;
+                case Op::MaskEqual:
+                    code.EmitPackedCompare(width, reg[i], reg[op.args[0]], reg[op.args[1]], nj::CompareType::Equal);
+                    break;
+                case Op::MaskNotEqual:
+                    code.EmitPackedCompare(width, reg[i], reg[op.args[0]], reg[op.args[1]], nj::CompareType::NotEqual);
+                    break;
+                case Op::Floor:
+                    code.EmitPackedRound(width, reg[i], reg[op.args[0]], static_cast<uint8_t>(nj::RoundingMode::Floor) | 8);
+                    break;
+                case Op::Ceil:
+                    code.EmitPackedRound(width, reg[i], reg[op.args[0]], static_cast<uint8_t>(nj::RoundingMode::Ceil) | 8);
+                    break;
+                case Op::Trunc:
+                    code.EmitPackedRound(width, reg[i], reg[op.args[0]], static_cast<uint8_t>(nj::RoundingMode::Truncate) | 8);
+                    break;
+                default:
+                    break;
+                }
+            };
+
+            size_t pos = 0;
+            while (pos < order.size() && invariant[order[pos]]) {
+                emit(order[pos++]);
+            }
+
+            auto loopStart = code.AllocateLabel();
+            auto loopEnd = code.AllocateLabel();
+
+            code.Emit<nj::OpCode::Xor>(index, index);
+            code.Emit<nj::OpCode::Cmp>(index, rows);
+            code.EmitConditionalJump<nj::JccType::JAE>(loopEnd);
+            code.PlaceLabel(loopStart);
+
+            while (pos < order.size()) {
+                emit(order[pos++]);
+            }
+
+            code.EmitPackedStore(width, out, index, nj::SIB::Scale8, 0, reg[ast.root]);
+            code.EmitImmediate<nj::OpCode::Add>(index, static_cast<int32_t>(lanes));
+            code.Emit<nj::OpCode::Cmp>(index, rows);
+            code.EmitConditionalJump<nj::JccType::JB>(loopStart);
+
+            code.PlaceLabel(loopEnd);
+            code.EmitVZeroUpper();
+
+            const nj::FunctionSpecification spec(allocator,
+                                                 -1,
+                                                 0,
+                                                 0,
+                                                 usedMask & nj::CallingConvention::c_xmmNonVolatileRegistersMask,
+                                                 nj::FunctionSpecification::BaseRegisterType::Unused,
+                                                 code.IsDiagnosticsStreamAvailable()
+                                                 ? &code.GetDiagnosticsStream()
+                                                 : nullptr);
+            code.EndFunctionBodyGeneration(spec);
+
+            func = generator.commit<Kernel>(block);
+        });
+        return true;
+    }
+
+    /**
+     * @brief Evaluate the whole vectors part of a batch.
+     * @return Number of rows evaluated.
+     */
+    size_t eval(const ExprJIT::Real* const* columns, ExprJIT::Real *out, size_t n) const
+    {
+        const size_t rows = n - n % lanes;
+        if (rows > 0) {
+            func(columns, out, rows);
+        }
+        return rows;
+    }
+
+};
+
+//----------------------------------------------------------
+//  NativeJIT batch compiler wrapper
+//----------------------------------------------------------
+
+/**
+ * @brief Compiles an expression into a kernel that loops over rows.
+ *
+ * The generated function takes the array of input columns, the output
+ * array and the number of rows. The loop over the rows is a part
+ * of the generated code, so the per-row cost is just the expression
+ * evaluation itself.
+ */
+struct BatchCompiler
+{
+    using Kernel = nj::Function<uint64_t, ExprJIT::Real**, ExprJIT::Real*, uint64_t>;
+
+    Kernel::FunctionType func = nullptr;
+    CodeArena::Block block;
+
+    Parser parser;
+    std::unique_ptr<VectorCompiler> vectorCompiler;
+    size_t columnsCount = 0;
+
+    static uint64_t returnZero(ExprJIT::Real**, ExprJIT::Real *out, uint64_t n)
+    {
+        std::fill(out, out + n, 0.0);
+        return n;
+    }
+
+    BatchCompiler(SymbolTable &symbols)
+        : func(BatchCompiler::returnZero),
+          block(),
+          parser(symbols),
+          vectorCompiler(nullptr)
+    {
+    }
+
+    bool compile(const std::string &str, const std::vector<std::string> &columns, int vectorWidth)
+    {
+        Ast ast;
+        parser.bindColumns(columns);
+        vectorCompiler.reset();
+        if (!parser.parse(str, ast)) {
+            func = BatchCompiler::returnZero;
+            block.release();
+            columnsCount = 0;
+            return false;
+        }
+        ast = optimize(ast, parser.symbols());
+
+        generateCode(ast.nodes.size(), [&](CodeGenerator &generator) {
+            Kernel kernel(generator.allocator, generator.code);
+            Lowering lowering(kernel);
+
+            // Loop variables must precede the loop body nodes.
+            auto &rowOffset = kernel.LoopVariable<uint64_t>();
+            auto &columnsNode = kernel.LoopVariable<ExprJIT::Real**>();
+            lowering.bindColumns(columnsNode, rowOffset);
+
+            auto &loop = kernel.Loop(rowOffset, columnsNode, lowering.lower(ast),
+                                     kernel.GetP2(), kernel.GetP3(), kernel.GetP1());
+            kernel.Compile(loop);
+            func = generator.commit<Kernel::FunctionType>(block);
+        });
+        columnsCount = columns.size();
+
+        nj::VectorWidth width;
+        if (cpu::vectorWidth(vectorWidth, width)) {
+            vectorCompiler = std::make_unique<VectorCompiler>(width);
+            if (!vectorCompiler->compile(ast, parser.symbols())) {
+                vectorCompiler.reset();
+            }
+        }
+
+        return true;
+    }
+
+    void eval(const ExprJIT::Real* const* columns, ExprJIT::Real *out, size_t n) const
+    {
+        size_t done = 0;
+        if (vectorCompiler != nullptr) {
+            done = vectorCompiler->eval(columns, out, n);
+            if (done == n) {
+                return;
+            }
+        }
+
+        // The kernel only reads the columns.
+        auto **tail = const_cast<ExprJIT::Real**>(columns);
+
+        // Remaining rows go through the scalar kernel
+        ExprJIT::Real *offset[BATCH_STACK_COLUMNS];
+        std::vector<ExprJIT::Real*> wide;
+        if (done > 0) {
+            if (columnsCount > BATCH_STACK_COLUMNS) {
+                wide.resize(columnsCount);
+                tail = wide.data();
+            } else {
+                tail = offset;
+            }
+            for (size_t i = 0; i < columnsCount; i++) {
+                tail[i] = const_cast<ExprJIT::Real*>(columns[i]) + done;
+            }
+        }
+        func(tail, out + done, n - done);
+    }
+
+};
+
+//----------------------------------------------------------
+//  NativeJIT fused expressions compiler wrapper
+//----------------------------------------------------------
+
+/**
+ * @brief Compiles several expressions into one function.
+ *
+ * The expressions are optimized as a single tree, so that their common
+ * subexpressions, including the variables reads, are evaluated once.
+ * The function stores the expressions values into an output array.
+ */
+struct FusedCompiler
+{
+    using Kernel = nj::Function<ExprJIT::Real, ExprJIT::Real*>;
+
+    Kernel::FunctionType func = nullptr;
+    CodeArena::Block block;
+    size_t outputsCount = 0;
+    std::string message;
+
+    Parser parser;
+
+    FusedCompiler(SymbolTable &symbols)
+        : block(),
+          message(),
+          parser(symbols)
+    {
+    }
+
+    bool compile(const std::vector<std::string> &expressions)
+    {
+        func = nullptr;
+        outputsCount = 0;
+        block.release();
+
+        Ast ast;
+        for (size_t i = 0; i < expressions.size(); i++) {
+            Ast tree;
+            if (!parser.parse(expressions[i], tree)) {
+                message = "Expression " + std::to_string(i) + ": " + parser.message();
+                return false;
+            }
+            ast.outputs.push_back(ast.append(tree));
+        }
+        message.clear();
+        if (ast.outputs.empty()) {
+            return true;
+        }
+        ast.root = ast.outputs.back();
+        ast = optimize(ast, parser.symbols());
+
+        generateCode(ast.nodes.size(), [&](CodeGenerator &generator) {
+            Kernel kernel(generator.allocator, generator.code);
+            Lowering lowering(kernel);
+            const auto values = lowering.lowerOutputs(ast);
+
+            std::vector<Lowering::Node*> stores;
+            for (size_t i = 0; i < values.size(); i++) {
+                const auto offset = static_cast<int32_t>(i * sizeof(ExprJIT::Real));
+                stores.push_back(&kernel.Store(kernel.GetP1(), offset, *values[i]));
+            }
+            kernel.Compile(sequence(kernel, stores, 0, stores.size()));
+            func = generator.commit<Kernel::FunctionType>(block);
+        });
+        outputsCount = expressions.size();
+
+        return true;
+    }
+
+    void eval(ExprJIT::Real *out) const
+    {
+        if (func != nullptr) {
+            func(out);
+        }
+    }
+
+private:
+
+    /// Nodes evaluated in a balanced tree of sequences, to keep the code generation recursion shallow.
+    static Lowering::Node& sequence(Kernel &kernel, const std::vector<Lowering::Node*> &nodes, size_t begin, size_t end)
+    {
+        if (end - begin == 1) {
+            return *nodes[begin];
+        }
+        const size_t middle = begin + (end - begin) / 2;
+        return kernel.Sequence(sequence(kernel, nodes, begin, middle), sequence(kernel, nodes, middle, end));
+    }
+};
+
+//----------------------------------------------------------
+//  ExprJIT::ThreadPool
+//----------------------------------------------------------
+
+/**
+ * @brief Work-stealing threads pool.
+ *
+ * Every thread, the calling one included, has its own queue of tasks.
+ * A thread takes the tasks from the front of its queue, and once it is
+ * empty steals them from the back of the other queues.
+ */
+struct ExprJIT::ThreadPool::Impl
+{
+    /// Task called with the task index and the calling thread index.
+    using Task = std::function<void(size_t, size_t)>;
+
+    struct Item
+    {
+        const Task *task;
+        size_t index;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<Queue>> queues; ///< Per thread, the calling one is the last.
+
+    std::mutex mutex;
+    std::condition_variable wakeUp;             ///< Tasks are queued, or stopping.
+    std::condition_variable finished;           ///< All the tasks are done.
+    std::atomic<size_t> queued;                 ///< Tasks in the queues.
+    size_t pending;                             ///< Tasks not yet done.
+    bool stop;
+
+    std::mutex runMutex;                        ///< One run at a time.
+
+    Impl(size_t count)
+        : threads(),
+          queues(),
+          queued(0),
+          pending(0),
+          stop(false)
+    {
+        if (count == 0) {
+            count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+        for (size_t i = 0; i < count; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i + 1 < count; i++) {
+            threads.emplace_back([this, i]() { loop(i); });
+        }
+    }
+
+    ~Impl()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wakeUp.notify_all();
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * @brief Run the tasks 0 to count-1 and wait for them to be done.
+     *
+     * The tasks are split into contiguous ranges, one per queue.
+     */
+    void run(size_t count, const Task &task)
+    {
+        std::lock_guard<std::mutex> runLock(runMutex);
+
+        // The counters are set first, a thread leaving work() might
+        // still take an item as soon as it is queued.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = count;
+            queued += count;
+        }
+
+        const size_t q = queues.size();
+        for (size_t i = 0; i < q; i++) {
+            std::lock_guard<std::mutex> lock(queues[i]->mutex);
+            for (size_t index = count * i / q; index < count * (i + 1) / q; index++) {
+                queues[i]->items.push_back(Item{ &task, index });
+            }
+        }
+        wakeUp.notify_all();
+
+        work(q - 1);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this]() { return pending == 0; });
+    }
+
+private:
+
+    void loop(size_t index)
+    {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeUp.wait(lock, [this]() { return stop || queued > 0; });
+                if (stop) {
+                    return;
+                }
+            }
+            work(index);
+        }
+    }
+
+    /**
+     * @brief Run the queued tasks until there are none left.
+     * @param index Calling thread index.
+     */
+    void work(size_t index)
+    {
+        Item item;
+        while (take(index, item)) {
+            (*item.task)(item.index, index);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+
+    bool take(size_t index, Item &item)
+    {
+        const size_t q = queues.size();
+        for (size_t k = 0; k < q; k++) {
+            auto &queue = *queues[(index + k) % q];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.items.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                item = queue.items.front();
+                queue.items.pop_front();
+            } else {
+                item = queue.items.back();
+                queue.items.pop_back();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+};
+
+ExprJIT::ThreadPool::ThreadPool(size_t threads)
+    : d(std::make_unique<Impl>(threads))
+{
+}
+
+ExprJIT::ThreadPool::~ThreadPool() = default;
+
+size_t ExprJIT::ThreadPool::size() const
+{
+    return d->queues.size();
+}
+
+//----------------------------------------------------------
+//  ExprJIT::Program
+//----------------------------------------------------------
+
+/**
+ * @brief Compiled program code.
+ *
+ * The generated function takes the frame pointer, so the code does not
+ * depend on the variables addresses and can be shared between threads
+ * and between the programs of the same expression.
+ *
+ * The code only refers the constants pool at the beginning of the code
+ * buffer relative to the instruction pointer. The only absolute addresses
+ * are the ones of the called functions, stored in the constants pool.
+ * So the code can be copied to another buffer, in another process, once
+ * the functions addresses are relocated.
+ */
+struct ProgramCode
+{
+    using Kernel = nj::Function<ExprJIT::Real, ExprJIT::Real*>;
+
+    /// Function address in the constants pool.
+    struct Relocation
+    {
+        uint32_t offset;        ///< Offset from the code start.
+        uint32_t function;      ///< Function index, see ProgramKey.
+    };
+
+    Kernel::FunctionType func = nullptr;
+    CodeArena::Block block;
+    bool compiled = false;      ///< Whether the code has been compiled rather than loaded.
+    uint32_t poolSize = 0;      ///< Constants pool size of the compiled code.
+
+    ProgramCode()
+        : block()
+    {
+    }
+
+    /**
+     * @brief Compile an optimized expression tree.
+     * @param ast Expression tree.
+     * @param slots Variables pointers, in the frame slots order.
+     */
+    void compile(const Ast &ast, const std::vector<ExprJIT::Real*> &slots)
+    {
+        generateCode(ast.nodes.size(), [&](CodeGenerator &generator) {
+            Kernel kernel(generator.allocator, generator.code);
+            Lowering lowering(kernel);
+            lowering.bindFrame(kernel.GetP1(), slots);
+            kernel.Compile(lowering.lower(ast));
+            func = generator.commit<Kernel::FunctionType>(block);
+            poolSize = generator.code.GetFunctionCodeStartOffset();
+        });
+        compiled = true;
+    }
+
+    /**
+     * @brief Copy the code to the executable memory and relocate it.
+     * @param bytes Code bytes.
+     * @param entry Entry point offset.
+     * @param relocations Functions addresses offsets.
+     * @param functions Functions addresses.
+     */
+    void load(const std::vector<uint8_t> &bytes,
+              uint32_t entry,
+              const std::vector<Relocation> &relocations,
+              const std::vector<uintptr_t> &functions)
+    {
+        // The executable memory is not writable.
+        std::vector<uint8_t> relocated(bytes);
+        for (const auto &relocation : relocations) {
+            const uint64_t address = functions[relocation.function];
+            std::memcpy(relocated.data() + relocation.offset, &address, sizeof(address));
+        }
+        block.assign(relocated.data(), relocated.size());
+        func = reinterpret_cast<Kernel::FunctionType>(block.start() + entry);
+    }
+
+    /**
+     * @brief Get the code bytes to be stored.
+     * @param functions Functions addresses, to be found in the constants pool.
+     * @return false if the code cannot be relocated.
+     */
+    bool save(std::vector<uint8_t> &bytes,
+              uint32_t &entry,
+              std::vector<Relocation> &relocations,
+              const std::vector<uintptr_t> &functions) const
+    {
+        if (!compiled) {
+            return false;
+        }
+
+        const uint8_t *start = block.start();
+        bytes.assign(start, start + block.size());
+        entry = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(func) - start);
+
+        // The constants pool precedes the function code.
+        relocations.clear();
+        for (uint32_t offset = 0; offset + sizeof(uint64_t) <= poolSize; offset += sizeof(uint64_t)) {
+            uint64_t value = 0;
+            std::memcpy(&value, start + offset, sizeof(value));
+            for (size_t i = 0; i < functions.size(); i++) {
+                if (value == functions[i]) {
+                    relocations.push_back(Relocation{ offset, static_cast<uint32_t>(i) });
+                }
+            }
+        }
+
+        return true;
+    }
+};
+
+/**
+ * @brief Identifies the code of a program.
+ *
+ * The key is made of the optimized expression tree, so it does not
+ * depend on the expression formatting. The variables are identified
+ * by their frame slots, and the functions by their indices in the
+ * functions list. The code can be shared by the programs calling the
+ * same functions, and stored for the programs calling the functions
+ * of the same names.
+ */
+struct ProgramKey
+{
+    std::string tree;                           ///< Serialized expression tree.
+    std::vector<uintptr_t> functions;           ///< Functions addresses, by index.
+    std::vector<std::string> functionNames;     ///< Functions names, by index.
+
+    ProgramKey(const Ast &ast, const std::vector<ExprJIT::Real*> &slots, const SymbolTable &symbols)
+        : tree(),
+          functions(),
+          functionNames()
+    {
+        tree.reserve((ast.nodes.size() + 1) * sizeof(Ast::Node));
+        append(tree, ast.root);
+        for (const auto &node : ast.nodes) {
+            append(tree, node.op);
+            for (unsigned k = 0; k < Ast::arity(node.op); k++) {
+                append(tree, node.args[k]);
+            }
+            switch (node.op) {
+            case Ast::Op::Constant:
+                append(tree, node.value);
+                break;
+            case Ast::Op::Variable:
+                append(tree, std::find(slots.begin(), slots.end(), node.variable) - slots.begin());
+                break;
+            case Ast::Op::Column:
+                append(tree, node.column);
+                break;
+            case Ast::Op::Call1:
+                append(tree, function(reinterpret_cast<uintptr_t>(node.function1), symbols.funcName(node.function1)));
+                break;
+            case Ast::Op::Call2:
+                append(tree, function(reinterpret_cast<uintptr_t>(node.function2), symbols.funcName(node.function2)));
+                break;
+            case Ast::Op::Call3:
+                append(tree, function(reinterpret_cast<uintptr_t>(node.function3), symbols.funcName(node.function3)));
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    /**
+     * @brief Key of the code in this process.
+     */
+    std::string local() const
+    {
+        std::string res = tree;
+        for (auto address : functions) {
+            append(res, address);
+        }
+        return res;
+    }
+
+    /**
+     * @brief Key of the stored code, valid across the processes.
+     */
+    std::string stored() const
+    {
+        std::string res;
+        append(res, PROGRAM_STORE_VERSION);
+        append(res, cpu::hasSSE41());
+        append(res, tree.size());
+        res += tree;
+        for (const auto &name : functionNames) {
+            append(res, name.size());
+            res += name;
+        }
+        return res;
+    }
+
+    template <typename T>
+    static void append(std::string &key, const T &value)
+    {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+private:
+
+    uint32_t function(uintptr_t address, const std::string &name)
+    {
+        const auto it = std::find(functions.begin(), functions.end(), address);
+        if (it != functions.end()) {
+            return static_cast<uint32_t>(it - functions.begin());
+        }
+        functions.push_back(address);
+        functionNames.push_back(name);
+        return static_cast<uint32_t>(functions.size() - 1);
+    }
+};
+
+/**
+ * @brief Process-wide cache of the compiled programs code.
+ *
+ * The least recently used code is evicted once the cache is full.
+ * If the cache directory is set, the code is stored there as well,
+ * and loaded by the other processes instead of being compiled.
+ */
+class ProgramCache final
+{
+public:
+
+    using Code = std::shared_ptr<const ProgramCode>;
+
+    static ProgramCache& instance()
+    {
+        static ProgramCache cache;
+        return cache;
+    }
+
+    Code find(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_index.find(key);
+        if (it == m_index.end()) {
+            m_statistics.misses++;
+            return nullptr;
+        }
+        m_statistics.hits++;
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return it->second->second;
+    }
+
+    void insert(const std::string &key, const Code &code)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_statistics.capacity == 0 || m_index.find(key) != m_index.end()) {
+            return;
+        }
+        m_entries.emplace_front(key, code);
+        m_index.insert(std::make_pair(key, m_entries.begin()));
+        evict();
+    }
+
+    /**
+     * @brief Load the stored code from the cache directory.
+     * @return nullptr if there is no valid code stored.
+     */
+    Code load(const ProgramKey &key)
+    {
+        const std::string path = this->path(key);
+        if (path.empty()) {
+            return nullptr;
+        }
+
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return nullptr;
+        }
+
+        const std::string stored = key.stored();
+        std::string header;
+        std::vector<ProgramCode::Relocation> relocations;
+        uint32_t entry = 0;
+        std::vector<uint8_t> bytes;
+        if (!read(file, header, stored.size()) || header != stored ||
+            !read(file, relocations) || !read(file, entry) || !read(file, bytes) ||
+            entry >= bytes.size()) {
+            return nullptr;
+        }
+        for (const auto &relocation : relocations) {
+            if (relocation.function >= key.functions.size() ||
+                relocation.offset + sizeof(uint64_t) > bytes.size()) {
+                return nullptr;
+            }
+        }
+
+        auto code = std::make_shared<ProgramCode>();
+        code->load(bytes, entry, relocations, key.functions);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_statistics.loads++;
+        return code;
+    }
+
+    /**
+     * @brief Store the compiled code in the cache directory.
+     * @param key Program key.
+     * @param code Compiled code.
+     * @param ast Program expression tree.
+     */
+    void store(const ProgramKey &key, const ProgramCode &code, const Ast &ast)
+    {
+        const std::string path = this->path(key);
+        if (path.empty()) {
+            return;
+        }
+
+        std::vector<uint8_t> bytes;
+        uint32_t entry = 0;
+        std::vector<ProgramCode::Relocation> relocations;
+        if (!code.save(bytes, entry, relocations, key.functions)) {
+            return;
+        }
+
+        // Function addresses are found by their values, a constant
+        // of the same value would be relocated as well.
+        for (const auto &node : ast.nodes) {
+            uint64_t value = 0;
+            std::memcpy(&value, &node.value, sizeof(value));
+            if (node.op == Ast::Op::Constant &&
+                std::find(key.functions.begin(), key.functions.end(), value) != key.functions.end()) {
+                return;
+            }
+        }
+
+        // The file is written under a temporary name, so that the other
+        // processes never read a partially written one.
+        const std::string tmpPath = path + "." + std::to_string(std::random_device()()) + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::binary);
+            const std::string stored = key.stored();
+            file.write(stored.data(), static_cast<std::streamsize>(stored.size()));
+            write(file, relocations);
+            write(file, entry);
+            write(file, bytes);
+            if (!file) {
+                file.close();
+                std::remove(tmpPath.c_str());
+                return;
+            }
+        }
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::remove(tmpPath.c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_statistics.stores++;
+    }
+
+    void setCapacity(size_t capacity)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_statistics.capacity = capacity;
+        evict();
+    }
+
+    void setDirectory(const std::string &directory)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_directory = directory;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.clear();
+        m_index.clear();
+        const auto capacity = m_statistics.capacity;
+        m_statistics = ExprJIT::CacheStatistics();
+        m_statistics.capacity = capacity;
+    }
+
+    ExprJIT::CacheStatistics statistics()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto res = m_statistics;
+        res.size = m_entries.size();
+        return res;
+    }
+
+private:
+
+    using Entry = std::pair<std::string, Code>;
+
+    ProgramCache()
+        : m_mutex(),
+          m_entries(),
+          m_index(),
+          m_statistics(),
+          m_directory()
+    {
+        m_statistics.capacity = PROGRAM_CACHE_CAPACITY;
+    }
+
+    void evict()
+    {
+        while (m_entries.size() > m_statistics.capacity) {
+            m_index.erase(m_entries.back().first);
+            m_entries.pop_back();
+            m_statistics.evictions++;
+        }
+    }
+
+    /**
+     * @brief Stored code file path, named after the key hash.
+     * @return Empty path if there is no cache directory.
+     */
+    std::string path(const ProgramKey &key)
+    {
+        std::string directory;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            directory = m_directory;
+        }
+        if (directory.empty()) {
+            return directory;
+        }
+
+        // 64-bit FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        for (auto c : key.stored()) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+
+        std::ostringstream ss;
+        ss << directory << '/' << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+        return ss.str();
+    }
+
+    template <typename T>
+    static void write(std::ostream &out, const T &value)
+    {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static void write(std::ostream &out, const std::vector<T> &values)
+    {
+        write(out, static_cast<uint64_t>(values.size()));
+        out.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(T)));
+    }
+
+    template <typename T>
+    static bool read(std::istream &in, T &value)
+    {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    template <typename T>
+    static bool read(std::istream &in, std::vector<T> &values)
+    {
+        uint64_t size = 0;
+        if (!read(in, size) || size > CODE_BUFFER_MAX_SIZE) {
+            return false;
+        }
+        values.resize(size);
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(size * sizeof(T))));
+    }
+
+    static bool read(std::istream &in, std::string &value, size_t size)
+    {
+        value.resize(size);
+        return static_cast<bool>(in.read(&value[0], static_cast<std::streamsize>(size)));
+    }
+
+    std::mutex m_mutex;
+    std::list<Entry> m_entries;     ///< Most recently used first.
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+    ExprJIT::CacheStatistics m_statistics;
+    std::string m_directory;        ///< Stored code directory, none if empty.
+};
+
+struct ExprJIT::Program::Impl
+{
+    ProgramCache::Code code;
+    std::vector<std::string> variables;     ///< Variables names, by frame slot.
+    std::vector<ExprJIT::Real> frame;       ///< Initial frame values.
+
+    Impl()
+        : code(nullptr),
+          variables(),
+          frame()
+    {
+    }
+
+    bool compile(SymbolTable &symbols, const std::string &str, std::string &message)
+    {
+        Parser parser(symbols);
+        Ast ast;
+        if (!parser.parse(str, ast)) {
+            message = parser.message();
+            return false;
+        }
+        ast = optimize(ast, symbols);
+
+        // Frame slots, in the variables first use order
+        std::vector<ExprJIT::Real*> slots;
+        for (const auto &node : ast.nodes) {
+            if (node.op == Ast::Op::Variable &&
+                std::find(slots.begin(), slots.end(), node.variable) == slots.end()) {
+                slots.push_back(node.variable);
+                variables.push_back(symbols.varName(node.variable));
+                frame.push_back(*node.variable);
+            }
+        }
+
+        auto &cache = ProgramCache::instance();
+        const ProgramKey key(ast, slots, symbols);
+        const auto localKey = key.local();
+        code = cache.find(localKey);
+        if (code == nullptr) {
+            code = cache.load(key);
+            if (code == nullptr) {
+                auto compiled = std::make_shared<ProgramCode>();
+                compiled->compile(ast, slots);
+                cache.store(key, *compiled, ast);
+                code = compiled;
+            }
+            cache.insert(localKey, code);
+        }
+
+        message.clear();
+        return true;
+    }
+};
+
+ExprJIT::Program::Program()
+    : d(std::make_unique<Impl>())
+{
+}
+
+ExprJIT::Program::~Program() = default;
 
-    Node& parseMulDiv(std::istream &in, bool &isConstant, ExprJIT::Real &constValue)
-    {
-        bool isC = false;
-        ExprJIT::Real cVal;
+const std::vector<std::string>& ExprJIT::Program::variables() const
+{
+    return d->variables;
+}
 
-        isConstant = false;
+//----------------------------------------------------------
+//  ExprJIT::Context
+//----------------------------------------------------------
 
-        ExprJIT::Real accumulator = 1.0;
-        std::vector<std::reference_wrapper<Node> > mulNodes;
-        std::vector<std::reference_wrapper<Node> > divNodes;
+ExprJIT::Context::Context(std::shared_ptr<const Program> program)
+    : m_program(program),
+      m_frame(program->d->frame)
+{
+}
 
-        Node &lnode = parseTerm(in, isC, cVal);
-        if (isC) {
-            accumulator = cVal;
-            markUnused(lnode);
-        } else {
-            mulNodes.push_back(lnode);
-        }
+bool ExprJIT::Context::set(const std::string &name, const ExprJIT::Real value)
+{
+    const auto &variables = m_program->d->variables;
+    const auto it = std::find(variables.begin(), variables.end(), name);
+    if (it == variables.end()) {
+        return false;
+    }
+    m_frame[static_cast<size_t>(it - variables.begin())] = value;
+    return true;
+}
 
-        if (!error()) {
-            bool done = false;
-            do {
-                skipSpace(in);
-                auto c = in.peek();
-                if (c == '*') {
-                    in.get();
-                    Node &rnode = parseTerm(in, isC, cVal);
-                    if (isC) {
-                        accumulator *= cVal;
-                        markUnused(rnode);
-                    } else {
-                        mulNodes.push_back(rnode);
-                    }
-                } else if (c == '/') {
-                    in.get();
-                    Node &rnode = parseTerm(in, isC, cVal);
-                    if (isC) {
-                        accumulator /= cVal;
-                        markUnused(rnode);
-                    } else {
-                        divNodes.push_back(rnode);
-                    }
+ExprJIT::Real ExprJIT::Context::eval() const
+{
+    // The program only reads the frame.
+    return m_program->d->code->func(const_cast<ExprJIT::Real*>(m_frame.data()));
+}
 
-                } else {
-                    done = true;
-                }
-            } while (!done);
-        }
+//----------------------------------------------------------
+//  ExprJIT::Module
+//----------------------------------------------------------
 
-        // There is no division node so we have to implement is as a function call
+/**
+ * @brief Code of the module expressions.
+ *
+ * The expressions are compiled one by one, and their code, which does
+ * not depend on its address, is packed into one executable memory block.
+ * Each expression code keeps its own constants pool, which precedes it.
+ */
+struct ExprJIT::Module::Impl
+{
+    using Kernel = nj::Function<ExprJIT::Real, ExprJIT::Real*>;
+
+    CodeArena::Block block;
+    std::vector<Kernel::FunctionType> entries;  ///< Expressions entry points.
+    std::vector<std::string> variables;         ///< Variables names, by frame slot.
+    std::vector<ExprJIT::Real> frame;           ///< Initial frame values.
+
+    Impl()
+        : block(),
+          entries(),
+          variables(),
+          frame()
+    {
+    }
 
-        if (!mulNodes.empty()) {
-            std::reference_wrapper<Node> n = mulNodes.front();
-            for (size_t i = 1; i < mulNodes.size(); i++) {
-                Node &p = mulNodes.at(i);
-                n = m_nodeFactory.Mul(n.get(), p);
+    bool compile(SymbolTable &symbols, const std::vector<std::string> &expressions, std::string &message)
+    {
+        Parser parser(symbols);
+        std::vector<Ast> asts(expressions.size());
+        for (size_t i = 0; i < expressions.size(); i++) {
+            if (!parser.parse(expressions[i], asts[i])) {
+                message = "Expression " + std::to_string(i) + ": " + parser.message();
+                return false;
             }
-            if (!divNodes.empty()) {
-                std::reference_wrapper<Node> p = divNodes.front();
-                for (size_t i = 1; i < divNodes.size(); i++) {
-                    Node &d = divNodes.at(i);
-                    p = m_nodeFactory.Mul(p.get(), d);
+            asts[i] = optimize(asts[i], symbols);
+        }
+
+        // Frame slots, in the variables first use order
+        std::vector<ExprJIT::Real*> slots;
+        for (const auto &ast : asts) {
+            for (const auto &node : ast.nodes) {
+                if (node.op == Ast::Op::Variable &&
+                    std::find(slots.begin(), slots.end(), node.variable) == slots.end()) {
+                    slots.push_back(node.variable);
+                    variables.push_back(symbols.varName(node.variable));
+                    frame.push_back(*node.variable);
                 }
-                auto &call = m_nodeFactory.Immediate(Parser::invf);
-                p = m_nodeFactory.Call(call, p.get());
-                n = m_nodeFactory.Mul(n.get(), p.get());
-            }
-            if (accumulator != 1.0) {
-                n = m_nodeFactory.Mul(n.get(), m_nodeFactory.Immediate(accumulator));
             }
-            return n.get();
         }
 
-        if (!divNodes.empty()) {
-            std::reference_wrapper<Node> n = divNodes.front();
-            for (size_t i = 1; i < divNodes.size(); i++) {
-                Node &p = divNodes.at(i);
-                n = m_nodeFactory.Mul(n.get(), p);
-            }
-            auto &call = m_nodeFactory.Immediate(Parser::invf);
-            n = m_nodeFactory.Call(call, n.get());
-            if (accumulator != 1.0) {
-                n = m_nodeFactory.Mul(n.get(), m_nodeFactory.Immediate(accumulator));
-            }
-            return n.get();
+        // Entry points offsets, the code being aligned as in the arena
+        std::vector<uint8_t> code;
+        std::vector<size_t> offsets;
+        for (const auto &ast : asts) {
+            generateCode(ast.nodes.size(), [&](CodeGenerator &generator) {
+                Kernel kernel(generator.allocator, generator.code);
+                Lowering lowering(kernel);
+                lowering.bindFrame(kernel.GetP1(), slots);
+                kernel.Compile(lowering.lower(ast));
+
+                const uint8_t *start = generator.code.BufferStart();
+                const uint8_t *entry = static_cast<const uint8_t*>(generator.code.GetEntryPoint());
+                code.resize((code.size() + CODE_ARENA_ALIGNMENT - 1) / CODE_ARENA_ALIGNMENT * CODE_ARENA_ALIGNMENT);
+                offsets.push_back(code.size() + static_cast<size_t>(entry - start));
+                code.insert(code.end(), start, start + generator.code.CurrentPosition());
+            });
+        }
+
+        if (!code.empty()) {
+            block.assign(code.data(), code.size());
+        }
+        for (const auto offset : offsets) {
+            entries.push_back(reinterpret_cast<Kernel::FunctionType>(block.start() + offset));
         }
 
-        isConstant = true;
-        constValue = accumulator;
-        return m_nodeFactory.Immediate(constValue);
+        message.clear();
+        return true;
     }
+};
 
-    Node& parseAddSub(std::istream &in, bool &isConstant, ExprJIT::Real &constValue)
-    {
-        bool isC = false;
-        ExprJIT::Real cVal;
+ExprJIT::Module::Module()
+    : d(std::make_unique<Impl>())
+{
+}
 
-        isConstant = false;
+ExprJIT::Module::~Module() = default;
 
-        ExprJIT::Real accumulator = 0.0;
-        std::vector<std::reference_wrapper<Node> > addNodes;
-        std::vector<std::reference_wrapper<Node> > subNodes;
+size_t ExprJIT::Module::size() const
+{
+    return d->entries.size();
+}
 
-        Node &lnode = parseMulDiv(in, isC, cVal);
-        if (isC) {
-            accumulator = cVal;
-            markUnused(lnode);
-        } else {
-            addNodes.push_back(lnode);
-        }
+const std::vector<std::string>& ExprJIT::Module::variables() const
+{
+    return d->variables;
+}
 
-        if (!error()) {
-            bool done = false;
-            do {
-                skipSpace(in);
-                auto c = in.peek();
-                if (c == '+') {
-                    in.get();
-                    Node &rnode = parseMulDiv(in, isC, cVal);
-                    if (isC) {
-                        accumulator += cVal;
-                        markUnused(rnode);
-                    } else {
-                        addNodes.push_back(rnode);
-                    }
-                } else if (c == '-') {
-                    in.get();
-                    Node &rnode = parseMulDiv(in, isC, cVal);
-                    if (isC) {
-                        accumulator -= cVal;
-                        markUnused(rnode);
-                    } else {
-                        subNodes.push_back(rnode);
-                    }
-                } else {
-                    done = true;
-                }
-            } while (!done);
-        }
+const std::vector<ExprJIT::Real>& ExprJIT::Module::frame() const
+{
+    return d->frame;
+}
 
-        if (!addNodes.empty()) {
-            std::reference_wrapper<Node> n = addNodes.front();
-            for (size_t i = 1; i < addNodes.size(); i++) {
-                Node &p = addNodes.at(i);
-                n = m_nodeFactory.Add(n.get(), p);
-            }
-            for (auto &&p : subNodes) {
-                n = m_nodeFactory.Sub(n.get(), p.get());
-            }
-            if (accumulator != 0.0) {
-                n = m_nodeFactory.Add(n.get(), m_nodeFactory.Immediate(accumulator));
-            }
-            return n;
-        }
+ExprJIT::Real ExprJIT::Module::eval(size_t index, const ExprJIT::Real *frame) const
+{
+    // The code only reads the frame.
+    return d->entries[index](const_cast<ExprJIT::Real*>(frame));
+}
 
-        if (!subNodes.empty()) {
-            std::reference_wrapper<Node> n = m_nodeFactory.Immediate(accumulator);
-            for (auto &&p : subNodes) {
-                n = m_nodeFactory.Sub(n.get(), p.get());
-            }
-            return n;
-        }
+void ExprJIT::Module::evalAll(const ExprJIT::Real *frame, ExprJIT::Real *out) const
+{
+    auto *f = const_cast<ExprJIT::Real*>(frame);
+    for (const auto entry : d->entries) {
+        *out++ = entry(f);
+    }
+}
 
-        isConstant = true;
-        constValue = accumulator;
-        return m_nodeFactory.Immediate(constValue);
+void ExprJIT::Module::eval(const std::vector<size_t> &indices, const ExprJIT::Real *frame, ExprJIT::Real *out) const
+{
+    auto *f = const_cast<ExprJIT::Real*>(frame);
+    for (const auto index : indices) {
+        *out++ = d->entries[index](f);
     }
+}
 
+//----------------------------------------------------------
+//  Environment
+//----------------------------------------------------------
 
-#undef PARSE_ERR
+struct ExprJIT::Environment::Impl
+{
+    std::shared_ptr<VariableStorage> storage = std::make_shared<VariableStorage>();
+};
 
-    nj::ExpressionNodeFactory &m_nodeFactory;
-    SymbolTable &m_symbols; ///< External variables.
-    bool m_error;           ///< Parsing error flag.
-    std::string m_message;  ///< Error message.
+ExprJIT::Environment::Environment()
+    : d(std::make_unique<Impl>())
+{
+}
 
-    /// Cache for variables Deref nodes.
-    std::map<std::string, Node&> m_symbolsCache;
-};
+ExprJIT::Environment::~Environment() = default;
+
+ExprJIT::VarHandle ExprJIT::Environment::variable(const std::string &name)
+{
+    auto *ptr = d->storage->define(name);
+    auto *version = d->storage->version(ptr);
+    assert(version != nullptr);
+    return VarHandle(ptr, version);
+}
+
+void ExprJIT::Environment::set(const std::string &name, const ExprJIT::Real value)
+{
+    d->storage->set(name, value);
+}
 
 //----------------------------------------------------------
-//  NativeJIT compiler wrapper
+//  ExprJIT private implementation
 //----------------------------------------------------------
-struct Compiler
+
+struct ExprJIT::Impl
 {
-    nj::ExecutionBuffer codeAllocator;
-    nj::Allocator allocator;
-    nj::FunctionBuffer code;
-    nj::Function<ExprJIT::Real> expression;
-    nj::Function<ExprJIT::Real>::FunctionType func = nullptr;
+    SymbolTable symbols;
+    std::unique_ptr<Compiler> compiler;
+    std::unique_ptr<BatchCompiler> batchCompiler;
+    std::unique_ptr<FunctionCompiler> functionCompiler;
+    std::unique_ptr<FusedCompiler> fusedCompiler;
+    std::string message;    ///< Last compilation error message.
+    int vectorWidth;        ///< Widest vector registers of the batch kernels, in bits.
+    bool memoize;           ///< Whether compile() memoizes the subtrees.
 
-    Parser parser;
+    explicit Impl(std::shared_ptr<VariableStorage> storage)
+        : symbols(std::move(storage)),
+          compiler(nullptr),
+          batchCompiler(nullptr),
+          functionCompiler(nullptr),
+          fusedCompiler(nullptr),
+          message(),
+          vectorWidth(512),
+          memoize(false)
+    {
+    }
 
-    static ExprJIT::Real returnZero()
+    bool compile(const std::string &str)
     {
-        return 0.0;
+        if (compiler == nullptr) {
+            compiler = std::make_unique<Compiler>(symbols);
+        }
+        bool ok = compiler->compile(str, memoize);
+        message = compiler->parser.message();
+        return ok;
     }
 
-    Compiler(SymbolTable &symbols, const size_t capacity = CODE_BUFFER_SIZE)
-        : codeAllocator(capacity),
-          allocator(capacity),
-          code(codeAllocator, static_cast<unsigned>(capacity)),
-          expression(allocator, code),
-          func(Compiler::returnZero),
-          parser(expression, symbols)
+    bool compileBatch(const std::string &str, const std::vector<std::string> &columns)
     {
-        // This will output generated assembly
-#ifdef EXPRJIT_ENABLE_ASM_OUTPUT
-        code.EnableDiagnostics(std::cout);
-#endif
+        if (batchCompiler == nullptr) {
+            batchCompiler = std::make_unique<BatchCompiler>(symbols);
+        }
+        bool ok = batchCompiler->compile(str, columns, vectorWidth);
+        message = batchCompiler->parser.message();
+        return ok;
     }
 
-    bool compile(const std::string &str)
+    bool compileFused(const std::vector<std::string> &expressions)
+    {
+        if (fusedCompiler == nullptr) {
+            fusedCompiler = std::make_unique<FusedCompiler>(symbols);
+        }
+        bool ok = fusedCompiler->compile(expressions);
+        message = fusedCompiler->message;
+        return ok;
+    }
+
+    std::shared_ptr<const ExprJIT::Program> compileProgram(const std::string &str)
     {
-        bool isConstant;
-        ExprJIT::Real constValue;
+        std::shared_ptr<ExprJIT::Program> program(new ExprJIT::Program());
+        if (!program->d->compile(symbols, str, message)) {
+            return nullptr;
+        }
+        return program;
+    }
 
-        Parser::Node& node = parser.parse(str, isConstant, constValue);
-        if (!parser.error()) {
-            func = expression.Compile(node);
+    std::shared_ptr<const ExprJIT::Module> compileModule(const std::vector<std::string> &expressions)
+    {
+        std::shared_ptr<ExprJIT::Module> module(new ExprJIT::Module());
+        if (!module->d->compile(symbols, expressions, message)) {
+            return nullptr;
         }
+        return module;
+    }
 
-        return !parser.error();
+    bool compileFunction(const std::string &str)
+    {
+        if (functionCompiler == nullptr) {
+            functionCompiler = std::make_unique<FunctionCompiler>(symbols);
+        }
+        bool ok = functionCompiler->compile(str);
+        message = functionCompiler->parser.message();
+        return ok;
     }
 
-    ExprJIT::Real eval() const
+    template <typename F>
+    bool function(F &func, size_t arity) const
     {
-        // func should always point to a valid function,
-        // either to returnZero() one or the one being compiled.
-        return func();
+        func = (functionCompiler != nullptr) ? functionCompiler->function<F>(arity) : nullptr;
+        return func != nullptr;
     }
 
-};
+    std::string error() const
+    {
+        return message;
+    }
 
-//----------------------------------------------------------
-//  ExprJIT private implementation
-//----------------------------------------------------------
+    ExprJIT::CompileStatistics compileStatistics() const
+    {
+        return (compiler != nullptr) ? compiler->statistics : ExprJIT::CompileStatistics();
+    }
 
-struct ExprJIT::Impl
-{
-    SymbolTable symbols;
-    std::unique_ptr<Compiler> compiler;
+    std::vector<std::string> dependencies() const
+    {
+        return (compiler != nullptr) ? compiler->dependencies : std::vector<std::string>();
+    }
 
-    Impl()
-        : compiler(nullptr)
+    ExprJIT::Real eval() const
     {
+        return (compiler != nullptr) ? compiler->eval() : 0.0;
     }
 
-    bool compile(const std::string &str)
+    void evalFused(ExprJIT::Real *out) const
     {
-        compiler = std::make_unique<Compiler>(symbols, CODE_BUFFER_SIZE);
-        return compiler->compile(str);
+        if (fusedCompiler != nullptr) {
+            fusedCompiler->eval(out);
+        }
     }
 
-    std::string error() const
+    void evalBatch(const ExprJIT::Real* const* columns, ExprJIT::Real *out, size_t n) const
     {
-        if (compiler != nullptr) {
-            return compiler->parser.message();
+        if (batchCompiler != nullptr) {
+            batchCompiler->eval(columns, out, n);
+        } else {
+            std::fill(out, out + n, 0.0);
         }
+    }
+
+    ExprJIT::Real evalBatch(ExprJIT::ThreadPool::Impl &pool,
+                            const ExprJIT::Real* const* columns, ExprJIT::Real *out, size_t n,
+                            ExprJIT::Reduction reduction) const
+    {
+        const size_t chunks = (n + BATCH_CHUNK_ROWS - 1) / BATCH_CHUNK_ROWS;
+        const size_t columnsCount = (batchCompiler != nullptr) ? batchCompiler->columnsCount : 0;
+
+        // Chunks output when there is no output array
+        std::vector<std::vector<ExprJIT::Real>> buffers(out == nullptr ? pool.queues.size() : 0);
+        std::vector<ExprJIT::Real> partials(chunks, 0.0);
+
+        pool.run(chunks, [&](size_t chunk, size_t thread) {
+            const size_t begin = chunk * BATCH_CHUNK_ROWS;
+            const size_t rows = std::min(BATCH_CHUNK_ROWS, n - begin);
+
+            ExprJIT::Real *chunkOut = nullptr;
+            if (out != nullptr) {
+                chunkOut = out + begin;
+            } else {
+                buffers[thread].resize(BATCH_CHUNK_ROWS);
+                chunkOut = buffers[thread].data();
+            }
 
-        return std::string();
+            std::vector<const ExprJIT::Real*> chunkColumns(columnsCount);
+            for (size_t i = 0; i < columnsCount; i++) {
+                chunkColumns[i] = columns[i] + begin;
+            }
+            evalBatch(chunkColumns.data(), chunkOut, rows);
+
+            if (reduction != ExprJIT::Reduction::None) {
+                partials[chunk] = reduce(reduction, chunkOut, rows);
+            }
+        });
+
+        return reduce(reduction, partials.data(), partials.size());
     }
 
-    ExprJIT::Real eval() const
+    static ExprJIT::Real reduce(ExprJIT::Reduction reduction, const ExprJIT::Real *values, size_t n)
     {
-        return compiler->eval();
+        ExprJIT::Real res = 0.0;
+        switch (reduction) {
+        case ExprJIT::Reduction::None:
+            break;
+        case ExprJIT::Reduction::Sum:
+            for (size_t i = 0; i < n; i++) {
+                res += values[i];
+            }
+            break;
+        case ExprJIT::Reduction::Min:
+            res = std::numeric_limits<ExprJIT::Real>::infinity();
+            for (size_t i = 0; i < n; i++) {
+                res = func::min(values[i], res);
+            }
+            break;
+        case ExprJIT::Reduction::Max:
+            res = -std::numeric_limits<ExprJIT::Real>::infinity();
+            for (size_t i = 0; i < n; i++) {
+                res = func::max(values[i], res);
+            }
+            break;
+        }
+        return res;
     }
 
 };
@@ -874,7 +5238,12 @@ ExprJIT::SymbolReference& ExprJIT::SymbolReference::operator =(Function3Ptr func
 //----------------------------------------------------------
 
 ExprJIT::ExprJIT()
-    : d(std::make_unique<Impl>())
+    : d(std::make_unique<Impl>(std::make_shared<VariableStorage>()))
+{
+}
+
+ExprJIT::ExprJIT(Environment &environment)
+    : d(std::make_unique<Impl>(environment.d->storage))
 {
 }
 
@@ -885,6 +5254,41 @@ bool ExprJIT::compile(const std::string &str)
     return d->compile(str);
 }
 
+bool ExprJIT::compileBatch(const std::string &str, const std::vector<std::string> &columns)
+{
+    return d->compileBatch(str, columns);
+}
+
+bool ExprJIT::compileFused(const std::vector<std::string> &expressions)
+{
+    return d->compileFused(expressions);
+}
+
+std::shared_ptr<const ExprJIT::Program> ExprJIT::compileProgram(const std::string &str)
+{
+    return d->compileProgram(str);
+}
+
+std::shared_ptr<const ExprJIT::Module> ExprJIT::compileModule(const std::vector<std::string> &expressions)
+{
+    return d->compileModule(expressions);
+}
+
+bool ExprJIT::compileFunction(const std::string &str)
+{
+    return d->compileFunction(str);
+}
+
+ExprJIT::CompileStatistics ExprJIT::compileStatistics() const
+{
+    return d->compileStatistics();
+}
+
+std::vector<std::string> ExprJIT::dependencies() const
+{
+    return d->dependencies();
+}
+
 std::string ExprJIT::error() const
 {
     return d->error();
@@ -895,11 +5299,100 @@ ExprJIT::Real ExprJIT::eval() const
     return d->eval();
 }
 
+void ExprJIT::evalBatch(const Real* const* columns, Real *out, size_t n) const
+{
+    d->evalBatch(columns, out, n);
+}
+
+void ExprJIT::evalFused(Real *out) const
+{
+    d->evalFused(out);
+}
+
+bool ExprJIT::function(Function0Ptr &func) const
+{
+    return d->function(func, 0);
+}
+
+bool ExprJIT::function(Function1Ptr &func) const
+{
+    return d->function(func, 1);
+}
+
+bool ExprJIT::function(Function2Ptr &func) const
+{
+    return d->function(func, 2);
+}
+
+bool ExprJIT::function(Function3Ptr &func) const
+{
+    return d->function(func, 3);
+}
+
+bool ExprJIT::function(Function4Ptr &func) const
+{
+    return d->function(func, 4);
+}
+
+ExprJIT::CacheStatistics ExprJIT::cacheStatistics()
+{
+    return ProgramCache::instance().statistics();
+}
+
+void ExprJIT::setCacheCapacity(size_t capacity)
+{
+    ProgramCache::instance().setCapacity(capacity);
+}
+
+void ExprJIT::setCacheDirectory(const std::string &directory)
+{
+    ProgramCache::instance().setDirectory(directory);
+}
+
+void ExprJIT::clearCache()
+{
+    ProgramCache::instance().clear();
+}
+
+ExprJIT::Real ExprJIT::evalBatch(ThreadPool &pool, const Real* const* columns, Real *out, size_t n,
+                                 Reduction reduction) const
+{
+    return d->evalBatch(*pool.d, columns, out, n, reduction);
+}
+
 ExprJIT::SymbolReference ExprJIT::operator[](const std::string &name)
 {
     return SymbolReference(*this, name);
 }
 
+ExprJIT::VarHandle ExprJIT::variable(const std::string &name)
+{
+    auto *ptr = d->symbols.defineVar(name);
+    auto *version = d->symbols.varVersion(ptr);
+    assert(version != nullptr);
+    return VarHandle(ptr, version);
+}
+
+void ExprJIT::setConstant(const std::string &name, const ExprJIT::Real value)
+{
+    d->symbols.setConst(name, value);
+}
+
+void ExprJIT::setPure(const std::string &name, bool pure)
+{
+    d->symbols.setPure(name, pure);
+}
+
+void ExprJIT::specialize(const std::string &name, bool enabled)
+{
+    d->symbols.setSpecialized(name, enabled);
+}
+
+void ExprJIT::memoize(bool enabled)
+{
+    d->memoize = enabled;
+}
+
 void ExprJIT::setSymbol(const std::string &name, const ExprJIT::Real value)
 {
     d->symbols.setVar(name, value);
@@ -919,3 +5412,8 @@ void ExprJIT::setSymbol(const std::string &name, Function3Ptr func)
 {
     d->symbols.setFunc(name, func);
 }
+
+void ExprJITDetail::setVectorWidth(ExprJIT &expr, int bits)
+{
+    expr.d->vectorWidth = bits;
+}
@@ -0,0 +1,24 @@
+#ifndef EXPRJIT_DETAIL_H
+#define EXPRJIT_DETAIL_H
+
+#include "exprjit.h"
+
+/**
+ * @brief Internal settings of the expressions, not part of the API.
+ */
+struct ExprJITDetail final
+{
+    /**
+     * @brief Narrow the vector registers of the batch kernels.
+     *
+     * Lets the narrower kernels be tested on the CPUs supporting the
+     * wider ones. Takes effect on the next compileBatch() of the
+     * expression; the registers are never wider than the detected ones.
+     *
+     * @param expr Expression.
+     * @param bits 512, 256, or 0 for the scalar code only.
+     */
+    static void setVectorWidth(ExprJIT &expr, int bits);
+};
+
+#endif // EXPRJIT_DETAIL_H
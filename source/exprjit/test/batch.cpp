@@ -0,0 +1,304 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+#include "exprjit_detail.h"
+
+// Vector widths the batch kernels are tested with: the detected one,
+// 256 bits on the AVX-512 CPUs, and the scalar code alone.
+static const int VECTOR_WIDTHS[] = { 512, 256, 0 };
+
+//----------------------------------------------------------
+
+TEST_CASE("Test batch evaluation")
+{
+    for (int width : VECTOR_WIDTHS) {
+        INFO("Vector width: " << width);
+
+        ExprJIT expr;
+        ExprJITDetail::setVectorWidth(expr, width);
+
+        const size_t n = 1000;
+        std::vector<double> x(n);
+        std::vector<double> y(n);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = 0.01 * i;
+            y[i] = 1.0 + i;
+        }
+
+        const double* columns[] = { x.data(), y.data() };
+        std::vector<double> out(n);
+
+        REQUIRE(expr.compileBatch("x*x + y", { "x", "y" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(x[i]*x[i] + y[i]));
+        }
+
+        REQUIRE(expr.compileBatch("sin(x)/y - 2*y", { "x", "y" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(sin(x[i])/y[i] - 2*y[i]));
+        }
+    }
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test batch evaluation with scalar variables")
+{
+    for (int width : VECTOR_WIDTHS) {
+        INFO("Vector width: " << width);
+
+        ExprJIT expr;
+        ExprJITDetail::setVectorWidth(expr, width);
+        expr["a"] = 2.0;
+        expr["x"] = 100.0;
+
+        const size_t n = 16;
+        std::vector<double> x(n);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = static_cast<double>(i);
+        }
+
+        const double* columns[] = { x.data() };
+        std::vector<double> out(n);
+
+        // Column binding takes precedence over the variable.
+        REQUIRE(expr.compileBatch("a*x + 1", { "x" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(2.0*x[i] + 1.0));
+        }
+
+        // Variables are read on every evaluation.
+        expr["a"] = 3.0;
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(3.0*x[i] + 1.0));
+        }
+
+        REQUIRE(expr.compileBatch("a + 1", {}));
+        expr.evalBatch(nullptr, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(4.0));
+        }
+    }
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test batch evaluation edge cases")
+{
+    for (int width : VECTOR_WIDTHS) {
+        INFO("Vector width: " << width);
+
+        ExprJIT expr;
+        ExprJITDetail::setVectorWidth(expr, width);
+
+        std::vector<double> x = { 1.0, 2.0, 3.0 };
+        const double* columns[] = { x.data() };
+        std::vector<double> out = { -1.0, -1.0, -1.0 };
+
+        REQUIRE(expr.compileBatch("x + 1", { "x" }));
+
+        // Empty batch must not touch the output.
+        expr.evalBatch(columns, out.data(), 0);
+        REQUIRE(out[0] == Approx(-1.0));
+
+        expr.evalBatch(columns, out.data(), 1);
+        REQUIRE(out[0] == Approx(2.0));
+        REQUIRE(out[1] == Approx(-1.0));
+
+        REQUIRE_FALSE(expr.compileBatch("x + z", { "x" }));
+        REQUIRE_FALSE(expr.error().empty());
+        expr.evalBatch(columns, out.data(), 3);
+        REQUIRE(out[0] == Approx(0.0));
+        REQUIRE(out[2] == Approx(0.0));
+    }
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test batch evaluation of many columns")
+{
+    for (int width : VECTOR_WIDTHS) {
+        INFO("Vector width: " << width);
+
+        // Rows left over by the vector kernel, for up to 40 columns.
+        const size_t n = 21;
+        for (size_t count : { 2, 32, 40 }) {
+            std::vector<std::vector<double>> data(count, std::vector<double>(n));
+            std::vector<const double*> columns;
+            std::vector<std::string> names;
+            std::string sum = "0";
+            for (size_t i = 0; i < count; i++) {
+                for (size_t row = 0; row < n; row++) {
+                    data[i][row] = double(i*row);
+                }
+                columns.push_back(data[i].data());
+                names.push_back("c" + std::to_string(i));
+                sum += " + " + names.back();
+            }
+
+            ExprJIT expr;
+            ExprJITDetail::setVectorWidth(expr, width);
+            REQUIRE(expr.compileBatch(sum, names));
+            std::vector<double> out(n, -1.0);
+            expr.evalBatch(columns.data(), out.data(), n);
+            for (size_t row = 0; row < n; row++) {
+                REQUIRE(out[row] == Approx(double(row*count*(count - 1)/2)));
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test vectorized batch evaluation")
+{
+    for (int width : VECTOR_WIDTHS) {
+        INFO("Vector width: " << width);
+
+        ExprJIT expr;
+        ExprJITDetail::setVectorWidth(expr, width);
+        expr["a"] = 0.5;
+
+        const size_t n = 37;
+        std::vector<double> x(n);
+        std::vector<double> y(n);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = 0.1 * i - 1.0;
+            y[i] = 2.0 + i;
+        }
+
+        const double* columns[] = { x.data(), y.data() };
+        std::vector<double> out(n);
+
+        REQUIRE(expr.compileBatch("a*x/y - sqrt(y) + min(x, a) * max(y, 3) - 2", { "x", "y" }));
+
+        // Batch sizes around the vector lanes count exercise the tail rows.
+        for (size_t rows = 1; rows <= n; rows++) {
+            std::fill(out.begin(), out.end(), -1.0);
+            expr.evalBatch(columns, out.data(), rows);
+            for (size_t i = 0; i < rows; i++) {
+                const double m = x[i] < 0.5 ? x[i] : 0.5;
+                const double M = y[i] > 3.0 ? y[i] : 3.0;
+                REQUIRE(out[i] == Approx(0.5*x[i]/y[i] - sqrt(y[i]) + m*M - 2.0));
+            }
+            for (size_t i = rows; i < n; i++) {
+                REQUIRE(out[i] == -1.0);
+            }
+        }
+
+        // Functions without a vector form are evaluated by the scalar code.
+        REQUIRE(expr.compileBatch("cos(x) + y", { "x", "y" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(cos(x[i]) + y[i]));
+        }
+
+        // Inlined builtins have the vector forms as well.
+        REQUIRE(expr.compileBatch("round(x) + floor(x) - ceil(x) + abs(x) * clamp(y, 4, 20)", { "x", "y" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            const double c = y[i] < 4.0 ? 4.0 : (y[i] > 20.0 ? 20.0 : y[i]);
+            REQUIRE(out[i] == round(x[i]) + floor(x[i]) - ceil(x[i]) + fabs(x[i]) * c);
+        }
+
+        // Constant exponents are reduced to vector operations.
+        REQUIRE(expr.compileBatch("x^3 - 2*y^-2 + y^0.5", { "x", "y" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(x[i]*x[i]*x[i] - 2.0/(y[i]*y[i]) + sqrt(y[i])));
+        }
+
+        // Selects are made of masks in the vector code.
+        REQUIRE(expr.compileBatch("x < 0 ? -x : (x >= a && y != 5 ? y : x*y) + (a > 0.2 ? 1 : 2)", { "x", "y" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            const double v = x[i] < 0 ? -x[i] : ((x[i] >= 0.5 && y[i] != 5) ? y[i] : x[i]*y[i]) + 1;
+            REQUIRE(out[i] == v);
+        }
+
+        // Shared subexpressions are evaluated once per row.
+        REQUIRE(expr.compileBatch("(x*y + a)*(x*y + a) - abs(y*x + a)/(a + x*y)", { "x", "y" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            const double s = x[i]*y[i] + 0.5;
+            REQUIRE(out[i] == Approx(s*s - fabs(s)/s));
+        }
+
+        // Expression not depending on the columns.
+        REQUIRE(expr.compileBatch("a*a + 1", { "x" }));
+        expr.evalBatch(columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == Approx(1.25));
+        }
+    }
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test parallel batch evaluation")
+{
+    for (int width : VECTOR_WIDTHS) {
+        INFO("Vector width: " << width);
+
+        ExprJIT::ThreadPool pool(4);
+        REQUIRE(pool.size() == 4);
+
+        ExprJIT expr;
+        ExprJITDetail::setVectorWidth(expr, width);
+        expr["a"] = 0.5;
+
+        // Several chunks, the last one being incomplete.
+        const size_t n = 100003;
+        std::vector<double> x(n);
+        std::vector<double> y(n);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = 1e-4 * i - 3.0;
+            y[i] = 1.0 + (i % 17);
+        }
+
+        const double* columns[] = { x.data(), y.data() };
+        std::vector<double> out(n, -1.0);
+        std::vector<double> expected(n);
+
+        REQUIRE(expr.compileBatch("a*x/y + cos(x)", { "x", "y" }));
+        expr.evalBatch(columns, expected.data(), n);
+
+        REQUIRE(expr.evalBatch(pool, columns, out.data(), n) == 0.0);
+        REQUIRE(out == expected);
+
+        double sum = 0.0;
+        double min = expected[0];
+        double max = expected[0];
+        for (auto v : expected) {
+            sum += v;
+            min = std::min(min, v);
+            max = std::max(max, v);
+        }
+
+        const double s = expr.evalBatch(pool, columns, out.data(), n, ExprJIT::Reduction::Sum);
+        REQUIRE(s == Approx(sum));
+        REQUIRE(expr.evalBatch(pool, columns, nullptr, n, ExprJIT::Reduction::Min) == min);
+        REQUIRE(expr.evalBatch(pool, columns, nullptr, n, ExprJIT::Reduction::Max) == max);
+
+        // Reductions do not depend on the threads count.
+        ExprJIT::ThreadPool single(1);
+        REQUIRE(expr.evalBatch(single, columns, nullptr, n, ExprJIT::Reduction::Sum) == s);
+
+        // Pool is reusable by other expressions.
+        ExprJIT other;
+        ExprJITDetail::setVectorWidth(other, width);
+        REQUIRE(other.compileBatch("x + y", { "x", "y" }));
+        other.evalBatch(pool, columns, out.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(out[i] == x[i] + y[i]);
+        }
+
+        REQUIRE(other.evalBatch(pool, columns, out.data(), 0, ExprJIT::Reduction::Sum) == 0.0);
+    }
+}
@@ -1,4 +1,5 @@
 #include <cmath>
+#include <vector>
 #include "catch.hpp"
 #include "exprjit.h"
 
@@ -86,6 +87,15 @@ TEST_CASE("Benchmarking series")
         r = expr();
     }
     REQUIRE(r == Approx(series(x, y)));
+
+    REQUIRE(expr.compileFunction("(x, y) -> x/y + x*x/y/y + x*x*x/y/y/y + x*x*x*x/y*y*y*y"));
+    ExprJIT::Function2Ptr f = nullptr;
+    REQUIRE(expr.function(f));
+
+    BENCHMARK("JIT-compiled function") {
+        r = f(x, y);
+    }
+    REQUIRE(r == Approx(series(x, y)));
 }
 
 //----------------------------------------------------------
@@ -108,3 +118,51 @@ TEST_CASE("Benchmarking constexpr optimization")
     }
     REQUIRE(r == Approx(constval(x)));
 }
+
+//----------------------------------------------------------
+
+TEST_CASE("Benchmarking batch series")
+{
+    const size_t n = 100000;
+    std::vector<double> x(n);
+    std::vector<double> y(n);
+    std::vector<double> out(n);
+    for (size_t i = 0; i < n; i++) {
+        x[i] = 0.5 + 1e-6 * i;
+        y[i] = 0.2 + 1e-6 * i;
+    }
+    const double* columns[] = { x.data(), y.data() };
+
+    ExprJIT expr;
+    expr["x"] = 0.0;
+    expr["y"] = 0.0;
+    REQUIRE(expr("x/y + x*x/y/y + x*x*x/y/y/y + x*x*x*x/y*y*y*y"));
+
+    ExprJIT batch;
+    REQUIRE(batch.compileBatch("x/y + x*x/y/y + x*x*x/y/y/y + x*x*x*x/y*y*y*y", { "x", "y" }));
+
+    BENCHMARK("Native") {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = series(x[i], y[i]);
+        }
+    }
+
+    BENCHMARK("JIT-compiled") {
+        for (size_t i = 0; i < n; i++) {
+            expr["x"] = x[i];
+            expr["y"] = y[i];
+            out[i] = expr();
+        }
+    }
+
+    BENCHMARK("JIT-compiled batch") {
+        batch.evalBatch(columns, out.data(), n);
+    }
+    REQUIRE(out[n - 1] == Approx(series(x[n - 1], y[n - 1])));
+
+    ExprJIT::ThreadPool pool;
+    BENCHMARK("JIT-compiled parallel batch") {
+        batch.evalBatch(pool, columns, out.data(), n);
+    }
+    REQUIRE(out[n - 1] == Approx(series(x[n - 1], y[n - 1])));
+}
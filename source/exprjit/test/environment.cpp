@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+
+
+TEST_CASE("Test shared environment")
+{
+    ExprJIT::Environment env;
+    env.set("x", 2.0);
+    env.set("y", 0.0);
+
+    ExprJIT a(env);
+    ExprJIT b(env);
+    ExprJIT c;
+    c["x"] = 10.0;
+
+    REQUIRE(a("x*x"));
+    REQUIRE(b("x + y"));
+    REQUIRE(c("x"));
+    REQUIRE(a() == Approx(4.0));
+    REQUIRE(b() == Approx(2.0));
+    REQUIRE(c() == Approx(10.0));
+
+    // One store is seen by all the objects of the environment.
+    env.set("x", 3.0);
+    REQUIRE(a() == Approx(9.0));
+    REQUIRE(b() == Approx(3.0));
+    REQUIRE(c() == Approx(10.0));
+
+    auto x = env.variable("x");
+    x = 4.0;
+    REQUIRE(a() == Approx(16.0));
+    a["y"] = 1.0;
+    REQUIRE(b() == Approx(5.0));
+
+    // Functions are not shared.
+    a["f"] = std::sin;
+    REQUIRE(a("f(x)"));
+    REQUIRE_FALSE(b("f(x)"));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test environment of many variables")
+{
+    std::unique_ptr<ExprJIT> expr;
+    std::vector<ExprJIT::VarHandle> handles;
+    std::string sum = "0";
+    {
+        ExprJIT::Environment env;
+        for (int i = 0; i < 200; i++) {
+            const std::string name = "v" + std::to_string(i);
+            handles.push_back(env.variable(name));
+            handles.back() = i;
+            sum += " + " + name;
+        }
+        expr = std::make_unique<ExprJIT>(env);
+    }
+
+    // Variables remain valid after the environment destruction.
+    REQUIRE(expr->compile(sum));
+    REQUIRE(expr->eval() == Approx(199.0*200.0/2.0));
+
+    for (auto &h : handles) {
+        h = 1.0;
+    }
+    REQUIRE(expr->eval() == Approx(200.0));
+    REQUIRE(expr->dependencies().size() == 200);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test environment filling whole chunks")
+{
+    // Number of the variables is a multiple of the storage chunk size.
+    ExprJIT::Environment env;
+    for (int i = 0; i < 128; i++) {
+        env.set("v" + std::to_string(i), i);
+    }
+
+    ExprJIT expr(env);
+    expr.specialize("v64");
+    REQUIRE(expr("sin(v0)*v127 + v127 + v64"));
+    REQUIRE(expr() == Approx(127.0 + 64.0));
+
+    env.set("v0", 1.0);
+    REQUIRE(expr() == Approx(std::sin(1.0)*127.0 + 127.0 + 64.0));
+    env.variable("v127") = 2.0;
+    env.variable("v64") = 3.0;
+    REQUIRE(expr() == Approx(std::sin(1.0)*2.0 + 2.0 + 3.0));
+
+    auto deps = expr.dependencies();
+    std::sort(deps.begin(), deps.end());
+    REQUIRE(deps == std::vector<std::string>({ "v0", "v127", "v64" }));
+}
@@ -0,0 +1,169 @@
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+
+
+TEST_CASE("Test function compilation")
+{
+    ExprJIT expr;
+
+    REQUIRE(expr.compileFunction("(x, y) -> x*y + 1"));
+
+    ExprJIT::Function2Ptr f2 = nullptr;
+    REQUIRE(expr.function(f2));
+    REQUIRE(f2(2.0, 3.0) == Approx(7.0));
+    REQUIRE(f2(-1.5, 4.0) == Approx(-5.0));
+
+    // Arity must match.
+    ExprJIT::Function1Ptr f1 = nullptr;
+    REQUIRE_FALSE(expr.function(f1));
+    REQUIRE(f1 == nullptr);
+
+    REQUIRE(expr.compileFunction("() -> 2*3"));
+    ExprJIT::Function0Ptr f0 = nullptr;
+    REQUIRE(expr.function(f0));
+    REQUIRE(f0() == Approx(6.0));
+
+    REQUIRE(expr.compileFunction("(t) -> sin(t)^2 + cos(t)^2"));
+    REQUIRE(expr.function(f1));
+    REQUIRE(f1(0.7) == Approx(1.0));
+
+    REQUIRE(expr.compileFunction("(a, b, c) -> a*b - c/a"));
+    ExprJIT::Function3Ptr f3 = nullptr;
+    REQUIRE(expr.function(f3));
+    REQUIRE(f3(2.0, 3.0, 4.0) == Approx(4.0));
+
+    // Parameters order is the parameters list one.
+    REQUIRE(expr.compileFunction("(w, z, y, x) -> ((x*10 + y)*10 + z)*10 + w"));
+    ExprJIT::Function4Ptr f4 = nullptr;
+    REQUIRE(expr.function(f4));
+    REQUIRE(f4(1.0, 2.0, 3.0, 4.0) == Approx(4321.0));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test function parameters and variables")
+{
+    ExprJIT expr;
+    expr["x"] = 100.0;
+    expr["a"] = 2.0;
+
+    // Parameters take precedence over the variables.
+    REQUIRE(expr.compileFunction("(x) -> a*x + 1"));
+    ExprJIT::Function1Ptr f = nullptr;
+    REQUIRE(expr.function(f));
+    REQUIRE(f(3.0) == Approx(7.0));
+
+    // Variables are read on every call.
+    expr["a"] = 3.0;
+    REQUIRE(f(3.0) == Approx(10.0));
+
+    // Conditions on the parameters.
+    REQUIRE(expr.compileFunction("(x) -> x < 0 ? -x : x*a"));
+    REQUIRE(expr.function(f));
+    REQUIRE(f(-2.0) == Approx(2.0));
+    REQUIRE(f(2.0) == Approx(6.0));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test function parse errors")
+{
+    ExprJIT expr;
+
+    REQUIRE_FALSE(expr.compileFunction("x -> x"));
+    REQUIRE_FALSE(expr.error().empty());
+    REQUIRE_FALSE(expr.compileFunction("(x) x"));
+    REQUIRE_FALSE(expr.compileFunction("(x y) -> x"));
+    REQUIRE_FALSE(expr.compileFunction("(x, 1) -> x"));
+    REQUIRE_FALSE(expr.compileFunction("(x, x) -> x"));
+    REQUIRE_FALSE(expr.compileFunction("(a, b, c, d, e) -> a"));
+    REQUIRE_FALSE(expr.compileFunction("(x) -> y"));
+
+    // No function after a failed compilation.
+    ExprJIT::Function1Ptr f = nullptr;
+    REQUIRE_FALSE(expr.function(f));
+    REQUIRE(f == nullptr);
+}
+
+//----------------------------------------------------------
+
+#ifdef __linux__
+
+/// Number of the process memory mappings and the permissions of the one containing the address.
+static size_t memoryMappings(const void *address, std::string &permissions)
+{
+    const auto a = reinterpret_cast<uintptr_t>(address);
+    std::ifstream maps("/proc/self/maps");
+    size_t count = 0;
+    std::string line;
+    while (std::getline(maps, line)) {
+        std::istringstream in(line);
+        uintptr_t begin = 0;
+        uintptr_t end = 0;
+        char dash = 0;
+        std::string perms;
+        in >> std::hex >> begin >> dash >> end >> perms;
+        if (a >= begin && a < end) {
+            permissions = perms;
+        }
+        count++;
+    }
+    return count;
+}
+
+#endif
+
+TEST_CASE("Test many compiled functions")
+{
+    const size_t n = 2000;
+    std::list<ExprJIT> expressions;
+    std::vector<ExprJIT::Function1Ptr> functions;
+
+    auto compile = [&](size_t i) {
+        expressions.emplace_back();
+        REQUIRE(expressions.back().compileFunction("(x) -> x*2 + " + std::to_string(i)));
+        ExprJIT::Function1Ptr f = nullptr;
+        REQUIRE(expressions.back().function(f));
+        return f;
+    };
+
+#ifdef __linux__
+    std::string permissions;
+    const size_t mappings = memoryMappings(nullptr, permissions);
+#endif
+
+    for (size_t i = 0; i < n; i++) {
+        functions.push_back(compile(i));
+    }
+
+#ifdef __linux__
+    // Functions share the pages, which are never writable and executable.
+    REQUIRE(memoryMappings(nullptr, permissions) < mappings + 100);
+    for (auto f : functions) {
+        memoryMappings(reinterpret_cast<const void*>(f), permissions);
+        REQUIRE(permissions.substr(0, 3) == "r-x");
+    }
+#endif
+
+    // Memory of the dropped functions is reused.
+    auto it = expressions.begin();
+    for (size_t i = 0; i < n; i++) {
+        if (i % 2 == 0) {
+            it = expressions.erase(it);
+            functions[i] = compile(i);
+        } else {
+            ++it;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        REQUIRE(functions[i](1.5) == Approx(3.0 + i));
+    }
+}
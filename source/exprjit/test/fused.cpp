@@ -0,0 +1,88 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+
+
+static int countedCalls = 0;
+
+static double counted(double x)
+{
+    countedCalls++;
+    return x*x;
+}
+
+TEST_CASE("Test fused evaluation")
+{
+    ExprJIT expr;
+    expr["x"] = 2.0;
+    expr["y"] = 3.0;
+    expr["f"] = counted;
+    expr.setPure("f");
+
+    REQUIRE(expr.compileFused({ "f(x*y) + 1", "f(y*x)/y", "x - y", "7", "x" }));
+
+    std::vector<double> out(6, -1.0);
+    countedCalls = 0;
+    expr.evalFused(out.data());
+    REQUIRE(out[0] == Approx(37.0));
+    REQUIRE(out[1] == Approx(12.0));
+    REQUIRE(out[2] == Approx(-1.0));
+    REQUIRE(out[3] == 7.0);
+    REQUIRE(out[4] == 2.0);
+    REQUIRE(out[5] == -1.0);
+
+    // Subexpressions shared by the expressions are evaluated once.
+    REQUIRE(countedCalls == 1);
+
+    // Variables are read on every evaluation.
+    expr["x"] = 1.0;
+    expr.evalFused(out.data());
+    REQUIRE(out[0] == Approx(10.0));
+    REQUIRE(out[1] == Approx(3.0));
+    REQUIRE(out[4] == 1.0);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test fused compilation errors")
+{
+    ExprJIT expr;
+    expr["x"] = 1.0;
+
+    REQUIRE_FALSE(expr.compileFused({ "x + 1", "x + y" }));
+    REQUIRE(expr.error().find("Expression 1") == 0);
+
+    // Nothing is evaluated after a failure.
+    std::vector<double> out(2, -1.0);
+    expr.evalFused(out.data());
+    REQUIRE(out[0] == -1.0);
+
+    REQUIRE(expr.compileFused({}));
+    REQUIRE(expr.error().empty());
+    expr.evalFused(out.data());
+    REQUIRE(out[0] == -1.0);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test many fused expressions")
+{
+    ExprJIT expr;
+    expr["a"] = 0.5;
+    expr["b"] = 2.0;
+
+    const size_t n = 1000;
+    std::vector<std::string> expressions;
+    for (size_t i = 0; i < n; i++) {
+        expressions.push_back("sin(a*b) + b/" + std::to_string(i + 1));
+    }
+    REQUIRE(expr.compileFused(expressions));
+
+    std::vector<double> out(n);
+    expr.evalFused(out.data());
+    for (size_t i = 0; i < n; i++) {
+        REQUIRE(out[i] == Approx(sin(1.0) + 2.0/(i + 1)));
+    }
+}
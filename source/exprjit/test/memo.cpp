@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+
+
+static int slowCalls = 0;
+
+static double slow(double x)
+{
+    slowCalls++;
+    return std::sin(x);
+}
+
+TEST_CASE("Test memoized subexpressions")
+{
+    ExprJIT expr;
+    expr["a"] = 0.5;
+    expr["t"] = 1.0;
+    expr["f"] = slow;
+    expr.setPure("f");
+    expr.memoize();
+
+    REQUIRE(expr("f(a*2) + t*f(a) + t"));
+
+    slowCalls = 0;
+    REQUIRE(expr() == Approx(std::sin(1.0) + std::sin(0.5) + 1.0));
+    REQUIRE(slowCalls == 2);
+
+    // Subexpressions of the unchanged variables are not evaluated again.
+    expr["t"] = 2.0;
+    REQUIRE(expr() == Approx(std::sin(1.0) + 2.0*std::sin(0.5) + 2.0));
+    REQUIRE(slowCalls == 2);
+
+    expr["a"] = 0.25;
+    REQUIRE(expr() == Approx(std::sin(0.5) + 2.0*std::sin(0.25) + 2.0));
+    REQUIRE(slowCalls == 4);
+
+    // Setting a variable to the same value evaluates them again.
+    expr["a"] = 0.25;
+    REQUIRE(expr() == Approx(std::sin(0.5) + 2.0*std::sin(0.25) + 2.0));
+    REQUIRE(slowCalls == 6);
+
+    // Recompiled expression does not reuse the previous values.
+    REQUIRE(expr("f(a*2) - t"));
+    REQUIRE(expr() == Approx(std::sin(0.5) - 2.0));
+    REQUIRE(slowCalls == 7);
+
+    // Nested subexpressions are checked by their enclosing ones.
+    expr["b"] = 1.0;
+    REQUIRE(expr("f(b + f(a)) * t + f(a) + t"));
+    slowCalls = 0;
+    REQUIRE(expr() == Approx(std::sin(1.0 + std::sin(0.25))*2.0 + std::sin(0.25) + 2.0));
+    REQUIRE(slowCalls == 2);
+    expr["b"] = 2.0;
+    REQUIRE(expr() == Approx(std::sin(2.0 + std::sin(0.25))*2.0 + std::sin(0.25) + 2.0));
+    REQUIRE(slowCalls == 3);
+    expr["a"] = 0.5;
+    REQUIRE(expr() == Approx(std::sin(2.0 + std::sin(0.5))*2.0 + std::sin(0.5) + 2.0));
+    REQUIRE(slowCalls == 5);
+    expr["t"] = 1.0;
+    REQUIRE(expr() == Approx(std::sin(2.0 + std::sin(0.5)) + std::sin(0.5) + 1.0));
+    REQUIRE(slowCalls == 5);
+
+    // Memoization off takes effect on the next compilation.
+    expr.memoize(false);
+    REQUIRE(expr("f(a) + t"));
+    slowCalls = 0;
+    expr();
+    expr();
+    REQUIRE(slowCalls == 2);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test concurrent evaluation")
+{
+    ExprJIT expr;
+    expr["a"] = 0.5;
+    expr["t"] = 2.0;
+
+    // eval() can be called by several threads at once, as long as
+    // the variables are not changed meanwhile. The expressions are
+    // not memoized by default.
+    REQUIRE(expr("sin(a)*t + cos(a*t)"));
+    const double expected = expr();
+    REQUIRE(expected == Approx(std::sin(0.5)*2.0 + std::cos(1.0)));
+
+    for (int round = 0; round < 4; round++) {
+        expr["a"] = 0.5;
+        std::vector<int> mismatches(4, 0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < mismatches.size(); i++) {
+            threads.emplace_back([&expr, &mismatches, expected, i]() {
+                for (int n = 0; n < 10000; n++) {
+                    if (expr() != expected) {
+                        mismatches[i]++;
+                    }
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        REQUIRE(mismatches == std::vector<int>(4, 0));
+    }
+}
+
+//----------------------------------------------------------
+
+static int ticks = 0;
+
+static double tick(double x)
+{
+    return x + ++ticks;
+}
+
+TEST_CASE("Test functions not marked as pure")
+{
+    ExprJIT expr;
+    expr["a"] = 0.5;
+    expr["t"] = 1.0;
+    expr["f"] = slow;
+    expr["g"] = tick;
+    expr.memoize();
+
+    // User functions are called on every evaluation by default.
+    REQUIRE(expr("f(a) + t"));
+    slowCalls = 0;
+    expr();
+    expr();
+    REQUIRE(slowCalls == 2);
+
+    // So are the subexpressions calling them along with the pure ones.
+    ticks = 0;
+    REQUIRE(expr("g(sin(a)) + t"));
+    REQUIRE(expr() == Approx(std::sin(0.5) + 1.0 + 1.0));
+    REQUIRE(expr() == Approx(std::sin(0.5) + 2.0 + 1.0));
+
+    // Marked functions are memoized from the next compilation on.
+    expr.setPure("f");
+    REQUIRE(expr("f(a) + t"));
+    slowCalls = 0;
+    expr();
+    expr();
+    REQUIRE(slowCalls == 1);
+
+    expr.setPure("f", false);
+    REQUIRE(expr("f(a) + t"));
+    expr();
+    REQUIRE(slowCalls == 2);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test expression dependencies")
+{
+    ExprJIT expr;
+    expr["x"] = 1.0;
+    expr["y"] = 2.0;
+    expr["z"] = 3.0;
+
+    REQUIRE(expr("x*y + sin(x)"));
+    auto deps = expr.dependencies();
+    std::sort(deps.begin(), deps.end());
+    REQUIRE(deps == std::vector<std::string>({ "x", "y" }));
+
+    REQUIRE(expr("2 + 3"));
+    REQUIRE(expr.dependencies().empty());
+
+    REQUIRE_FALSE(expr("z + w"));
+    REQUIRE(expr.dependencies().empty());
+}
@@ -0,0 +1,79 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+
+
+TEST_CASE("Test module evaluation")
+{
+    ExprJIT expr;
+    expr["x"] = 2.0;
+    expr["y"] = 3.0;
+    expr["z"] = 4.0;
+
+    auto module = expr.compileModule({ "x*y + 1", "sin(y) - x", "y/x", "abs(-2)" });
+    REQUIRE(module != nullptr);
+    REQUIRE(module->size() == 4);
+    REQUIRE(module->variables() == std::vector<std::string>({ "x", "y" }));
+    REQUIRE(module->frame() == std::vector<double>({ 2.0, 3.0 }));
+
+    std::vector<double> frame = module->frame();
+    REQUIRE(module->eval(0, frame.data()) == Approx(7.0));
+    REQUIRE(module->eval(3, frame.data()) == Approx(2.0));
+
+    // Module does not depend on the compiler variables.
+    expr["x"] = 10.0;
+    frame[1] = 5.0;
+    std::vector<double> out(4);
+    module->evalAll(frame.data(), out.data());
+    REQUIRE(out[0] == Approx(11.0));
+    REQUIRE(out[1] == Approx(sin(5.0) - 2.0));
+    REQUIRE(out[2] == Approx(2.5));
+    REQUIRE(out[3] == Approx(2.0));
+
+    std::vector<double> subset(3);
+    module->eval({ 2, 0, 2 }, frame.data(), subset.data());
+    REQUIRE(subset == std::vector<double>({ out[2], out[0], out[2] }));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test module compilation errors")
+{
+    ExprJIT expr;
+    expr["x"] = 1.0;
+
+    REQUIRE(expr.compileModule({ "x + 1", "x + y" }) == nullptr);
+    REQUIRE(expr.error().find("Expression 1") == 0);
+
+    auto module = expr.compileModule({});
+    REQUIRE(module != nullptr);
+    REQUIRE(module->size() == 0);
+    module->evalAll(nullptr, nullptr);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test large module")
+{
+    ExprJIT expr;
+    expr["a"] = 0.5;
+    expr["b"] = 2.0;
+
+    const size_t n = 5000;
+    std::vector<std::string> expressions;
+    for (size_t i = 0; i < n; i++) {
+        expressions.push_back("a*" + std::to_string(i) + " + cos(b)/" + std::to_string(i + 1));
+    }
+
+    auto module = expr.compileModule(expressions);
+    REQUIRE(module != nullptr);
+    REQUIRE(module->size() == n);
+
+    std::vector<double> out(n);
+    module->evalAll(module->frame().data(), out.data());
+    for (size_t i = 0; i < n; i++) {
+        REQUIRE(out[i] == Approx(0.5*i + cos(2.0)/(i + 1)));
+    }
+}
@@ -1,4 +1,5 @@
 #include <cmath>
+#include <string>
 #include "catch.hpp"
 #include "exprjit.h"
 
@@ -18,6 +19,10 @@ TEST_CASE("Test basic expressions")
 
     REQUIRE(expr("8/2*0.5*1e-1"));
     REQUIRE(expr() == Approx(0.2));
+
+    // Leading zeros of the fractional part.
+    REQUIRE(expr("2.05 + 0.003"));
+    REQUIRE(expr() == Approx(2.053));
 }
 
 //----------------------------------------------------------
@@ -44,6 +49,36 @@ TEST_CASE("Test external variables")
 
 //----------------------------------------------------------
 
+TEST_CASE("Test variable handles")
+{
+    ExprJIT expr;
+    expr["x"] = 1.0;
+
+    auto x = expr.variable("x");
+    auto y = expr.variable("y");
+    REQUIRE(x.value() == 1.0);
+    REQUIRE(y.value() == 0.0);
+
+    // Handles remain valid as the other variables are defined.
+    for (int i = 0; i < 100; i++) {
+        expr["v" + std::to_string(i)] = i;
+    }
+
+    REQUIRE(expr("x*y + sin(y)"));
+    x = 3.0;
+    y = 2.0;
+    REQUIRE(expr() == Approx(6.0 + std::sin(2.0)));
+
+    // Handle and operator[] refer to the same variable.
+    expr["y"] = 0.5;
+    REQUIRE(y == 0.5);
+    REQUIRE(expr() == Approx(1.5 + std::sin(0.5)));
+    y = 4.0;
+    REQUIRE(expr() == Approx(12.0 + std::sin(4.0)));
+}
+
+//----------------------------------------------------------
+
 TEST_CASE("Test standard functions")
 {
     ExprJIT expr;
@@ -58,6 +93,28 @@ TEST_CASE("Test standard functions")
     REQUIRE(expr() == Approx(1.0));
 
     REQUIRE_FALSE(expr("undefined(0.0)"));
+
+    // All the standard functions are found by their names.
+    expr["x"] = 0.5;
+    REQUIRE(expr("abs(x) + acos(x) + acosh(x + 1) + asin(x) + asinh(x) + atan(x) + atanh(x) + "
+                 "ceil(x) + cos(x) + cosh(x) + exp(x) + exp2(x) + floor(x) + log(x) + log10(x) + "
+                 "log2(x) + round(x) + sin(x) + sinh(x) + sqrt(x) + tan(x) + tanh(x) + "
+                 "atan2(x, 2) + hypot(x, 2) + max(x, 2) + min(x, 2) + mod(x, 2) + pow(x, 2) + "
+                 "clamp(x, 0, 1)"));
+    REQUIRE(expr() == Approx(0.5 + std::acos(0.5) + std::acosh(1.5) + std::asin(0.5) + std::asinh(0.5) +
+                             std::atan(0.5) + std::atanh(0.5) + 1.0 + std::cos(0.5) + std::cosh(0.5) +
+                             std::exp(0.5) + std::exp2(0.5) + 0.0 + std::log(0.5) + std::log10(0.5) +
+                             std::log2(0.5) + std::round(0.5) + std::sin(0.5) + std::sinh(0.5) +
+                             std::sqrt(0.5) + std::tan(0.5) + std::tanh(0.5) +
+                             std::atan2(0.5, 2.0) + std::hypot(0.5, 2.0) + 2.0 + 0.5 + 0.5 + 0.25 + 0.5));
+
+    // Standard functions can be redefined by one object only.
+    ExprJIT other;
+    expr["sin"] = std::cos;
+    REQUIRE(expr("sin(0.0)"));
+    REQUIRE(expr() == Approx(1.0));
+    REQUIRE(other("sin(0.0)"));
+    REQUIRE(other() == Approx(0.0));
 }
 
 //----------------------------------------------------------
@@ -168,3 +225,484 @@ TEST_CASE("Test multiple divisions")
     REQUIRE(expr("16/x/x/x/x"));
     REQUIRE(expr() == Approx(1.0));
 }
+
+//----------------------------------------------------------
+
+TEST_CASE("Test division")
+{
+    ExprJIT expr;
+    expr["x"] = 0.7;
+    expr["y"] = 0.3;
+    expr["z"] = 1.9;
+
+    // Divisions are evaluated left to right, as in C++.
+    REQUIRE(expr("x/y/z"));
+    REQUIRE(expr() == 0.7 / 0.3 / 1.9);
+
+    REQUIRE(expr("x*z/y"));
+    REQUIRE(expr() == 0.7 * 1.9 / 0.3);
+
+    REQUIRE(expr("1/y + x/y/y"));
+    REQUIRE(expr() == Approx(1.0/0.3 + 0.7/0.3/0.3));
+
+    expr["y"] = 0.0;
+    REQUIRE(expr("x/y"));
+    REQUIRE(std::isinf(expr()));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test inlined functions")
+{
+    ExprJIT expr;
+    expr["x"] = 0.0;
+    expr["y"] = 0.0;
+
+    REQUIRE(expr("sqrt(x) + abs(y)"));
+    expr["x"] = 2.0;
+    expr["y"] = -3.5;
+    REQUIRE(expr() == std::sqrt(2.0) + 3.5);
+
+    REQUIRE(expr("min(x, y) * max(x, y)"));
+    REQUIRE(expr() == -3.5 * 2.0);
+
+    REQUIRE(expr("clamp(x, y, 1)"));
+    REQUIRE(expr() == 1.0);
+    expr["x"] = -5.0;
+    REQUIRE(expr() == -3.5);
+    expr["x"] = 0.25;
+    REQUIRE(expr() == 0.25);
+
+    REQUIRE(expr("abs(x)"));
+    expr["x"] = -0.0;
+    REQUIRE(!std::signbit(expr()));
+
+    const double values[] = { -2.5, -1.5, -0.5, -0.49999999999999994, -0.3, 0.0,
+                              0.3, 0.49999999999999994, 0.5, 1.5, 2.5, 2.7,
+                              4503599627370497.0, -4503599627370497.0 };
+
+    REQUIRE(expr("floor(x)"));
+    for (double v : values) {
+        expr["x"] = v;
+        REQUIRE(expr() == std::floor(v));
+    }
+
+    REQUIRE(expr("ceil(x)"));
+    for (double v : values) {
+        expr["x"] = v;
+        REQUIRE(expr() == std::ceil(v));
+    }
+
+    // Halfway cases are rounded away from zero.
+    REQUIRE(expr("round(x)"));
+    for (double v : values) {
+        expr["x"] = v;
+        REQUIRE(expr() == std::round(v));
+        REQUIRE(std::signbit(expr()) == std::signbit(std::round(v)));
+    }
+
+    // Arguments are not modified.
+    expr["x"] = -1.5;
+    REQUIRE(expr("round(x) + floor(x) + ceil(x) + abs(x) + x"));
+    REQUIRE(expr() == -2.0 - 2.0 - 1.0 + 1.5 - 1.5);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test function arguments")
+{
+    ExprJIT expr;
+    expr["x"] = 3.0;
+    expr["y"] = 0.5;
+    expr["pi"] = 3.141592653589793;
+    expr["func3"] = func3;
+
+    REQUIRE(expr("max(x*y, 2)"));
+    REQUIRE(expr() == 2.0);
+
+    REQUIRE(expr("sin(pi/4)*2"));
+    REQUIRE(expr() == Approx(std::sqrt(2.0)));
+
+    REQUIRE(expr("func3(x - 1, y*4, 2 + 2*y - 1)"));
+    REQUIRE(expr() == Approx(func3(2.0, 2.0, 2.0)));
+
+    REQUIRE(expr("min(max(x, y + 1), (x + y)/2)"));
+    REQUIRE(expr() == 1.75);
+
+    REQUIRE_FALSE(expr("func3(x, y, x, y)"));
+    REQUIRE(expr.error().find("Too many arguments") != std::string::npos);
+
+    REQUIRE_FALSE(expr("max(x, y"));
+    REQUIRE_FALSE(expr("max(x)"));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test constant folding")
+{
+    ExprJIT expr;
+    expr["x"] = 0.7;
+
+    REQUIRE(expr("2*x*3/4"));
+    REQUIRE(expr() == 0.7 * (2.0*3.0/4.0));
+
+    REQUIRE(expr("1 + x + 2 - 3 - x"));
+    REQUIRE(expr() == 0.0);
+
+    REQUIRE(expr("x*(2 - 1 - 1)"));
+    REQUIRE(expr() == 0.0);
+
+    REQUIRE(expr("sqrt(4)*x + max(1, 2)"));
+    REQUIRE(expr() == 2.0*0.7 + 2.0);
+
+    REQUIRE(expr("-(0)"));
+    REQUIRE(std::signbit(expr()));
+
+    REQUIRE(expr("-x"));
+    REQUIRE(expr() == -0.7);
+}
+
+//----------------------------------------------------------
+
+static int ticks = 0;
+
+static ExprJIT::Real tick(ExprJIT::Real x)
+{
+    return x + ++ticks;
+}
+
+TEST_CASE("Test constant folding of user functions")
+{
+    ExprJIT expr;
+    expr["x"] = 0.5;
+    expr["f"] = tick;
+
+    // User functions are called on every evaluation.
+    ticks = 0;
+    REQUIRE(expr("f(1) + x"));
+    REQUIRE(ticks == 0);
+    REQUIRE(expr() == 2.5);
+    REQUIRE(expr() == 3.5);
+
+    // Unless marked as pure.
+    expr.setPure("f");
+    REQUIRE(expr("f(1) + x"));
+    REQUIRE(ticks == 3);
+    REQUIRE(expr() == 4.5);
+    REQUIRE(expr() == 4.5);
+    REQUIRE(ticks == 3);
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test named constants")
+{
+    ExprJIT expr;
+    expr["x"] = 0.5;
+
+    // Standard constants are folded.
+    REQUIRE(expr("sin(pi/4)*e + cos(pi/6)/sqrt(2)"));
+    REQUIRE(expr.compileStatistics().nodes == 1);
+    REQUIRE(expr() == Approx(std::sin(3.141592653589793/4)*std::exp(1.0) + std::cos(3.141592653589793/6)/std::sqrt(2.0)));
+
+    REQUIRE(expr("-inf < x && x < inf"));
+    REQUIRE(expr() == 1.0);
+
+    expr.setConstant("g", 9.81);
+    expr.setConstant("x", 2.0);
+    REQUIRE(expr("g*x*x/2"));
+    REQUIRE(expr.compileStatistics().nodes == 1);
+    REQUIRE(expr() == Approx(9.81*2.0));
+
+    // Constants are used by the next compilations only.
+    expr.setConstant("g", 1.62);
+    REQUIRE(expr() == Approx(9.81*2.0));
+    REQUIRE(expr("g"));
+    REQUIRE(expr() == 1.62);
+
+    // Variables hide the standard constants.
+    expr["e"] = 3.0;
+    REQUIRE(expr("e"));
+    REQUIRE(expr() == 3.0);
+
+    // Batch columns hide the constants.
+    REQUIRE(expr.compileBatch("g*x", { "x" }));
+    const double x[] = { 1.0, 2.0 };
+    const double *columns[] = { x };
+    double out[2] = {};
+    expr.evalBatch(columns, out, 2);
+    REQUIRE(out[0] == Approx(1.62));
+    REQUIRE(out[1] == Approx(3.24));
+}
+
+//----------------------------------------------------------
+
+static int countedCalls = 0;
+
+ExprJIT::Real counted(ExprJIT::Real x)
+{
+    countedCalls++;
+    return std::sin(x);
+}
+
+TEST_CASE("Test common subexpressions")
+{
+    const double x = 0.7;
+    const double y = 1.3;
+
+    ExprJIT expr;
+    expr["x"] = x;
+    expr["y"] = y;
+    expr["f"] = counted;
+
+    REQUIRE(expr("x*x/y/y + x*x*x/y/y/y"));
+    REQUIRE(expr() == x*x/y/y + x*x*x/y/y/y);
+
+    // Repeated calls of the functions which are not pure are all made.
+    REQUIRE(expr("f(x) + f(x)"));
+    countedCalls = 0;
+    REQUIRE(expr() == Approx(2*std::sin(x)));
+    REQUIRE(countedCalls == 2);
+
+    // Repeated calls of the pure ones are evaluated once.
+    expr.setPure("f");
+    REQUIRE(expr("f(x)*f(x) + f(x)/(1 + f(x*y)) - f(y*x)"));
+    countedCalls = 0;
+    const double s = std::sin(x);
+    const double sxy = std::sin(x*y);
+    REQUIRE(expr() == Approx(s*s + s/(1 + sxy) - sxy));
+    REQUIRE(countedCalls == 2);
+
+    // Shared values survive the registers pressure.
+    REQUIRE(expr("(x + y)*(x - y) + sqrt(x + y)*(x - y)/(x*y + 1) + "
+                 "(x*y + 1)*(x + y) - sqrt(x*y + 1)/(x - y) + "
+                 "(x + y)/(x*y + 1)*(sqrt(x + y) - (x - y))"));
+    const double a = x + y;
+    const double b = x - y;
+    const double c = x*y + 1;
+    REQUIRE(expr() == Approx(a*b + std::sqrt(a)*b/c + c*a - std::sqrt(c)/b + a/c*(std::sqrt(a) - b)));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test power operator")
+{
+    ExprJIT expr;
+    const double x = 1.7;
+    expr["x"] = x;
+    expr["y"] = 2.5;
+
+    REQUIRE(expr("2^10"));
+    REQUIRE(expr() == 1024.0);
+
+    REQUIRE(expr("2**3**2"));
+    REQUIRE(expr() == 512.0);
+
+    REQUIRE(expr("-2^2"));
+    REQUIRE(expr() == -4.0);
+
+    REQUIRE(expr("2*x^2*3"));
+    REQUIRE(expr() == Approx(6.0*x*x));
+
+    REQUIRE(expr("x^y"));
+    REQUIRE(expr() == std::pow(x, 2.5));
+
+    REQUIRE(expr("x**(y - 0.5)"));
+    REQUIRE(expr() == Approx(x*x));
+
+    // Constant exponents are strength-reduced.
+    for (int n = -33; n <= 33; n++) {
+        REQUIRE(expr("x^" + std::to_string(n)));
+        REQUIRE(expr() == Approx(std::pow(x, n)));
+        REQUIRE(expr("pow(x, " + std::to_string(n) + ")"));
+        REQUIRE(expr() == Approx(std::pow(x, n)));
+    }
+
+    REQUIRE(expr("x^0.5"));
+    REQUIRE(expr() == std::sqrt(x));
+
+    REQUIRE(expr("x^(-1/2)"));
+    REQUIRE(expr() == 1.0/std::sqrt(x));
+
+    REQUIRE(expr("x^1.25"));
+    REQUIRE(expr() == std::pow(x, 1.25));
+
+    expr["x"] = -3.0;
+    REQUIRE(expr("x^3 + x^2"));
+    REQUIRE(expr() == -27.0 + 9.0);
+
+    REQUIRE_FALSE(expr("x^"));
+    REQUIRE_FALSE(expr("x***2"));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test comparison and logical operators")
+{
+    ExprJIT expr;
+    expr["x"] = 2.0;
+    expr["y"] = 3.0;
+
+    REQUIRE(expr("x < y"));
+    REQUIRE(expr() == 1.0);
+    REQUIRE(expr("x > y"));
+    REQUIRE(expr() == 0.0);
+    REQUIRE(expr("x <= 2"));
+    REQUIRE(expr() == 1.0);
+    REQUIRE(expr("x >= y - 1"));
+    REQUIRE(expr() == 1.0);
+    REQUIRE(expr("x == 2"));
+    REQUIRE(expr() == 1.0);
+    REQUIRE(expr("x != 2"));
+    REQUIRE(expr() == 0.0);
+
+    REQUIRE(expr("x < y && y < 4"));
+    REQUIRE(expr() == 1.0);
+    REQUIRE(expr("x > y || y > 4"));
+    REQUIRE(expr() == 0.0);
+    REQUIRE(expr("!(x > y) && !0"));
+    REQUIRE(expr() == 1.0);
+    REQUIRE(expr("x && y*0"));
+    REQUIRE(expr() == 0.0);
+    REQUIRE(expr("1 + (x < y)*10"));
+    REQUIRE(expr() == 11.0);
+
+    // Precedence: arithmetic, relational, equality, and, or.
+    REQUIRE(expr("x + 1 == y && 0 || x < y == 1"));
+    REQUIRE(expr() == 1.0);
+
+    // NaN compares false, except for !=.
+    expr["y"] = std::nan("");
+    REQUIRE(expr("(x < y) + (x <= y) + (x > y) + (x >= y) + (y == y)"));
+    REQUIRE(expr() == 0.0);
+    REQUIRE(expr("y != y"));
+    REQUIRE(expr() == 1.0);
+    REQUIRE(expr("y ? 1 : 2"));
+    REQUIRE(expr() == 1.0);
+
+    REQUIRE_FALSE(expr("x = y"));
+    REQUIRE_FALSE(expr("x & y"));
+    REQUIRE_FALSE(expr("x | y"));
+    REQUIRE_FALSE(expr("x ? y"));
+}
+
+//----------------------------------------------------------
+
+double piecewise(double t)
+{
+    return (t < 0.0) ? -0.1 : ((t < 1.0) ? 0.5*t : 1.0/t);
+}
+
+TEST_CASE("Test conditional operator")
+{
+    ExprJIT expr;
+    expr["t"] = 0.0;
+    expr["a"] = 1.0;
+
+    REQUIRE(expr("t < 0 ? -0.1 : t < 1 ? 0.5*t : 1/t"));
+    for (double t = -2.0; t < 3.0; t += 0.25) {
+        expr["t"] = t;
+        REQUIRE(expr() == piecewise(t));
+    }
+
+    // Conditions which are not comparisons, and equalities
+    REQUIRE(expr("a ? t : -t"));
+    for (double t = -2.0; t < 3.0; t += 0.25) {
+        expr["t"] = t;
+        REQUIRE(expr() == t);
+    }
+
+    REQUIRE(expr("t == 1 ? sin(t) : (t != 2 ? 0 : cos(t))"));
+    for (double t = 0.0; t < 3.0; t += 0.5) {
+        expr["t"] = t;
+        REQUIRE(expr() == (t == 1.0 ? sin(t) : (t != 2.0 ? 0.0 : cos(t))));
+    }
+
+    // NaN is not less than anything.
+    expr["t"] = std::nan("");
+    REQUIRE(expr("t < 1 ? 1 : 2"));
+    REQUIRE(expr() == 2.0);
+    REQUIRE(expr("t >= 1 ? 1 : 2"));
+    REQUIRE(expr() == 2.0);
+
+    REQUIRE(expr("1 < 2 ? t : 3"));
+    REQUIRE(std::isnan(expr()));
+    REQUIRE(expr("(1 > 2 ? t : 3) + 1"));
+    REQUIRE(expr() == 4.0);
+}
+
+//----------------------------------------------------------
+
+static double nested(double x)
+{
+    ExprJIT expr;
+    expr["x"] = x;
+    return expr("x*x + 1") ? expr() : 0.0;
+}
+
+TEST_CASE("Test recompilation")
+{
+    ExprJIT expr;
+    expr["x"] = 2.0;
+    expr["nested"] = nested;
+
+    for (int i = 0; i < 100; i++) {
+        REQUIRE(expr("x*" + std::to_string(i) + " + 1"));
+        REQUIRE(expr() == Approx(2.0*i + 1.0));
+    }
+
+    auto stats = expr.compileStatistics();
+    REQUIRE(stats.nodes == 5);
+    REQUIRE(stats.codeSize > 0);
+    REQUIRE(stats.codegenTime > 0.0);
+
+    // Failed compilation leaves no code.
+    REQUIRE_FALSE(expr("x*"));
+    REQUIRE(expr() == 0.0);
+    REQUIRE(expr.compileStatistics().codeSize == 0);
+    REQUIRE(expr("x - 1"));
+    REQUIRE(expr() == Approx(1.0));
+
+    // Compilation from a function called during the compilation.
+    REQUIRE(expr("nested(3) + nested(x)"));
+    REQUIRE(expr() == Approx(15.0));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test large expressions")
+{
+    ExprJIT expr;
+    expr["x"] = 0.5;
+    expr["y"] = 2.0;
+
+    // Long chains with more shared subexpressions than
+    // the stack frame can hold.
+    const int n = 20000;
+    std::string str = "1";
+    double expected = 1.0;
+    for (int i = 0; i < n; i++) {
+        const int c = i % 1000;
+        if (i % 2 == 0) {
+            str += " + sin(x*" + std::to_string(c) + ")";
+            expected += sin(0.5*c);
+        } else {
+            str += " - y/" + std::to_string(c + 1);
+            expected -= 2.0/(c + 1);
+        }
+    }
+    REQUIRE(expr(str));
+    REQUIRE(expr() == Approx(expected));
+    REQUIRE(expr.compileStatistics().codeSize > 16384);
+
+    expr["y"] = 1.001;
+    str = "x";
+    for (int i = 0; i < n; i++) {
+        str += (i % 2 == 0) ? "*y" : "/y*1.0001";
+    }
+    REQUIRE(expr(str));
+    REQUIRE(expr() == Approx(0.5*pow(1.0001, n/2)));
+
+    REQUIRE(expr.compileProgram(str) != nullptr);
+    REQUIRE(expr.compileBatch(str, { "x" }));
+}
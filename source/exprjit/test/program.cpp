@@ -0,0 +1,224 @@
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+
+
+TEST_CASE("Test program evaluation")
+{
+    ExprJIT expr;
+    expr["x"] = 2.0;
+    expr["y"] = 3.0;
+    expr["z"] = 4.0;
+
+    auto program = expr.compileProgram("x*y + sin(y) - y/x");
+    REQUIRE(program != nullptr);
+    REQUIRE(program->variables() == std::vector<std::string>({ "x", "y" }));
+
+    // Initial values are the ones of the compilation time.
+    ExprJIT::Context context(program);
+    REQUIRE(context.eval() == Approx(6.0 + sin(3.0) - 1.5));
+
+    // Program does not depend on the compiler variables.
+    expr["x"] = 10.0;
+    REQUIRE(context.eval() == Approx(6.0 + sin(3.0) - 1.5));
+
+    REQUIRE(context.set("x", 1.0));
+    REQUIRE_FALSE(context.set("z", 1.0));
+    REQUIRE(context() == Approx(3.0 + sin(3.0) - 3.0));
+
+    context[1] = 5.0;
+    REQUIRE(context() == Approx(5.0 + sin(5.0) - 5.0));
+
+    // Contexts are independent.
+    ExprJIT::Context other(program);
+    REQUIRE(other() == Approx(6.0 + sin(3.0) - 1.5));
+    REQUIRE(context() == Approx(5.0 + sin(5.0) - 5.0));
+
+    // Program outlives the compiler.
+    {
+        ExprJIT tmp;
+        tmp["a"] = 0.5;
+        program = tmp.compileProgram("a < 1 ? a*a : 1/a");
+    }
+    REQUIRE(program != nullptr);
+    ExprJIT::Context c(program);
+    REQUIRE(c() == Approx(0.25));
+    c.set("a", 4.0);
+    REQUIRE(c() == Approx(0.25));
+    c.set("a", 0.1);
+    REQUIRE(c() == Approx(0.01));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test program compilation errors")
+{
+    ExprJIT expr;
+
+    REQUIRE(expr.compileProgram("x + 1") == nullptr);
+    REQUIRE_FALSE(expr.error().empty());
+
+    auto program = expr.compileProgram("2*3");
+    REQUIRE(program != nullptr);
+    REQUIRE(expr.error().empty());
+    REQUIRE(program->variables().empty());
+    REQUIRE(ExprJIT::Context(program).eval() == Approx(6.0));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test concurrent program evaluation")
+{
+    ExprJIT expr;
+    expr["x"] = 0.0;
+    expr["y"] = 0.0;
+
+    const auto program = expr.compileProgram("x*x + y*sqrt(x) - 1");
+    REQUIRE(program != nullptr);
+
+    const size_t threadsCount = 4;
+    const size_t n = 10000;
+    std::vector<std::vector<double>> results(threadsCount, std::vector<double>(n));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadsCount; t++) {
+        threads.emplace_back([&program, &results, t]() {
+            ExprJIT::Context context(program);
+            context.set("y", static_cast<double>(t));
+            for (size_t i = 0; i < n; i++) {
+                context[0] = static_cast<double>(i);
+                results[t][i] = context();
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (size_t t = 0; t < threadsCount; t++) {
+        for (size_t i = 0; i < n; i++) {
+            const double x = static_cast<double>(i);
+            REQUIRE(results[t][i] == Approx(x*x + t*sqrt(x) - 1));
+        }
+    }
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test programs cache")
+{
+    ExprJIT::clearCache();
+    ExprJIT::setCacheCapacity(2);
+
+    ExprJIT expr;
+    expr["x"] = 1.0;
+    expr["y"] = 2.0;
+
+    auto p1 = expr.compileProgram("x*2 + 1");
+    auto stats = ExprJIT::cacheStatistics();
+    REQUIRE(stats.misses == 1);
+    REQUIRE(stats.hits == 0);
+    REQUIRE(stats.size == 1);
+
+    // Same expression once optimized.
+    auto p2 = expr.compileProgram(" 1 + 2.0 * x ");
+    stats = ExprJIT::cacheStatistics();
+    REQUIRE(stats.misses == 1);
+    REQUIRE(stats.hits == 1);
+
+    // Variables are identified by the frame slots, not by their names.
+    ExprJIT other;
+    other["a"] = 5.0;
+    auto p3 = other.compileProgram("a*2 + 1");
+    REQUIRE(ExprJIT::cacheStatistics().hits == 2);
+    REQUIRE(p3->variables() == std::vector<std::string>({ "a" }));
+    REQUIRE(ExprJIT::Context(p3).eval() == Approx(11.0));
+    REQUIRE(ExprJIT::Context(p2).eval() == Approx(3.0));
+
+    // Functions are a part of the key.
+    expr["f"] = static_cast<ExprJIT::Function1Ptr>([](double v) { return v + 10.0; });
+    expr["g"] = static_cast<ExprJIT::Function1Ptr>([](double v) { return v - 10.0; });
+    auto pf = expr.compileProgram("f(x*y)");
+    auto pg = expr.compileProgram("g(x*y)");
+    stats = ExprJIT::cacheStatistics();
+    REQUIRE(stats.misses == 3);
+    REQUIRE(stats.evictions == 1);
+    REQUIRE(stats.size == 2);
+    REQUIRE(ExprJIT::Context(pf).eval() == Approx(12.0));
+    REQUIRE(ExprJIT::Context(pg).eval() == Approx(-8.0));
+
+    // Evicted code is still used by its programs.
+    REQUIRE(ExprJIT::Context(p1).eval() == Approx(3.0));
+    expr.compileProgram("x*2 + 1");
+    REQUIRE(ExprJIT::cacheStatistics().misses == 4);
+
+    ExprJIT::setCacheCapacity(0);
+    expr.compileProgram("x*2 + 1");
+    expr.compileProgram("x*2 + 1");
+    stats = ExprJIT::cacheStatistics();
+    REQUIRE(stats.size == 0);
+    REQUIRE(stats.misses == 6);
+
+    ExprJIT::setCacheCapacity(256);
+    ExprJIT::clearCache();
+    REQUIRE(ExprJIT::cacheStatistics().misses == 0);
+    REQUIRE(ExprJIT::cacheStatistics().capacity == 256);
+}
+
+//----------------------------------------------------------
+
+static double plusTen(double x) { return x + 10.0; }
+static double minusTen(double x) { return x - 10.0; }
+
+TEST_CASE("Test programs cache directory")
+{
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() / "exprjit_test_cache";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    ExprJIT::clearCache();
+    ExprJIT::setCacheDirectory(dir.string());
+
+    ExprJIT expr;
+    expr["x"] = 2.0;
+    expr["f"] = plusTen;
+    REQUIRE(expr.compileProgram("f(x*x) + floor(x/3)") != nullptr);
+    REQUIRE(ExprJIT::cacheStatistics().stores == 1);
+    REQUIRE(std::distance(fs::directory_iterator(dir), fs::directory_iterator()) == 1);
+
+    // Loaded code calls the functions of the same names.
+    ExprJIT::clearCache();
+    ExprJIT other;
+    other["a"] = 3.0;
+    other["f"] = minusTen;
+    auto program = other.compileProgram("f(a*a) + floor(a/3)");
+    REQUIRE(program != nullptr);
+    auto stats = ExprJIT::cacheStatistics();
+    REQUIRE(stats.loads == 1);
+    REQUIRE(stats.stores == 0);
+    REQUIRE(ExprJIT::Context(program).eval() == Approx(0.0));
+
+    // Other functions names make another key.
+    other["g"] = plusTen;
+    REQUIRE(other.compileProgram("g(a*a) + floor(a/3)") != nullptr);
+    REQUIRE(ExprJIT::cacheStatistics().stores == 1);
+
+    // Invalid files are ignored.
+    for (const auto &entry : fs::directory_iterator(dir)) {
+        fs::resize_file(entry.path(), fs::file_size(entry.path()) / 2);
+    }
+    ExprJIT::clearCache();
+    program = expr.compileProgram("f(x*x) + floor(x/3)");
+    stats = ExprJIT::cacheStatistics();
+    REQUIRE(stats.loads == 0);
+    REQUIRE(stats.stores == 1);
+    REQUIRE(ExprJIT::Context(program).eval() == Approx(14.0));
+
+    ExprJIT::setCacheDirectory("");
+    ExprJIT::clearCache();
+    fs::remove_all(dir);
+}
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+#include "exprjit.h"
+
+
+TEST_CASE("Test specialized variables")
+{
+    ExprJIT expr;
+    expr["pi"] = 3.14159265358979;
+    expr["k"] = 2.0;
+    expr["x"] = 0.5;
+    expr.specialize("pi");
+    expr.specialize("k");
+
+    // Specialized variables are folded as constants.
+    REQUIRE(expr("sin(pi/4)*k + cos(pi/6)/sqrt(k)"));
+    REQUIRE(expr.compileStatistics().nodes == 1);
+    REQUIRE(expr() == Approx(std::sin(3.14159265358979/4)*2.0 + std::cos(3.14159265358979/6)/std::sqrt(2.0)));
+
+    REQUIRE(expr("k*x + pi"));
+    REQUIRE(expr() == Approx(2.0*0.5 + 3.14159265358979));
+    auto deps = expr.dependencies();
+    std::sort(deps.begin(), deps.end());
+    REQUIRE(deps == std::vector<std::string>({ "k", "pi", "x" }));
+
+    // Non-specialized variables are read on every evaluation.
+    expr["x"] = 1.5;
+    REQUIRE(expr() == Approx(2.0*1.5 + 3.14159265358979));
+
+    // Changed specialized variables compile the expression again.
+    expr["k"] = 3.0;
+    REQUIRE(expr() == Approx(3.0*1.5 + 3.14159265358979));
+    expr["k"] = 3.0;
+    expr["x"] = 2.0;
+    REQUIRE(expr() == Approx(3.0*2.0 + 3.14159265358979));
+
+    // Specialization off takes effect on the next compilation.
+    expr.specialize("k", false);
+    REQUIRE(expr("k*x + pi"));
+    expr["k"] = 4.0;
+    REQUIRE(expr() == Approx(4.0*2.0 + 3.14159265358979));
+}
+
+//----------------------------------------------------------
+
+static double half(double x) { return x/2; }
+static double twice(double x) { return x*2; }
+
+TEST_CASE("Test specialized variables after the symbols change")
+{
+    ExprJIT::Environment env;
+    env.set("k", 2.0);
+    env.set("x", 1.0);
+
+    ExprJIT expr(env);
+    expr["f"] = half;
+    expr.specialize("k");
+    REQUIRE(expr("f(k) + x"));
+    REQUIRE(expr() == Approx(2.0));
+
+    // Symbols defined since the compilation do not change the expression
+    // compiled again for the new values of the specialized variables.
+    expr.setConstant("k", 100.0);
+    expr["f"] = twice;
+    expr.specialize("k", false);
+    env.set("k", 6.0);
+    REQUIRE(expr() == Approx(4.0));
+    REQUIRE(expr.compileStatistics().nodes == 4);
+
+    // Nor does another object of the same environment.
+    ExprJIT other(env);
+    other.setConstant("x", 0.0);
+    REQUIRE(other("k + x"));
+    env.set("k", 8.0);
+    REQUIRE(expr() == Approx(5.0));
+    REQUIRE(other() == Approx(8.0));
+}
+
+//----------------------------------------------------------
+
+TEST_CASE("Test specialized variables in programs")
+{
+    ExprJIT expr;
+    expr["a"] = 2.0;
+    expr.specialize("a");
+
+    // Programs read the specialized variables from their frame.
+    auto program = expr.compileProgram("a*a");
+    REQUIRE(program != nullptr);
+    ExprJIT::Context context(program);
+    REQUIRE(context.set("a", 3.0));
+    REQUIRE(context.eval() == Approx(9.0));
+
+    expr.compileBatch("a + x", { "x" });
+    const double x[] = { 1.0, 2.0 };
+    const double *columns[] = { x };
+    double out[2] = {};
+    expr["a"] = 5.0;
+    expr.evalBatch(columns, out, 2);
+    REQUIRE(out[0] == Approx(6.0));
+    REQUIRE(out[1] == Approx(7.0));
+}
@@ -0,0 +1,438 @@
+/*
+ * Compilation latency and memory benchmark.
+ *
+ * Compiles generated expressions of 10 to 100k terms, and reports as JSON
+ * the compilation phases times, the generated code and the heap bytes,
+ * and the number of evaluations it takes for the compilation to pay off
+ * compared to a bytecode interpreter.
+ *
+ * Usage: exprjit_bench [terms...]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "exprjit.h"
+
+// Minimal time spent measuring each value, in seconds
+constexpr double MEASURE_TIME = 0.2;
+
+// Default corpus sizes, in terms
+const std::vector<size_t> DEFAULT_TERMS = { 10, 100, 1000, 10000, 100000 };
+
+//----------------------------------------------------------
+//  Heap usage
+//----------------------------------------------------------
+
+namespace heap {
+
+// Allocations are prefixed with their size
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+std::atomic<size_t> live(0);
+std::atomic<size_t> peak(0);
+
+void* allocate(size_t size)
+{
+    void *block = std::malloc(size + HEADER_SIZE);
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *static_cast<size_t*>(block) = size;
+
+    const size_t now = live += size;
+    size_t max = peak.load();
+    while (now > max && !peak.compare_exchange_weak(max, now)) {
+    }
+    return static_cast<char*>(block) + HEADER_SIZE;
+}
+
+void release(void *ptr)
+{
+    if (ptr != nullptr) {
+        void *block = static_cast<char*>(ptr) - HEADER_SIZE;
+        live -= *static_cast<size_t*>(block);
+        std::free(block);
+    }
+}
+
+void resetPeak()
+{
+    peak = live.load();
+}
+
+} // namespace heap
+
+void* operator new(size_t size) { return heap::allocate(size); }
+void* operator new[](size_t size) { return heap::allocate(size); }
+void operator delete(void *ptr) noexcept { heap::release(ptr); }
+void operator delete[](void *ptr) noexcept { heap::release(ptr); }
+void operator delete(void *ptr, size_t) noexcept { heap::release(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { heap::release(ptr); }
+
+//----------------------------------------------------------
+//  Reference interpreter
+//----------------------------------------------------------
+
+/**
+ * @brief Stack based bytecode interpreter.
+ *
+ * This is how the expressions are evaluated without a JIT compiler,
+ * the bytecode being built while parsing.
+ */
+struct Interpreter
+{
+    enum class Op : uint8_t
+    {
+        Constant,
+        Variable,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Sin,
+        Cos,
+        Sqrt
+    };
+
+    struct Instruction
+    {
+        Op op;
+        uint32_t variable;
+        double value;
+    };
+
+    std::vector<Instruction> code;
+    mutable std::vector<double> stack;
+
+    void emit(Op op, double value = 0.0, uint32_t variable = 0)
+    {
+        code.push_back(Instruction{ op, variable, value });
+    }
+
+    double eval(const double *variables) const
+    {
+        stack.resize(code.size() + 1);
+        double *top = stack.data();
+        for (const auto &ins : code) {
+            switch (ins.op) {
+            case Op::Constant:  *++top = ins.value; break;
+            case Op::Variable:  *++top = variables[ins.variable]; break;
+            case Op::Add:       top[-1] += top[0]; --top; break;
+            case Op::Sub:       top[-1] -= top[0]; --top; break;
+            case Op::Mul:       top[-1] *= top[0]; --top; break;
+            case Op::Div:       top[-1] /= top[0]; --top; break;
+            case Op::Sin:       *top = std::sin(*top); break;
+            case Op::Cos:       *top = std::cos(*top); break;
+            case Op::Sqrt:      *top = std::sqrt(*top); break;
+            }
+        }
+        return *top;
+    }
+};
+
+//----------------------------------------------------------
+//  Corpus
+//----------------------------------------------------------
+
+const char* const VARIABLES[] = { "x", "y", "z", "w" };
+const double VALUES[] = { 0.7, 1.3, 0.4, 1.1 };
+
+/**
+ * @brief Generated expression and its bytecode.
+ */
+struct Corpus
+{
+    std::string expression;
+    Interpreter interpreter;
+
+    Corpus(size_t terms, uint32_t seed)
+        : expression(),
+          interpreter()
+    {
+        std::mt19937 rng(seed);
+        std::ostringstream ss;
+        for (size_t i = 0; i < terms; i++) {
+            const bool sub = (rng() % 2 == 0);
+            if (i > 0) {
+                ss << (sub ? " - " : " + ");
+            }
+            term(ss, rng);
+            if (i > 0) {
+                interpreter.emit(sub ? Interpreter::Op::Sub : Interpreter::Op::Add);
+            }
+        }
+        expression = ss.str();
+    }
+
+private:
+
+    using Op = Interpreter::Op;
+
+    void term(std::ostream &ss, std::mt19937 &rng)
+    {
+        const uint32_t a = rng() % 4;
+        const uint32_t b = rng() % 4;
+        // Constants of two decimals are parsed exactly as computed.
+        const double c = (1 + rng() % 999) / 100.0;
+
+        switch (rng() % 6) {
+        case 0:
+            ss << c << "*" << VARIABLES[a];
+            constant(c);
+            variable(a);
+            interpreter.emit(Op::Mul);
+            break;
+        case 1:
+            ss << VARIABLES[a] << "*" << VARIABLES[b];
+            variable(a);
+            variable(b);
+            interpreter.emit(Op::Mul);
+            break;
+        case 2:
+            ss << "sin(" << VARIABLES[a] << ")";
+            variable(a);
+            interpreter.emit(Op::Sin);
+            break;
+        case 3:
+            ss << "cos(" << c << "*" << VARIABLES[a] << ")";
+            constant(c);
+            variable(a);
+            interpreter.emit(Op::Mul);
+            interpreter.emit(Op::Cos);
+            break;
+        case 4:
+            ss << "sqrt(" << VARIABLES[a] << "*" << VARIABLES[a] << " + " << c << ")";
+            variable(a);
+            variable(a);
+            interpreter.emit(Op::Mul);
+            constant(c);
+            interpreter.emit(Op::Add);
+            interpreter.emit(Op::Sqrt);
+            break;
+        default:
+            ss << "(" << VARIABLES[a] << " - " << c << ")/(" << VARIABLES[b] << " + " << c << ")";
+            variable(a);
+            constant(c);
+            interpreter.emit(Op::Sub);
+            variable(b);
+            constant(c);
+            interpreter.emit(Op::Add);
+            interpreter.emit(Op::Div);
+            break;
+        }
+    }
+
+    void constant(double value)
+    {
+        interpreter.emit(Op::Constant, value);
+    }
+
+    void variable(uint32_t index)
+    {
+        interpreter.emit(Op::Variable, 0.0, index);
+    }
+};
+
+//----------------------------------------------------------
+//  Measurements
+//----------------------------------------------------------
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Average time of a function call, in seconds.
+ */
+template <typename F>
+double measure(F &&func)
+{
+    size_t calls = 0;
+    size_t batch = 1;
+    const auto start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < MEASURE_TIME) {
+        for (size_t i = 0; i < batch; i++) {
+            func();
+        }
+        calls += batch;
+        batch *= 2;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return elapsed / calls;
+}
+
+struct Result
+{
+    size_t terms = 0;
+    size_t length = 0;
+    bool compiled = false;
+    std::string error;
+    ExprJIT::CompileStatistics statistics;  ///< Of the fastest compilation.
+    double compileTime = 0.0;               ///< Fastest compilation, in seconds.
+    size_t heapPeak = 0;                    ///< Heap used during the compilation.
+    size_t heapRetained = 0;                ///< Heap kept by the compiled expression.
+    double jitTime = 0.0;
+    double interpreterTime = 0.0;
+    double relativeError = 0.0;
+};
+
+Result run(size_t terms)
+{
+    Result result;
+    result.terms = terms;
+
+    const Corpus corpus(terms, static_cast<uint32_t>(terms));
+    result.length = corpus.expression.size();
+
+    ExprJIT expr;
+    for (size_t i = 0; i < 4; i++) {
+        expr[VARIABLES[i]] = VALUES[i];
+    }
+
+    // Compiler buffers are allocated by the first compilation.
+    expr("0");
+    const size_t heapBefore = heap::live.load();
+    heap::resetPeak();
+
+    try {
+        result.compiled = expr(corpus.expression);
+        result.heapPeak = heap::peak.load() - heapBefore;
+        result.heapRetained = (heap::live.load() > heapBefore) ? heap::live.load() - heapBefore : 0;
+        if (!result.compiled) {
+            result.error = expr.error();
+            return result;
+        }
+
+        result.compileTime = std::numeric_limits<double>::max();
+        const auto start = Clock::now();
+        do {
+            const auto compileStart = Clock::now();
+            expr(corpus.expression);
+            const double time = std::chrono::duration<double>(Clock::now() - compileStart).count();
+            if (time < result.compileTime) {
+                result.compileTime = time;
+                result.statistics = expr.compileStatistics();
+            }
+        } while (std::chrono::duration<double>(Clock::now() - start).count() < MEASURE_TIME);
+    } catch (const std::exception &e) {
+        result.compiled = false;
+        result.error = e.what();
+        result.heapPeak = heap::peak.load() - heapBefore;
+        return result;
+    }
+
+    double sink = 0.0;
+    result.jitTime = measure([&]() { sink += expr(); });
+    result.interpreterTime = measure([&]() { sink += corpus.interpreter.eval(VALUES); });
+
+    const double expected = corpus.interpreter.eval(VALUES);
+    result.relativeError = std::fabs(expr() - expected) / std::max(1.0, std::fabs(expected));
+    return result;
+}
+
+//----------------------------------------------------------
+//  JSON output
+//----------------------------------------------------------
+
+std::string quoted(const std::string &str)
+{
+    std::ostringstream ss;
+    ss << '"';
+    for (const char c : str) {
+        if (c == '"' || c == '\\') {
+            ss << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+        } else {
+            ss << c;
+        }
+    }
+    ss << '"';
+    return ss.str();
+}
+
+void write(std::ostream &out, const Result &r)
+{
+    out << "    {\n"
+        << "      \"terms\": " << r.terms << ",\n"
+        << "      \"length\": " << r.length << ",\n"
+        << "      \"compiled\": " << (r.compiled ? "true" : "false") << ",\n";
+
+    if (!r.compiled) {
+        out << "      \"error\": " << quoted(r.error) << ",\n"
+            << "      \"heap_peak_bytes\": " << r.heapPeak << "\n"
+            << "    }";
+        return;
+    }
+
+    // Evaluations it takes for the compilation to be paid off
+    const double gain = r.interpreterTime - r.jitTime;
+    std::ostringstream breakEven;
+    if (gain > 0.0) {
+        breakEven << std::ceil(r.compileTime / gain);
+    } else {
+        breakEven << "null";
+    }
+
+    const auto &s = r.statistics;
+    out << "      \"nodes\": " << s.nodes << ",\n"
+        << "      \"compile_seconds\": {\n"
+        << "        \"total\": " << r.compileTime << ",\n"
+        << "        \"parse\": " << s.parseTime << ",\n"
+        << "        \"optimize\": " << s.optimizeTime << ",\n"
+        << "        \"lowering\": " << s.loweringTime << ",\n"
+        << "        \"codegen\": " << s.codegenTime << "\n"
+        << "      },\n"
+        << "      \"code_bytes\": " << s.codeSize << ",\n"
+        << "      \"heap_peak_bytes\": " << r.heapPeak << ",\n"
+        << "      \"heap_retained_bytes\": " << r.heapRetained << ",\n"
+        << "      \"eval_seconds\": {\n"
+        << "        \"jit\": " << r.jitTime << ",\n"
+        << "        \"interpreter\": " << r.interpreterTime << "\n"
+        << "      },\n"
+        << "      \"break_even_evals\": " << breakEven.str() << ",\n"
+        << "      \"relative_error\": " << r.relativeError << "\n"
+        << "    }";
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<size_t> terms;
+    for (int i = 1; i < argc; i++) {
+        const long long n = std::atoll(argv[i]);
+        if (n <= 0) {
+            std::cerr << "Usage: " << argv[0] << " [terms...]\n";
+            return 1;
+        }
+        terms.push_back(static_cast<size_t>(n));
+    }
+    if (terms.empty()) {
+        terms = DEFAULT_TERMS;
+    }
+
+    std::cout << std::setprecision(6)
+              << "{\n"
+              << "  \"benchmark\": \"compile\",\n"
+              << "  \"results\": [\n";
+    for (size_t i = 0; i < terms.size(); i++) {
+        write(std::cout, run(terms[i]));
+        std::cout << (i + 1 < terms.size() ? ",\n" : "\n") << std::flush;
+    }
+    std::cout << "  ]\n"
+              << "}\n";
+
+    return 0;
+}